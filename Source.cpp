@@ -1,7 +1,23 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <string>           // uniform names
+#include <unordered_map>    // uniform reflection tables, program cache
+#include <vector>
+#include <algorithm>        // sort
+#include <cstdint>          // uint64_t
+#include <cstddef>          // offsetof
+#include <cfloat>           // FLT_MAX
+#include <chrono>           // CPU submit timing
+#include <random>           // stress scene placement
+#include <memory>           // unique_ptr
+#include <mutex>            // texture decode results
+#include <atomic>           // texture cache counters
+#include <cstring>          // memcpy
+#include <fstream>          // timing output
+#include <sstream>          // timing JSON
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
+#include "imagedecoder.h"   // Decoder backends behind one interface, before stb_image's implementation includes it again
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"      // Image loading Utility functions
 
@@ -11,6 +27,23 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "camera.h" // Camera class
+#include "meshprocessing.h" // Vertex welding and cache optimization
+#include "culling.h" // Frustum culling
+#include "bvh.h" // Ray queries
+#include "normalmatrix.h" // Per-object normal matrices
+#include "threadpool.h" // Worker threads for texture decoding
+#include "mappedfile.h" // Memory mapped cooked textures
+#include "texturecache.h" // Cooked texture format and mip chains
+#include "blockcompression.h" // BC1/BC3 texture encoding
+#include "gpuresources.h" // Ownership and memory accounting of GL objects
+#include "imagekernels.h" // SIMD image conversion, analysis and downsampling
+#include "mipgenerator.h" // Multithreaded filtered mip chains
+#include "profiler.h" // CPU and GPU frame scopes, Chrome trace export
+#include "headless.h" // EGL / OSMesa contexts without a window
+#include "frametiming.h" // Frame time percentiles
+#include "inputrecording.h" // Input logs for reproducible runs
+#include "flythrough.h" // Spline camera paths for benchmarks
+#include "framepacing.h" // Frame limiter, frame time smoothing, present latency
 
 using namespace std; // Standard namespace
 
@@ -28,34 +61,450 @@ namespace
     const int WINDOW_WIDTH = 1024;
     const int WINDOW_HEIGHT = 756;
 
-    // Stores the GL data relative to a given mesh
+    // Frames a headless run draws when --frames does not say
+    const uint32_t HEADLESS_DEFAULT_FRAMES = 300;
+
+    // Vertex layouts a mesh can be stored in. Each has its own vertex buffer and VAO in the scene.
+    enum VertexFormat
+    {
+        FLOAT_VERTICES,     // 32 bytes: float position, normal and texture coordinate
+        COMPACT_VERTICES,   // 16 bytes: see CompactVertex
+        VERTEX_FORMAT_COUNT
+    };
+
+    // When meshes are stored as CompactVertex (--vertex-format)
+    enum CompactVertexMode
+    {
+        COMPACT_AUTO,       // Meshes of at least COMPACT_MIN_VERTICES that stay within the tolerances below
+        COMPACT_NEVER,
+        COMPACT_ALWAYS      // Every mesh that stays within the tolerances
+    };
+
+    // How textures are block compressed when they are cooked (--texture-compression)
+    enum TextureCompressionMode
+    {
+        COMPRESSION_AUTO,   // High quality when the result is cached, fast when textures are cooked on every run
+        COMPRESSION_OFF,
+        COMPRESSION_FAST,
+        COMPRESSION_HIGH
+    };
+
+    // How buffer swaps wait for vertical blank (--vsync)
+    enum VsyncMode
+    {
+        VSYNC_ON,
+        VSYNC_OFF,
+        VSYNC_ADAPTIVE      // Waits for frames that are on time and tears late ones, where EXT_swap_control_tear is supported
+    };
+
+    const char* const VSYNC_MODE_NAMES[] = { "on", "off", "adaptive" };
+
+    // Quantization limits; a mesh that exceeds any of them keeps float vertices
+    const GLuint COMPACT_MIN_VERTICES = 1024;
+    const float COMPACT_POSITION_TOLERANCE = 1e-4f;    // Scene units; the authored meshes use 1e-4 offsets against z-fighting
+    const float COMPACT_NORMAL_TOLERANCE = 0.5f;       // Degrees
+    const float COMPACT_UV_TOLERANCE = 1.0f / 16384.0f;
+
+    // Stores the ranges a mesh occupies in the scene's shared vertex and index buffers
     struct GLMesh
     {
-        GLuint vao, vao2, vao3, vao4, vao5;         // Handle for the vertex array object
-        GLuint vbo, vbo2, vbo3, vbo4, vbo5;         // Handle for the vertex buffer object
-        GLuint nVertices, nVertices2, nVertices3, nVertices4, nVertices5;    // Number of indices of the mesh
+        GLuint firstIndex;  // First index of the mesh in the shared index buffer
+        GLuint nIndices;    // Number of indices of the mesh
+        GLint baseVertex;   // First vertex of the mesh in its format's vertex buffer; indices are relative to it
+        GLuint nVertices;   // Number of (welded) vertices of the mesh
+        glm::vec3 center;   // Center of the mesh bounds in model space, used for depth sorting
+        glm::vec3 extent;   // Half size of the bounding box around center
+        float radius;       // Bounding sphere around center
+
+        // Vertex layout and how to turn its attributes back into model space (identity for floats)
+        VertexFormat format;
+        glm::vec3 positionOffset;
+        glm::vec3 positionScale;
+        glm::vec4 uvTransform;  // xy offset, zw scale
+    };
+
+    // Model space triangles of a mesh and the BVH over them, kept on the CPU for ray queries
+    struct PickMesh
+    {
+        std::vector<float> positions;   // x, y, z per welded vertex
+        std::vector<uint32_t> indices;
+        Bvh bvh;
+    };
+
+    // Closest hit of a ray cast into the scene
+    struct RayHit
+    {
+        uint32_t object;
+        uint32_t instance;
+        uint32_t triangle;  // Index of the triangle within the object's mesh
+        float distance;     // Along the ray, in units of its direction's length
+    };
+
+    // Vertex and index data gathered on the CPU before the scene's buffers are created
+    struct MeshData
+    {
+        std::vector<GLfloat> floatVertices;
+        std::vector<CompactVertex> compactVertices;
+        std::vector<GLuint> indices;
+    };
+
+    // Settings taken from the command line
+    struct Options
+    {
+        CompactVertexMode compactVertices = COMPACT_AUTO;
+        uint32_t stressDice = 0;    // When non zero, the dice is drawn this many times scattered over the table
+        uint32_t benchBvhTriangles = 0; // When non zero, time BVH build, refit and ray queries on this many triangles and exit
+        uint32_t benchVertexTriangles = 0; // When non zero, time the vertex shaders on a sphere of this many triangles and exit
+        bool syncTextures = false;          // Decode and upload every texture on the main thread before the first frame
+        uint32_t syntheticTextures = 0;     // Extra textures loaded (not drawn) to measure loading at scale
+        bool textureCache = true;           // Load cooked textures from TEXTURE_CACHE_DIR, cooking the missing ones
+        bool benchTextures = false;         // Time cold and warm loads of the scene's textures and exit
+        TextureCompressionMode textureCompression = COMPRESSION_AUTO;
+        bool benchCompression = false;      // Compress the scene's textures, report quality, size and speed and exit
+        bool textureStreaming = true;       // Stream texture array mips by screen footprint instead of loading them all
+        uint32_t textureBudgetMB = 256;     // Texture array memory the streamed levels have to fit in
+        bool srgbTextures = false;          // Treat texture colors as sRGB and light in linear space
+        bool benchImageKernels = false;     // Time the scalar and SIMD image kernels on the scene's textures and exit
+        ImageFilter mipFilter = FILTER_KAISER;  // Filter cooked mip levels are built with
+        float alphaCoverage = 0.0f;         // When non zero, mip alpha keeps the share of texels reaching this cutoff
+        bool benchMips = false;             // Time mip chain generation per filter and level on the scene's textures and exit
+        bool stbDecoderOnly = false;        // Decode every image with stb_image even when faster decoders are compiled in
+        uint32_t benchDecodeRepeats = 0;    // When non zero, decode the shipped images this many times with every decoder and exit
+        std::string profileTrace = "profile.json";  // Chrome trace written on P and, with --profile-trace, at exit
+        bool profileAtExit = false;
+        bool headless = false;              // Render into a framebuffer object of an EGL or OSMesa context, with no window
+        int width = WINDOW_WIDTH;           // Size of the window, or of the headless framebuffer
+        int height = WINDOW_HEIGHT;
+        uint32_t frames = 0;                // When non zero, exit after drawing this many frames and report their times
+        std::string timingOutput;           // When set, the frame time report and every frame time are written here as JSON
+        std::string recordInput;            // When set, every key, cursor and scroll event and frame step is logged here
+        std::string replayInput;            // When set, input comes from this log instead of the window
+        float replayTimestep = 1.0f / 60.0f;    // Camera step of every replayed frame, or 0 for the recorded steps
+        bool frameHash = false;             // Read every frame back and report a hash of all of them
+        std::string flythrough;             // When set, fly the camera along every path in this file and report frame times per segment
+        VsyncMode vsync = VSYNC_ON;
+        double fpsLimit = 0.0;              // When non zero, frames are held to this rate by sleeping and then spinning
+        uint32_t frameSmoothing = 0;        // When non zero, the camera moves by the mean time of this many frames
+    };
+
+    // Stores a linked shader program and every uniform handle resolved right after linking,
+    // so the render loop never has to look a uniform up by name
+    struct GLProgram
+    {
+        GpuProgram id;
+
+        // Handles for the uniforms shared by the scene shaders (-1 when the program does not use them)
+        GLint model = -1;
+        GLint normalMatrix = -1;
+        GLint view = -1;
+        GLint projection = -1;
+        GLint objectColor = -1;
+        GLint lightColor = -1;
+        GLint lightPos = -1;
+        GLint viewPosition = -1;
+        GLint uvScale = -1;
+        GLint positionOffset = -1;
+        GLint positionScale = -1;
+        GLint uvTransform = -1;
+        GLint textureLayer = -1;
+        GLint textureMinLod = -1;
+        GLint texture = -1;         // First active sampler2D or sampler2DArray, whatever the shader named it
+
+        // Every active uniform (location) and uniform block (index) keyed by name
+        std::unordered_map<std::string, GLint> uniforms;
+        std::unordered_map<std::string, GLuint> blocks;
+    };
+
+    // Everything an object needs to be shaded: its program variant, texture array layer and UV tiling
+    struct GLMaterial
+    {
+        const GLProgram* program;
+        const GLProgram* multiDrawProgram;  // Variant fed from shader storage, nullptr if the material has none
+        GLuint textureId;       // GL_TEXTURE_2D_ARRAY, or 0 for untextured materials
+        uint32_t textureLayer;
+        glm::vec2 uvScale;
+        uint32_t programKey;    // Small ids for the draw key, shared by materials using the same program / texture
+        uint32_t textureKey;
+    };
+
+    // Scene representation. Objects are stored as parallel (SoA) arrays indexed by object id,
+    // meshes and materials are shared tables the objects refer to by index.
+    struct Scene
+    {
+        // Every mesh lives in one immutable vertex buffer per vertex format, each behind its own VAO,
+        // and one index buffer shared by both
+        GpuVertexArray vaos[VERTEX_FORMAT_COUNT];
+        GpuBuffer vbos[VERTEX_FORMAT_COUNT];
+        GpuBuffer ebo;
+        GLenum indexType;       // GL_UNSIGNED_SHORT when every mesh fits in 16-bit indices
+        GLsizei indexSize;
+        std::vector<GLMesh> meshes;
+        std::vector<GLMaterial> materials;
+
+        std::vector<glm::mat4> transforms;
+        std::vector<uint32_t> meshIds;
+        std::vector<uint32_t> materialIds;
+
+        // Every object owns a range of instance transforms, relative to its own transform. Plain objects
+        // have a single identity instance.
+        std::vector<uint32_t> firstInstances;
+        std::vector<uint32_t> instanceCounts;
+        std::vector<glm::mat4> instanceTransforms;
+
+        // World matrix and normal matrix (three std430 mat3 columns) of every instance, derived from the above
+        std::vector<glm::mat4> instanceModels;
+        std::vector<glm::vec4> instanceNormalMatrices;
+
+        // Distinct programs and textures seen by UAddMaterial; their positions are the draw key ids
+        std::vector<const GLProgram*> programs;
+        std::vector<GLuint> textures;
+
+        // World space bounds of every object, covering all of its instances
+        BoundsSoA bounds;
+
+        // Ray queries go through a BVH over the world space box of every instance, and then through the
+        // model space BVH of the instance's mesh
+        std::vector<PickMesh> pickMeshes;
+        std::vector<BvhBox> instanceBoxes;
+        Bvh instanceBvh;
+
+        // Set when objects or materials change so the shader storage copies get re-uploaded
+        bool dirty;
+        bool materialsDirty;    // Only the material records changed (texture residency)
+        bool matricesDirty;
+        bool boundsDirty;
+        bool bvhRebuild;    // Instances were added
+        bool bvhRefit;      // Instances moved
+    };
+
+    // Per-instance data read by the multi-draw vertex shader (std430 layout of ObjectRecord). Instances
+    // are stored in object order, so an object's records start at its first instance.
+    struct GLObjectRecord
+    {
+        glm::mat4 model;
+        glm::vec4 normalMatrix[3];
+        uint32_t materialId;
+        uint32_t meshId;
+        uint32_t padding[2];
+    };
+
+    // Per-mesh dequantization read by the multi-draw vertex shader (std430 layout of MeshRecord)
+    struct GLMeshRecord
+    {
+        glm::vec4 positionOffset;
+        glm::vec4 positionScale;
+        glm::vec4 uvTransform;
+    };
+
+    // Per-material data read by the multi-draw vertex shader (std430 layout of MaterialRecord)
+    struct GLMaterialRecord
+    {
+        glm::vec4 uvScale;
+        uint32_t textureLayer;
+        float textureMinLod;    // Finest level of the layer that is resident
+        uint32_t padding[2];
+    };
+
+    // One glDrawElementsIndirect command as laid out in the indirect buffer
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
     };
 
-    // Main GLFW window
+    // Buffers backing glMultiDrawElementsIndirect submission
+    struct GLMultiDraw
+    {
+        GpuBuffer objectBuffer;     // GLObjectRecord per instance, shader storage binding 0
+        GpuBuffer materialBuffer;   // GLMaterialRecord per material, shader storage binding 1
+        GpuBuffer meshBuffer;       // GLMeshRecord per mesh, shader storage binding 2
+        GpuBuffer indirectBuffer;   // Commands rebuilt from the sorted draw queue every frame
+        GpuBuffer drawIdBuffer;     // 0, 1, 2, ... read through an instanced attribute so baseInstance selects the first instance
+        GLsizei drawIdCapacity = 0;
+        std::vector<DrawElementsIndirectCommand> commands;
+    };
+
+    // Meshes created by UCreateSceneMeshes, in creation order
+    enum SceneMesh
+    {
+        TABLE_MESH,
+        TABLE_CLOTH_MESH,
+        DICE_MESH,
+        BOX_MESH,
+        CANDLE_MESH
+    };
+
+    // One entry of the per-frame draw queue. The key packs, from the most significant bits down,
+    // program (10 bits), texture (12 bits), vertex format/VAO (1 bit), mesh (13 bits) and view depth
+    // (24 bits) so sorting the queue groups draws by the state that is most expensive to change.
+    struct DrawItem
+    {
+        uint64_t key;
+        uint32_t object;
+
+        bool operator<(const DrawItem& other) const { return key < other.key; }
+    };
+
+    // State changes and draws issued by the last URender call
+    struct RenderStats
+    {
+        unsigned drawCalls;         // glDraw* / glMultiDraw* calls
+        unsigned objectsDrawn;      // Instances, so an instanced object counts every copy
+        unsigned programBinds;
+        unsigned textureBinds;
+        unsigned vaoBinds;
+        CullStats culling;
+    };
+
+    // Main GLFW window, nullptr when headless
     GLFWwindow* gWindow = nullptr;
-    // Triangle mesh data
-    GLMesh gMesh;
+    int gFramebufferWidth = WINDOW_WIDTH, gFramebufferHeight = WINDOW_HEIGHT;
+    std::string gRenderer;
+
+    // Headless runs draw into a framebuffer object of their own, as the context has no default one to show
+    HeadlessContext gHeadless;
+    GpuFramebuffer gHeadlessFramebuffer;
+    GpuRenderbuffer gHeadlessColor, gHeadlessDepth;
+
+    // Time of every frame drawn, for the timing report
+    std::vector<float> gFrameTimesMs;
+    Options gOptions;
+    // Scene objects and the queue they are drawn from
+    Scene gScene;
+    std::vector<DrawItem> gDrawQueue;
+    RenderStats gRenderStats;
+
+    // Submission path, toggled with M, and the CPU time each path spends submitting the queue
+    GLMultiDraw gMultiDraw;
+    bool gUseMultiDraw = true;
+    bool gUseCulling = true;
+    std::vector<uint8_t> gVisible;  // Frustum test result per object this frame
+    double gSubmitSeconds[2] = { 0.0, 0.0 };    // [0] per-object draws, [1] multi-draw indirect
+    unsigned long gSubmitFrames[2] = { 0, 0 };
+    double gFrameSeconds[2] = { 0.0, 0.0 };     // Whole frame time, split the same way
     // Texture
-    GLuint gTextureId;
-    GLuint gTexture2Id;
-    GLuint gTexture3Id;
-    GLuint gTexture4Id;
-    GLuint gTexture5Id;
     glm::vec2 gUVScale(5.0f, 5.0f);
     GLint gTexWrapMode = GL_REPEAT;
 
-    // Shader programs
-    GLuint tableProgramId;
-    GLuint tableClothProgramId;
-    GLuint diceProgramId;
-    GLuint boxProgramId;
-    GLuint candleProgramId;
-    GLuint lightProgramId;
+    // Persistently mapped pixel buffer ring that loaded mip chains are copied into
+    const int PIXEL_BUFFER_SLOT_COUNT = 4;
+    const size_t PIXEL_BUFFER_SLOT_SIZE = 8 * 1024 * 1024;  // Larger chains upload from client memory
+
+    // Cooked textures live next to the executable's working directory, one file per source image
+    const char* const TEXTURE_CACHE_DIR = "texturecache";
+
+    // Set once the context exists; textures are only cooked to S3TC formats when it can sample them
+    bool gTextureCompressionSupported = false;
+
+    // Scene textures are packed by class into one GL_TEXTURE_2D_ARRAY each, every layer resized to
+    // TEXTURE_ARRAY_LAYER_SIZE squared when it is cooked, so all the objects of a class sample through a
+    // single binding and tell their texture apart by layer
+    enum TextureClass
+    {
+        TEXTURE_CLASS_OPAQUE,   // RGB, BC1 when compressed
+        TEXTURE_CLASS_ALPHA,    // RGBA, BC3 when compressed
+        TEXTURE_CLASS_COUNT
+    };
+    const int TEXTURE_ARRAY_LAYER_SIZE = 1024;
+
+    // Every mip level of a texture in its final GL format, either mapped from the cooked texture cache or
+    // cooked from the source image, waiting for the context thread to upload it. The payload sits in
+    // exactly one place: a pixel buffer slot, the mapping of the cooked file, or cookedPayload.
+    struct TextureImage
+    {
+        GLuint textureId = 0;
+        std::string filename;
+        int targetSize = 0;                     // Resize to this square size when cooking, 0 to keep the source's
+        int targetChannels = 0;                 // Convert to this channel count when cooking, 0 to keep the source's
+        int arrayClass = -1;                    // Texture array and layer the image is uploaded into, or -1 for a 2D texture
+        int layer = -1;
+        bool loaded = false;
+        bool cacheHit = false;
+        CookedTextureHeader header = {};
+        std::vector<TextureLevel> levels;
+        std::shared_ptr<MappedFile> mapping;    // Keeps the cooked file mapped until the upload
+        const unsigned char* mappedPayload = nullptr;
+        std::vector<unsigned char> cookedPayload;
+        int slot = -1;                          // Pixel buffer slot holding the payload, or -1
+    };
+
+    // Mip residency of one texture array layer. Levels from residentLevel down to the smallest are on the
+    // GPU; finer ones are uploaded from source when the objects using the layer cover enough pixels to
+    // need them, and dropped again, least recently used layer first, when the budget runs out.
+    struct TextureLayerResidency
+    {
+        TextureImage source;        // Cooked chain kept in client memory (or mapped) once the layer has loaded
+        int residentLevel = 0;
+        int requestedLevel = 0;     // Finest level a visible object asked for this frame
+        uint64_t lastUsedFrame = 0;
+    };
+
+    struct GLTextureArray
+    {
+        GpuTexture id;
+        int channels = 3;
+        std::vector<std::string> layers;    // Source image of every layer, in layer order
+        CookedTextureHeader format = {};    // Internal format, block size and level count every layer is cooked to
+        bool sparse = false;                // Levels are committed per layer, so an evicted level gives its memory back
+        int sparseLevels = 0;               // Levels below this are committed one by one, the rest as the mip tail
+        int tailLevel = 0;                  // Levels from this one down are resident in every layer and never evicted
+        std::vector<TextureLayerResidency> residency;
+    };
+    GLTextureArray gTextureArrays[TEXTURE_CLASS_COUNT];
+
+    // Texture array memory accounting. Without sparse textures every level stays allocated, so the budget
+    // then limits what is uploaded rather than what the driver holds.
+    struct TextureStreaming
+    {
+        uint64_t budgetBytes = 0;
+        uint64_t residentBytes = 0;
+        uint64_t frame = 0;
+        unsigned streamedLevels = 0, evictedLevels = 0;
+    };
+    TextureStreaming gTextureStreaming;
+    const int TEXTURE_STREAM_START_SIZE = 128;      // Layers start with the levels up to this size
+    const double TEXTURE_STREAM_BUDGET_MS = 2.0;    // Streamed uploads per frame stop once they have taken this long
+
+    // Textures are decoded on a thread pool while their GL names already hold a placeholder texel, so the
+    // scene renders from the first frame and each texture swaps in as its upload happens
+    struct TextureLoader
+    {
+        std::unique_ptr<ThreadPool> pool;
+        std::mutex mutex;
+        std::vector<TextureImage> decoded;  // Guarded by mutex
+        unsigned pending = 0;               // Submitted but not uploaded yet, only touched by the context thread
+        std::vector<GpuTexture> syntheticTextures;
+
+        // Slots are handed to workers from freeSlots (guarded by mutex). Once the upload from a slot is
+        // queued, its fence is polled by the context thread, which frees the slot when the GPU is done.
+        GpuBuffer pixelBuffer;
+        unsigned char* pixelBufferMemory = nullptr;
+        GLsync slotFences[PIXEL_BUFFER_SLOT_COUNT] = {};
+        std::vector<int> freeSlots;
+        unsigned ringUploads = 0, clientUploads = 0;
+        std::atomic<unsigned> cacheHits{ 0 }, cacheMisses{ 0 };
+        std::vector<double> mipLevelMs;     // Mip generation time per level over every cook, guarded by mutex
+    };
+    TextureLoader gTextureLoader;
+
+    // Helper threads for cooks the main thread spreads over every core, made by the first one
+    std::unique_ptr<ThreadPool> gCookPool;
+    const double TEXTURE_UPLOAD_BUDGET_MS = 4.0; // Uploads per frame stop once they have taken this long
+
+    // Startup timing, from entering main
+    std::chrono::steady_clock::time_point gStartTime;
+
+    // Shader programs, owned by the program cache; materials sharing a variant share the program
+    const GLProgram* lightProgram = nullptr;
+
+    // Linked programs keyed by a hash of their sources and injected #defines
+    std::unordered_map<uint64_t, GLProgram> gProgramCache;
+
+    // Number of glGetUniformLocation calls made so far; only program creation should move it
+    unsigned long gUniformLookups = 0;
 
     GLUquadricObj* quad;
     
@@ -69,6 +518,28 @@ namespace
     // timing
     float gDeltaTime = 0.0f, gLastFrame = 0.0f;
 
+    // Input log being written and the one being played back. While a replay runs, the window's input is
+    // ignored and the camera moves by gInputDeltaTime, a fixed step, instead of the frame time.
+    InputRecorder gInputRecorder;
+    InputReplay gInputReplay;
+    float gInputDeltaTime = 0.0f;
+    bool gKeysDown[GLFW_KEY_LAST + 1] = {};
+
+    // Paths of --flythrough, the one being flown and its next frame, and the path and segment of every frame drawn
+    std::vector<FlightPath> gFlightPaths;
+    size_t gFlightPath = 0;
+    uint32_t gFlightFrame = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> gFlightSegments;
+
+    // Frame pacing, and the time the input of the frame being drawn was polled
+    FrameLimiter gFrameLimiter;
+    FrameTimeSmoother gFrameSmoother;
+    PresentLatency gPresentLatency;
+    uint64_t gInputPollNs = 0;
+
+    // FNV-1a of the pixels of every frame drawn so far, with --frame-hash
+    uint64_t gFrameHash = 14695981039346656037ull;
+
     // Subject position and scale
     glm::vec3 tablePos(0.0f, 0.0f, 0.0f);
     glm::vec3 tableScale(0.4f);
@@ -81,31 +552,125 @@ namespace
     glm::vec3 gLightPosition(0.0f, 0.9f, 0.0f);
     glm::vec3 gLightScale(0.001f);
 
-    // Lamp animation
-    bool gIsLampOrbiting = true;
+    // Lamp animation, toggled with L. The lamp circles the middle of the table, taking its light along, and
+    // moves its scene object each frame, so the next pick refits the instance BVH rather than rebuilding it.
+    bool gIsLampOrbiting = false;
+    uint32_t gLampObject = 0;
+    float gLampAngle = 0.0f;
+    const float LAMP_ORBIT_RADIUS = 1.2f;
+    const float LAMP_ORBIT_SPEED = 30.0f;   // Degrees per second
 
     // perspective changing
     bool changePersp = false;
 }
 
 
+bool UParseOptions(int argc, char* argv[], Options& options);
 bool UInitialize(int, char* [], GLFWwindow** window);
+bool UCreateHeadlessContext();
+void UDestroyHeadlessContext();
+double UGetTime();
+bool UShouldClose(uint32_t framesDrawn);
+void UPresentFrame();
+bool UReportsFrameTimes();
+void UReportFrameTimes();
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
+void UOrbitLamp(float deltaTime);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UHandleInputEvent(const InputRecord& event);
+bool UKeyDown(int key);
+void UKeyPressed(int key);
+void UHashFrame();
+void UFlyCamera();
+void UApplyVsync();
+void UPrintFramePacing();
+void UWriteFramePacingJson(std::ostream& json);
+void UReportFlightTimes(std::ostream& json);
+std::string UJsonString(const std::string& text);
+void UAppendMesh(const char* name, const GLfloat* verts, GLsizeiptr size, MeshData& meshData, GLMesh& mesh, PickMesh& pickMesh);
+void UCreateSceneMeshes(Scene& scene);
+uint32_t UAddMaterial(Scene& scene, const GLProgram* program, const GLProgram* multiDrawProgram, GLuint textureId, uint32_t textureLayer, glm::vec2 uvScale);
+uint32_t UAddObject(Scene& scene, uint32_t meshId, uint32_t materialId, const glm::mat4& transform);
+uint32_t UAddInstancedObject(Scene& scene, uint32_t meshId, uint32_t materialId, const glm::mat4& transform, const std::vector<glm::mat4>& instances);
+std::vector<glm::mat4> UScatterOnTable(const GLMesh& mesh, uint32_t count);
+void UBuildDrawQueue(const Scene& scene, const std::vector<uint8_t>& visible, const glm::vec3& viewPosition, const glm::vec3& viewDirection, std::vector<DrawItem>& queue);
+void UUpdateSceneBounds(Scene& scene);
+void UUpdateInstanceMatrices(Scene& scene);
+void UTransformBounds(const GLMesh& mesh, const glm::mat4& model, glm::vec3& center, glm::vec3& extent, float& radius);
+void USetObjectTransform(Scene& scene, uint32_t object, const glm::mat4& transform);
+void UUpdateSceneBvh(Scene& scene);
+bool URayCast(Scene& scene, const glm::vec3& origin, const glm::vec3& direction, RayHit& hit);
+void UPickRay(double x, double y, glm::vec3& origin, glm::vec3& direction);
+void UBenchmarkBvh(uint32_t triangleCount);
+void UBenchmarkVertexThroughput(uint32_t triangleCount);
+void UBenchmarkTextureCache(const std::vector<std::string>& filenames);
+void UBenchmarkTextureCompression(const std::vector<std::string>& filenames);
+void UBenchmarkImageKernels(const std::vector<std::string>& filenames);
+void UBenchmarkMipGeneration(const std::vector<std::string>& filenames);
+void UBenchmarkImageDecoders(const std::vector<std::string>& filenames, uint32_t repeats);
+void UDestroyScene(Scene& scene);
+void UBindFrameUniforms(const GLProgram* program, const glm::mat4& view, const glm::mat4& projection);
+void UBindMeshUniforms(const GLProgram* program, const GLMesh& mesh);
+void USetNormalMatrix(const GLProgram* program, const glm::vec4* columns);
+void UBindVertexFormat(VertexFormat format, int& boundFormat);
+void USubmitDrawQueue(const glm::mat4& view, const glm::mat4& projection);
+void USubmitMultiDraw(const glm::mat4& view, const glm::mat4& projection);
+void UUploadMultiDrawData(Scene& scene, GLMultiDraw& multiDraw);
+void UUploadMaterialRecords(Scene& scene, GLMultiDraw& multiDraw);
+void UDestroyMultiDraw(GLMultiDraw& multiDraw);
+bool UCreateTexture(const char* filename, GpuTexture& texture);
+bool UGetTextureFormat(int channels, GLenum& internalFormat, GLenum& format);
+std::string UTextureCachePath(const TextureImage& image);
+bool UCompressTextures();
+bool UGetCookQuality(BlockQuality& quality);
+bool ULoadTextureImage(TextureImage& image, unsigned encodeThreads = 1);
+bool UCookTextureImage(TextureImage& image, const unsigned char* pixels, int width, int height, int channels, bool compress, BlockQuality quality, unsigned encodeThreads);
+void UCompressTextureImage(TextureImage& image, BlockQuality quality, unsigned encodeThreads);
+MipSettings UMipSettings(unsigned threadCount);
+ThreadPool* UCookPool();
+void UPrintMipTimings();
+const unsigned char* UTexturePayload(const TextureImage& image);
+bool UUploadTextureImage(GLuint textureId, const unsigned char* image, int width, int height, int channels);
+bool UUploadTextureLevels(GLuint textureId, const CookedTextureHeader& header, const TextureLevel* levels, const unsigned char* payload, GLuint pixelBuffer = 0);
+void UCreatePixelBufferRing();
+void URecyclePixelBufferSlots();
+void UCreateTextureAsync(const char* filename, GpuTexture& texture);
+void UQueueTextureLoad(const TextureImage& request);
+uint32_t UAddTextureLayer(TextureClass textureClass, const char* filename);
+bool UCreateTextureArrays();
+bool UUploadTextureLayer(const GLTextureArray& array, int layer, const CookedTextureHeader& header, const TextureLevel* levels, const unsigned char* payload,
+    GLuint pixelBuffer = 0, uint32_t firstLevel = 0, uint32_t endLevel = UINT32_MAX);
+void UDestroyTextureArrays();
+uint64_t UTextureLevelBytes(const GLTextureArray& array, int level);
+void UCommitTextureLevel(GLTextureArray& array, int layer, int level, bool commit);
+float UTextureMinLod(const GLMaterial& material);
+void URequestTextureLevels(const Scene& scene, const std::vector<uint8_t>& visible, const glm::mat4& projection);
+void UStreamTextureLevels(double budgetMs);
+void UEvictTextureLevel(GLTextureArray& array, int layer);
+void UPrintTextureResidency();
+void UUploadDecodedTextures(double budgetMs);
+void UDestroyTextureLoader();
+void UPrintGpuResources();
+void UWriteProfileTrace();
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+glm::mat4 UGetProjection();
+void UReportStressFrame(float deltaTime);
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLProgram& program);
+void UReflectShaderProgram(GLProgram& program);
+GLint UGetUniformLocation(GLuint programId, const char* name);
+void UDestroyShaderProgram(GLProgram& program);
+std::vector<std::string> UPhongDefines(float ambientStrength, float specularIntensity, float highlightSize, bool cpuNormalMatrix = true);
+const GLProgram* UGetShaderVariant(const char* vtxShaderSource, const char* fragShaderSource, std::vector<std::string> defines);
+void UDestroyShaderVariants();
 
 
-/* Cube Vertex Shader Source Code*/
-const GLchar* tableVertexShaderSource = GLSL(440,
+/* Phong Vertex Shader Source Code, shared by every textured object
+   NORMAL_MATRIX is injected by UPhongDefines: the normalMatrix uniform, or the per-vertex inverse for comparison*/
+const GLchar* phongVertexShaderSource = GLSL(440,
 
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 layout(location = 1) in vec3 normal; // VAP position 1 for normals
@@ -114,104 +679,121 @@ layout(location = 2) in vec2 textureCoordinate;
 out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate;
+flat out uint vertexTextureLayer;
+flat out float vertexTextureMinLod;
 
 //Uniform / Global variables for the  transform matrices
 uniform mat4 model;
+uniform mat3 normalMatrix; // Inverse transpose of the model matrix, computed once per object on the CPU
 uniform mat4 view;
 uniform mat4 projection;
+uniform vec2 uvScale;
+uniform uint textureLayer; // Layer of the material's texture in the bound texture array
+uniform float textureMinLod; // Finest mip level of that layer that is resident
+
+// Mesh dequantization, identity (offset 0, scale 1) for float vertices
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+uniform vec4 uvTransform; // xy offset, zw scale
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
+    vec4 meshPosition = vec4(positionOffset + position * positionScale, 1.0f);
+
+    gl_Position = projection * view * model * meshPosition; // Transforms vertices into clip coordinates
+    vertexFragmentPos = vec3(model * meshPosition); // Gets fragment / pixel position in world space only (exclude view and projection)
+    vertexNormal = NORMAL_MATRIX * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexTextureCoordinate = (uvTransform.xy + textureCoordinate * uvTransform.zw) * uvScale; // Tiling is linear, so scaling before interpolation matches scaling per fragment
+    vertexTextureLayer = textureLayer;
+    vertexTextureMinLod = textureMinLod;
 }
 );
 
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* tableFragmentShaderSource = GLSL(440,
-
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+/* Phong Vertex Shader Source Code for glMultiDrawElementsIndirect submission. The model matrix and material
+   come from shader storage, indexed by the draw id attribute. It advances once per instance from the
+   command's baseInstance, so it is baseInstance + gl_InstanceID and each instance reads its own record*/
+const GLchar* phongMultiDrawVertexShaderSource = GLSL(440,
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 2) in vec2 textureCoordinate;
+layout(location = 3) in uint drawId; // Instanced attribute, equal to the command's baseInstance + gl_InstanceID
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform vec2 uvScale;
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexTextureCoordinate;
+flat out uint vertexTextureLayer;
+flat out float vertexTextureMinLod;
 
-void main()
+struct ObjectRecord
 {
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
-
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.2f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
-
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    mat4 model;
+    mat3 normalMatrix;
+    uint materialId;
+    uint meshId;
+};
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+struct MaterialRecord
+{
+    vec4 uvScale; // xy used
+    uint textureLayer;
+    float textureMinLod;
+};
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
+struct MeshRecord
+{
+    vec4 positionOffset; // Dequantization, identity for float vertices
+    vec4 positionScale;
+    vec4 uvTransform; // xy offset, zw scale
+};
 
-/* Cube Vertex Shader Source Code*/
-const GLchar* tableClothVertexShaderSource = GLSL(440,
+layout(std430, binding = 0) readonly buffer ObjectData
+{
+    ObjectRecord objects[];
+};
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
+layout(std430, binding = 1) readonly buffer MaterialData
+{
+    MaterialRecord materials[];
+};
 
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
+layout(std430, binding = 2) readonly buffer MeshData
+{
+    MeshRecord meshes[];
+};
 
 //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
+    mat4 model = objects[drawId].model;
+    mat3 normalMatrix = objects[drawId].normalMatrix;
+    MaterialRecord material = materials[objects[drawId].materialId];
+    MeshRecord mesh = meshes[objects[drawId].meshId];
+    vec4 meshPosition = vec4(mesh.positionOffset.xyz + position * mesh.positionScale.xyz, 1.0f);
+
+    gl_Position = projection * view * model * meshPosition; // Transforms vertices into clip coordinates
+    vertexFragmentPos = vec3(model * meshPosition); // Gets fragment / pixel position in world space only (exclude view and projection)
+    vertexNormal = NORMAL_MATRIX * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexTextureCoordinate = (mesh.uvTransform.xy + textureCoordinate * mesh.uvTransform.zw) * material.uvScale.xy;
+    vertexTextureLayer = material.textureLayer;
+    vertexTextureMinLod = material.textureMinLod;
 }
 );
 
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* tableClothFragmentShaderSource = GLSL(440,
+/* Phong Fragment Shader Source Code
+   AMBIENT_STRENGTH, SPECULAR_INTENSITY and HIGHLIGHT_SIZE are injected as #defines by UGetShaderVariant*/
+const GLchar* phongFragmentShaderSource = GLSL(440,
 
     in vec3 vertexNormal; // For incoming normals
 in vec3 vertexFragmentPos; // For incoming fragment position
 in vec2 vertexTextureCoordinate;
+flat in uint vertexTextureLayer;
+flat in float vertexTextureMinLod;
 
 out vec4 fragmentColor; // For outgoing cube color to the GPU
 
@@ -220,15 +802,14 @@ uniform vec3 objectColor;
 uniform vec3 lightColor;
 uniform vec3 lightPos;
 uniform vec3 viewPosition;
-uniform sampler2D uTexture2; // Useful when working with multiple textures
-uniform vec2 uvScale;
+uniform sampler2DArray uTexture; // Every scene texture of the class, one per layer
 
 void main()
 {
     /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
     //Calculate Ambient lighting*/
-    float ambientStrength = 0.2f; // Set ambient or global lighting strength
+    float ambientStrength = AMBIENT_STRENGTH; // Set ambient or global lighting strength
     vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
 
     //Calculate Diffuse lighting*/
@@ -238,19 +819,21 @@ void main()
     vec3 diffuse = impact * lightColor; // Generate diffuse light color
 
     //Calculate Specular lighting*/
-    float specularIntensity = 0.1f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
+    float specularIntensity = SPECULAR_INTENSITY; // Set specular light strength
+    float highlightSize = HIGHLIGHT_SIZE; // Set specular highlight size
     vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
     vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
     //Calculate specular component
     float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
     vec3 specular = specularIntensity * specularComponent * lightColor;
 
-    // Texture holds the color to be used for all three components
-    vec4 texture2Color = texture(uTexture2, vertexTextureCoordinate * uvScale);
+    // Texture holds the color to be used for all three components. Levels finer than the resident ones
+    // hold no data yet, so the hardware's level of detail is clamped to what has been streamed in.
+    float lod = max(textureQueryLod(uTexture, vertexTextureCoordinate).y, vertexTextureMinLod);
+    vec4 textureColor = textureLod(uTexture, vec3(vertexTextureCoordinate, float(vertexTextureLayer)), lod);
 
     // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * texture2Color.xyz;
+    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
 
     fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
 }
@@ -267,419 +850,638 @@ uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+// Mesh dequantization, identity (offset 0, scale 1) for float vertices
+uniform vec3 positionOffset;
+uniform vec3 positionScale;
+
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    gl_Position = projection * view * model * vec4(positionOffset + position * positionScale, 1.0f); // Transforms vertices into clip coordinates
 }
 );
 
 
-//////////////////////////////
-
-
-const GLchar* diceVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
-
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
 }
 );
 
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* diceFragmentShaderSource = GLSL(440,
-
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+int main(int argc, char* argv[])
+{
+    gStartTime = std::chrono::steady_clock::now();
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    if (!UParseOptions(argc, argv, gOptions))
+        return EXIT_FAILURE;
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture3; // Useful when working with multiple textures
-uniform vec2 uvScale;
+    // The textured objects. Each one is a Phong variant that only differs in its lighting constants,
+    // so identical variants resolve to the same linked program.
+    struct TexturedObject
+    {
+        SceneMesh mesh;
+        const char* texFilename;
+        TextureClass textureClass;
+        float ambientStrength;
+        float specularIntensity;
+        float highlightSize;
+    };
+    const TexturedObject texturedObjects[] = {
+        { TABLE_MESH, "wood.jpg", TEXTURE_CLASS_OPAQUE, 0.2f, 0.8f, 16.0f },
+        { TABLE_CLOTH_MESH, "fabric.jpg", TEXTURE_CLASS_OPAQUE, 0.2f, 0.1f, 16.0f },
+        { DICE_MESH, "dice.jpg", TEXTURE_CLASS_OPAQUE, 0.2f, 0.8f, 16.0f },
+        { BOX_MESH, "box.jpg", TEXTURE_CLASS_OPAQUE, 0.8f, 0.8f, 16.0f },
+        { CANDLE_MESH, "candle.jpg", TEXTURE_CLASS_OPAQUE, 0.8f, 0.8f, 16.0f },
+    };
+    const size_t texturedObjectCount = sizeof(texturedObjects) / sizeof(texturedObjects[0]);
 
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+    if (gOptions.benchBvhTriangles > 0)
+    {
+        UBenchmarkBvh(gOptions.benchBvhTriangles);
+        return EXIT_SUCCESS;
+    }
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.2f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+    if (gOptions.benchTextures || gOptions.benchCompression || gOptions.benchImageKernels || gOptions.benchMips || gOptions.benchDecodeRepeats > 0)
+    {
+        std::vector<std::string> filenames;
+        for (const TexturedObject& object : texturedObjects)
+            filenames.push_back(object.texFilename);
+
+        // There is no context to ask, so cook as if it samples S3TC
+        gTextureCompressionSupported = true;
+        if (gOptions.benchTextures)
+            UBenchmarkTextureCache(filenames);
+        if (gOptions.benchCompression)
+            UBenchmarkTextureCompression(filenames);
+        if (gOptions.benchImageKernels)
+            UBenchmarkImageKernels(filenames);
+        if (gOptions.benchMips)
+            UBenchmarkMipGeneration(filenames);
+        if (gOptions.benchDecodeRepeats > 0)
+        {
+            // The brick texture is shipped but not drawn; it is the only PNG
+            filenames.push_back("newBrick.png");
+            UBenchmarkImageDecoders(filenames, gOptions.benchDecodeRepeats);
+        }
+        return EXIT_SUCCESS;
+    }
 
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+    PROFILE_THREAD("main");
+    PROFILE_CREATE_GPU();
 
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+    if (gOptions.benchVertexTriangles > 0)
+    {
+        UBenchmarkVertexThroughput(gOptions.benchVertexTriangles);
+        UDestroyShaderVariants();
+        return EXIT_SUCCESS;
+    }
 
-    // Texture holds the color to be used for all three components
-    vec4 texture2Color = texture(uTexture3, vertexTextureCoordinate * uvScale);
+    gPresentLatency.CreateQueries();
+    gFrameLimiter.SetRate(gOptions.fpsLimit);
+    gFrameSmoother.SetFrames(gOptions.frameSmoothing);
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * texture2Color.xyz;
+    // Create the meshes
+    UCreateSceneMeshes(gScene); // Calls the function to create the Vertex Buffer Objects
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
+    // Create the lamp's shader program
+    lightProgram = UGetShaderVariant(lampVertexShaderSource, lampFragmentShaderSource, {});
+    if (!lightProgram)
+        return EXIT_FAILURE;
 
-//////////////////////////////
+    // Load textures. Each one gets a layer of its class's texture array; the arrays are allocated once
+    // every layer is known.
+    uint32_t textureLayers[texturedObjectCount];
+    for (size_t i = 0; i < texturedObjectCount; ++i)
+        textureLayers[i] = UAddTextureLayer(texturedObjects[i].textureClass, texturedObjects[i].texFilename);
+    if (!UCreateTextureArrays())
+        return EXIT_FAILURE;
 
-//*******************************
+    // Build the scene. Every object is authored relative to the table, so they share its transform.
+    const glm::mat4 tableModel = glm::translate(tablePos) * glm::scale(tableScale);
+    for (size_t i = 0; i < texturedObjectCount; ++i)
+    {
+        const TexturedObject& object = texturedObjects[i];
+        const std::vector<std::string> defines = UPhongDefines(object.ambientStrength, object.specularIntensity, object.highlightSize);
+        const GLProgram* program = UGetShaderVariant(phongVertexShaderSource, phongFragmentShaderSource, defines);
+        const GLProgram* multiDrawProgram = UGetShaderVariant(phongMultiDrawVertexShaderSource, phongFragmentShaderSource, defines);
+        if (!program || !multiDrawProgram)
+            return EXIT_FAILURE;
+
+        const uint32_t material = UAddMaterial(gScene, program, multiDrawProgram, gTextureArrays[object.textureClass].id, textureLayers[i], gUVScale);
+        if (object.mesh == DICE_MESH && gOptions.stressDice > 0)
+            UAddInstancedObject(gScene, object.mesh, material, tableModel, UScatterOnTable(gScene.meshes[object.mesh], gOptions.stressDice));
+        else
+            UAddObject(gScene, object.mesh, material, tableModel);
+    }
 
-const GLchar* boxVertexShaderSource = GLSL(440,
+    // The lamp is drawn with the table cloth's quad
+    const glm::mat4 lampModel = glm::translate(gLightPosition) * glm::scale(gLightScale);
+    gLampObject = UAddObject(gScene, TABLE_CLOTH_MESH, UAddMaterial(gScene, lightProgram, nullptr, 0, 0, gUVScale), lampModel);
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
+    cout << "INFO: Linked " << gProgramCache.size() << " shader programs" << endl;
 
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
+    // The synthetic set cycles through the scene's images so every texture is a real decode
+    gTextureLoader.syntheticTextures.resize(gOptions.syntheticTextures);
+    for (uint32_t i = 0; i < gOptions.syntheticTextures; ++i)
+    {
+        const char* filename = texturedObjects[i % texturedObjectCount].texFilename;
+        if (gOptions.syncTextures)
+            UCreateTexture(filename, gTextureLoader.syntheticTextures[i]);
+        else
+            UCreateTextureAsync(filename, gTextureLoader.syntheticTextures[i]);
+    }
+    if (!gOptions.replayInput.empty())
+    {
+        if (!gInputReplay.Load(gOptions.replayInput.c_str()) || gInputReplay.FrameCount() == 0)
+        {
+            cout << "ERROR: Could not read input log " << gOptions.replayInput << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "INFO: Replaying " << gInputReplay.FrameCount() << " frames and " << gInputReplay.EventCount() << " input events from "
+            << gOptions.replayInput << endl;
+    }
+    if (!gOptions.flythrough.empty())
+    {
+        std::string error;
+        if (!LoadFlightPaths(gOptions.flythrough.c_str(), gFlightPaths, error))
+        {
+            cout << "ERROR: Could not load flythrough " << gOptions.flythrough << ": " << error << endl;
+            return EXIT_FAILURE;
+        }
+        for (const FlightPath& path : gFlightPaths)
+            cout << "INFO: Flight path " << path.name << ": " << path.SegmentCount() << " segments, " << path.Length() << " units in " << path.frames << " frames" << endl;
+    }
+    if (!gOptions.recordInput.empty() && !gInputRecorder.Open(gOptions.recordInput.c_str()))
+    {
+        cout << "ERROR: Could not create input log " << gOptions.recordInput << endl;
+        return EXIT_FAILURE;
+    }
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    bool firstFrame = true, fullyLoaded = false;
+    uint32_t framesDrawn = 0;
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-}
-);
 
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* boxFragmentShaderSource = GLSL(440,
+    // render loop
+    // -----------
+    // Every frame time is kept for the report, so an open ended interactive session keeps none
+    const bool reportFrameTimes = UReportsFrameTimes();
+    while (!UShouldClose(framesDrawn))
+    {
+        PROFILE_FRAME();
+        PROFILE_SCOPE("Frame");
 
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+        float currentFrame = (float)UGetTime();
+        gDeltaTime = currentFrame - gLastFrame;
+        gLastFrame = currentFrame;
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+        // The first delta reaches back to startup, so frame times start with the second one
+        if (framesDrawn > 0 && reportFrameTimes)
+            gFrameTimesMs.push_back(gDeltaTime * 1000.0f);
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture4; // Useful when working with multiple textures
-uniform vec2 uvScale;
-
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
-
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.8f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
-
-    // Texture holds the color to be used for all three components
-    vec4 texture2Color = texture(uTexture4, vertexTextureCoordinate * uvScale);
-
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * texture2Color.xyz;
-
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
-
-//*******************************
-const GLchar* candleVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
-
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
-
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-}
-);
-
-
-/* Candle Fragment Shader Source Code*/
-const GLchar* candleFragmentShaderSource = GLSL(440,
-
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
-
-out vec4 fragmentColor; // For outgoing cube color to the GPU
-
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture5; // Useful when working with multiple textures
-uniform vec2 uvScale;
-
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
-
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.8f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
-
-    // Texture holds the color to be used for all three components
-    vec4 texture2Color = texture(uTexture5, vertexTextureCoordinate * uvScale);
-
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * texture2Color.xyz;
-
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
-
-
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
-
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
-
-void main()
-{
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
-
-
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
-    {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
-
-        for (int i = width * channels; i > 0; --i)
+        // A replay moves the camera by the same steps whatever the frame times are now
+        gInputDeltaTime = gFrameSmoother.Smooth(gDeltaTime);
+        if (gInputReplay.IsLoaded())
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            float recordedDeltaTime = 0.0f;
+            gInputReplay.BeginFrame(recordedDeltaTime);
+            gInputDeltaTime = gOptions.replayTimestep > 0.0f ? gOptions.replayTimestep : recordedDeltaTime;
         }
-    }
-}
+        gInputRecorder.Write(InputRecord::Frame(currentFrame, gInputDeltaTime));
 
+        UProcessInput(gWindow);
+        if (gIsLampOrbiting)
+            UOrbitLamp(gInputDeltaTime);
+        if (!gFlightPaths.empty())
+            UFlyCamera();
+        {
+            PROFILE_SCOPE("Texture uploads");
+            UUploadDecodedTextures(TEXTURE_UPLOAD_BUDGET_MS);
+        }
 
+        // Frame time is the time since the previous frame, so it is booked to the path that drew that frame
+        static int framePath = -1;
+        if (framePath >= 0)
+            gFrameSeconds[framePath] += gDeltaTime;
+        framePath = gUseMultiDraw ? 1 : 0;
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+        if (gOptions.stressDice > 0)
+            UReportStressFrame(gDeltaTime);
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+        // Uniform handles are all resolved at link time, so a frame should never add lookups
+        unsigned long lookupsBefore = gUniformLookups;
+        URender();
+        if (gUniformLookups != lookupsBefore)
+            cout << "WARNING: " << gUniformLookups - lookupsBefore << " uniform lookups this frame" << endl;
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(tableVertexShaderSource, tableFragmentShaderSource, tableProgramId))
-        return EXIT_FAILURE;
+        const double sinceStartMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gStartTime).count();
+        if (firstFrame)
+        {
+            cout << "INFO: Time to first frame: " << sinceStartMs << " ms (" << gTextureLoader.pending << " textures still loading)" << endl;
+            firstFrame = false;
+        }
+        if (!fullyLoaded && gTextureLoader.pending == 0)
+        {
+            cout << "INFO: Time to fully loaded: " << sinceStartMs << " ms (" << texturedObjectCount + gOptions.syntheticTextures << " textures, "
+                << (gOptions.syncTextures ? "main thread only" : std::to_string(gTextureLoader.pool->Size()) + " decode threads") << ", "
+                << gTextureLoader.ringUploads << " through the pixel buffer ring, " << gTextureLoader.clientUploads << " from client memory, "
+                << gTextureLoader.cacheHits << " cooked cache hits, " << gTextureLoader.cacheMisses << " cooked now)" << endl;
+            UPrintMipTimings();
+            fullyLoaded = true;
+        }
 
-    if (!UCreateShaderProgram(tableClothVertexShaderSource, tableClothFragmentShaderSource, tableClothProgramId))
-        return EXIT_FAILURE;
+        ++framesDrawn;
 
-    if (!UCreateShaderProgram(diceVertexShaderSource, diceFragmentShaderSource, diceProgramId))
-        return EXIT_FAILURE;
+        // Waiting before the poll rather than after it keeps the input of the next frame as fresh as it can be
+        if (gFrameLimiter.IsActive())
+        {
+            PROFILE_SCOPE("Frame limiter");
+            gFrameLimiter.Wait();
+        }
 
-    if (!UCreateShaderProgram(boxVertexShaderSource, boxFragmentShaderSource, boxProgramId))
-        return EXIT_FAILURE;
+        PROFILE_SCOPE("Poll events");
+        if (gWindow)
+            glfwPollEvents();
+        gInputPollNs = PacingNow();
+        if (gInputReplay.IsLoaded())
+            gInputReplay.DispatchEvents(UHandleInputEvent);
+    }
+    if (reportFrameTimes)
+        gFrameTimesMs.push_back(((float)UGetTime() - gLastFrame) * 1000.0f);
 
-    if (!UCreateShaderProgram(candleVertexShaderSource, candleFragmentShaderSource, candleProgramId))
-        return EXIT_FAILURE;
+    cout << "INFO: Uniform lookups (all at program creation): " << gUniformLookups << endl;
+    if (gOptions.profileAtExit)
+        UWriteProfileTrace();
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, lightProgramId))
-        return EXIT_FAILURE;
 
+    cout << "INFO: Last frame: " << gRenderStats.drawCalls << " draws, " << gRenderStats.programBinds << " program binds, "
+        << gRenderStats.textureBinds << " texture binds, " << gRenderStats.vaoBinds << " VAO binds" << endl;
+    cout << "INFO: Last frame culling: " << gRenderStats.culling.tested << " tested, " << gRenderStats.culling.culled << " culled, "
+        << gRenderStats.culling.drawn << " drawn" << endl;
 
-    // Load texture
-    const char* texFilename = "wood.jpg";
-    if (!UCreateTexture(texFilename, gTextureId))
+    for (int path = 0; path < 2; ++path)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        if (gSubmitFrames[path] > 0)
+            cout << "INFO: " << (path == 0 ? "Per-object" : "Multi-draw indirect") << " submit: "
+                << gSubmitSeconds[path] * 1000.0 / gSubmitFrames[path] << " ms/frame, frame time: "
+                << gFrameSeconds[path] * 1000.0 / gSubmitFrames[path] << " ms over " << gSubmitFrames[path] << " frames" << endl;
     }
-    glUseProgram(tableProgramId);
-    glUniform1i(glGetUniformLocation(tableProgramId, "uTexture"), 0);
-
-    const char* tex2Filename = "fabric.jpg";
-    if (!UCreateTexture(tex2Filename, gTexture2Id))
+    if (reportFrameTimes)
+        UReportFrameTimes();
+    UPrintFramePacing();
+    if (gInputRecorder.IsOpen())
     {
-        cout << "Failed to load texture " << tex2Filename << endl;
-        return EXIT_FAILURE;
+        const size_t frames = gInputRecorder.FrameCount(), events = gInputRecorder.EventCount();
+        if (gInputRecorder.Close())
+            cout << "INFO: Recorded " << frames << " frames and " << events << " input events to " << gOptions.recordInput << endl;
+        else
+            cout << "ERROR: Could not write input log " << gOptions.recordInput << endl;
     }
-    glUseProgram(tableClothProgramId);
-    glUniform1i(glGetUniformLocation(tableClothProgramId, "uTexture2"), 0);
 
-    const char* tex3Filename = "dice.jpg";
-    if (!UCreateTexture(tex3Filename, gTexture3Id))
-    {
-        cout << "Failed to load texture " << tex3Filename << endl;
-        return EXIT_FAILURE;
-    }
-    glUseProgram(diceProgramId);
-    glUniform1i(glGetUniformLocation(diceProgramId, "uTexture3"), 0);
-    
-    const char* tex4Filename = "box.jpg";
-    if (!UCreateTexture(tex4Filename, gTexture4Id))
-    {
-        cout << "Failed to load texture " << tex4Filename << endl;
-        return EXIT_FAILURE;
-    }
-    glUseProgram(boxProgramId);
-    glUniform1i(glGetUniformLocation(boxProgramId, "uTexture4"), 0);
-    
-    
-    const char* tex5Filename = "candle.jpg";
-    if (!UCreateTexture(tex5Filename, gTexture5Id))
+    UDestroyMultiDraw(gMultiDraw);
+    UDestroyScene(gScene);
+    UDestroyTextureLoader();
+    UDestroyTextureArrays();
+    UDestroyShaderVariants();
+    PROFILE_DESTROY_GPU();
+    gPresentLatency.DestroyQueries();
+    UDestroyHeadlessContext();
+
+    // Everything the scene created is gone by now; anything still listed is a leak
+    GpuResourceManager& resources = GpuResources();
+    if (resources.LiveCount() == 0)
+        cout << "INFO: GPU resources: " << resources.CreatedCount() << " created, all destroyed, peak " << resources.PeakBytes() / (1024.0 * 1024.0) << " MB" << endl;
+    else
     {
-        cout << "Failed to load texture " << tex5Filename << endl;
-        return EXIT_FAILURE;
+        cout << "WARNING: " << resources.LiveCount() << " GPU resources still alive at shutdown (" << resources.TotalBytes() << " bytes):" << endl;
+        resources.ReportLive(cout);
     }
-    glUseProgram(candleProgramId);
-    glUniform1i(glGetUniformLocation(candleProgramId, "uTexture5"), 0);
-    
+
+    exit(EXIT_SUCCESS); // Terminates the program successfully
+}
 
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+// Reads the command line into options, printing the usage on anything it does not understand
+bool UParseOptions(int argc, char* argv[], Options& options)
+{
+    for (int i = 1; i < argc; ++i)
     {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
 
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
-
-        UProcessInput(gWindow);
-        URender();
-        glfwPollEvents();
+        if (arg == "--vertex-format" && hasValue)
+        {
+            const std::string value = argv[++i];
+            if (value == "auto")
+                options.compactVertices = COMPACT_AUTO;
+            else if (value == "float")
+                options.compactVertices = COMPACT_NEVER;
+            else if (value == "compact")
+                options.compactVertices = COMPACT_ALWAYS;
+            else
+            {
+                cout << "Unknown vertex format " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--stress" && hasValue)
+        {
+            options.stressDice = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--bench-bvh" && hasValue)
+        {
+            options.benchBvhTriangles = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--bench-vertex" && hasValue)
+        {
+            options.benchVertexTriangles = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--sync-textures")
+        {
+            options.syncTextures = true;
+        }
+        else if (arg == "--synthetic-textures" && hasValue)
+        {
+            options.syntheticTextures = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--no-texture-cache")
+        {
+            options.textureCache = false;
+        }
+        else if (arg == "--bench-textures")
+        {
+            options.benchTextures = true;
+        }
+        else if (arg == "--texture-compression" && hasValue)
+        {
+            const std::string value = argv[++i];
+            if (value == "auto")
+                options.textureCompression = COMPRESSION_AUTO;
+            else if (value == "off")
+                options.textureCompression = COMPRESSION_OFF;
+            else if (value == "fast")
+                options.textureCompression = COMPRESSION_FAST;
+            else if (value == "high")
+                options.textureCompression = COMPRESSION_HIGH;
+            else
+            {
+                cout << "Unknown texture compression " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bench-compression")
+        {
+            options.benchCompression = true;
+        }
+        else if (arg == "--texture-budget" && hasValue)
+        {
+            options.textureBudgetMB = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--no-texture-streaming")
+        {
+            options.textureStreaming = false;
+        }
+        else if (arg == "--srgb-textures")
+        {
+            options.srgbTextures = true;
+        }
+        else if (arg == "--bench-image-kernels")
+        {
+            options.benchImageKernels = true;
+        }
+        else if (arg == "--mip-filter" && hasValue)
+        {
+            const std::string value = argv[++i];
+            if (value == "box")
+                options.mipFilter = FILTER_BOX;
+            else if (value == "kaiser")
+                options.mipFilter = FILTER_KAISER;
+            else if (value == "lanczos")
+                options.mipFilter = FILTER_LANCZOS;
+            else
+            {
+                cout << "Unknown mip filter " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--alpha-coverage" && hasValue)
+        {
+            options.alphaCoverage = std::strtof(argv[++i], nullptr);
+        }
+        else if (arg == "--bench-mips")
+        {
+            options.benchMips = true;
+        }
+        else if (arg == "--image-decoder" && hasValue)
+        {
+            const std::string value = argv[++i];
+            if (value == "auto")
+                options.stbDecoderOnly = false;
+            else if (value == "stb")
+                options.stbDecoderOnly = true;
+            else
+            {
+                cout << "Unknown image decoder " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bench-decode" && hasValue)
+        {
+            options.benchDecodeRepeats = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--profile-trace" && hasValue)
+        {
+            options.profileTrace = argv[++i];
+            options.profileAtExit = true;
+        }
+        else if (arg == "--headless")
+        {
+            options.headless = true;
+        }
+        else if (arg == "--resolution" && hasValue)
+        {
+            const std::string value = argv[++i];
+            char* end = nullptr;
+            options.width = (int)std::strtol(value.c_str(), &end, 10);
+            options.height = *end == 'x' ? (int)std::strtol(end + 1, &end, 10) : 0;
+            if (options.width <= 0 || options.height <= 0 || *end != '\0')
+            {
+                cout << "Unknown resolution " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--frames" && hasValue)
+        {
+            options.frames = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--timing-output" && hasValue)
+        {
+            options.timingOutput = argv[++i];
+        }
+        else if (arg == "--record-input" && hasValue)
+        {
+            options.recordInput = argv[++i];
+        }
+        else if (arg == "--replay-input" && hasValue)
+        {
+            options.replayInput = argv[++i];
+        }
+        else if (arg == "--replay-timestep" && hasValue)
+        {
+            options.replayTimestep = std::strtof(argv[++i], nullptr);
+        }
+        else if (arg == "--frame-hash")
+        {
+            options.frameHash = true;
+        }
+        else if (arg == "--flythrough" && hasValue)
+        {
+            options.flythrough = argv[++i];
+        }
+        else if (arg == "--vsync" && hasValue)
+        {
+            const std::string value = argv[++i];
+            if (value == "on")
+                options.vsync = VSYNC_ON;
+            else if (value == "off")
+                options.vsync = VSYNC_OFF;
+            else if (value == "adaptive")
+                options.vsync = VSYNC_ADAPTIVE;
+            else
+            {
+                cout << "Unknown vsync mode " << value << endl;
+                return false;
+            }
+        }
+        else if (arg == "--fps-limit" && hasValue)
+        {
+            options.fpsLimit = std::strtod(argv[++i], nullptr);
+        }
+        else if (arg == "--frame-smoothing" && hasValue)
+        {
+            options.frameSmoothing = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            cout << "Unknown option " << arg << "\n"
+                << "Usage: " << argv[0] << " [options]\n"
+                << "  --vertex-format auto|float|compact   Mesh vertex layout (default auto: compact for large meshes)\n"
+                << "  --stress <count>                     Scatter count dice over the table, e.g. 100000, and report frame time\n"
+                << "  --bench-bvh <triangles>              Time BVH build, refit and ray queries on a random soup and exit\n"
+                << "  --bench-vertex <triangles>           Time the Phong vertex shader with and without CPU normal matrices and exit\n"
+                << "  --sync-textures                      Load textures on the main thread before the first frame\n"
+                << "  --synthetic-textures <count>         Also load count textures, e.g. 200, to time loading at scale\n"
+                << "  --no-texture-cache                   Decode every texture instead of loading it from " << TEXTURE_CACHE_DIR << "/\n"
+                << "  --bench-textures                     Time cold (decode and cook) and warm (cooked) texture loads and exit\n"
+                << "  --texture-compression auto|off|fast|high  BC1/BC3 encoding of textures (default auto: high when cached)\n"
+                << "  --bench-compression                  Report PSNR, memory and encoder MPix/s of the scene textures and exit\n"
+                << "  --texture-budget <MB>                Texture array memory streamed mips have to fit in (default 256)\n"
+                << "  --no-texture-streaming               Load every mip level of every texture array layer up front\n"
+                << "  --srgb-textures                      Sample textures as sRGB and write an sRGB framebuffer\n"
+                << "  --bench-image-kernels                Time scalar and SIMD image kernels on the scene textures and exit\n"
+                << "  --mip-filter box|kaiser|lanczos      Filter of cooked mip levels (default kaiser)\n"
+                << "  --alpha-coverage <cutoff>            Keep the share of texels with alpha above cutoff, e.g. 0.5, in every mip\n"
+                << "  --bench-mips                         Time mip generation per filter and level on the scene textures and exit\n"
+                << "  --image-decoder auto|stb             Decoder of source images (default auto: the fastest compiled in per format)\n"
+                << "  --bench-decode <count>               Decode the shipped images count times per decoder, on 1 and all cores, and exit\n"
+                << "  --profile-trace <path>               Write the profiler's Chrome trace to path at exit (P writes it any time)\n"
+                << "  --headless                           Render offscreen through EGL or OSMesa, without a window or input\n"
+                << "  --resolution <width>x<height>        Size of the window or headless framebuffer (default " << WINDOW_WIDTH << "x" << WINDOW_HEIGHT << ")\n"
+                << "  --frames <count>                     Exit after count frames (headless default " << HEADLESS_DEFAULT_FRAMES << ") and print a TIMING: JSON line\n"
+                << "  --timing-output <path>               Also write the timing JSON, with every frame time, to path\n"
+                << "  --record-input <path>                Log every key, cursor and scroll event and frame step to path\n"
+                << "  --replay-input <path>                Drive the camera from a recorded log, for as many frames as it has\n"
+                << "  --replay-timestep <seconds>          Camera step per replayed frame (default 1/60, 0 for the recorded steps)\n"
+                << "  --frame-hash                         Hash the pixels of every frame, to check replays draw identical frames\n"
+                << "  --flythrough <path>                  Fly the camera along the spline paths in a file, e.g. flythrough.txt, and\n"
+                << "                                       report frame time percentiles per path segment\n"
+                << "  --vsync on|off|adaptive              Wait for vertical blank on every swap, never, or only when on time (default on)\n"
+                << "  --fps-limit <hz>                     Hold frames to hz, e.g. 60, by sleeping and then spinning to the deadline\n"
+                << "  --frame-smoothing <frames>           Move the camera by the mean time of the last frames instead of the last one" << endl;
+            return false;
+        }
     }
 
+    // A headless run has no window to close, unless a replay or flythrough ends it
+    if (options.headless && options.frames == 0 && options.replayInput.empty() && options.flythrough.empty())
+        options.frames = HEADLESS_DEFAULT_FRAMES;
 
-    UDestroyMesh(gMesh);
-    UDestroyTexture(gTextureId);
-    UDestroyTexture(gTexture2Id);
-    UDestroyShaderProgram(tableProgramId);
-    UDestroyShaderProgram(tableClothProgramId);
-    UDestroyShaderProgram(lightProgramId);
+    // Textures finishing loading during a replay or flythrough would change what its frames show
+    if (!options.replayInput.empty() || !options.flythrough.empty())
+        options.syncTextures = true;
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    return true;
 }
 
 
-
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
-
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+    gFramebufferWidth = gOptions.width;
+    gFramebufferHeight = gOptions.height;
+    if (gOptions.headless)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
+        if (!UCreateHeadlessContext())
+            return false;
     }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    else
+    {
+        glfwInit();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        if (gOptions.srgbTextures)
+            glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
+
+        *window = glfwCreateWindow(gOptions.width, gOptions.height, WINDOW_TITLE, NULL, NULL);
+        if (*window == NULL)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return false;
+        }
+        glfwMakeContextCurrent(*window);
+        UApplyVsync();
+        glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+        glfwSetCursorPosCallback(*window, UMousePositionCallback);
+        glfwSetScrollCallback(*window, UMouseScrollCallback);
+        glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+        glfwSetKeyCallback(*window, UKeyCallback);
 
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+        // High DPI screens give the window more pixels than its size in screen coordinates
+        glfwGetFramebufferSize(*window, &gFramebufferWidth, &gFramebufferHeight);
 
-    if (GLEW_OK != GlewInitResult)
-    {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
+        glewExperimental = GL_TRUE;
+        GLenum GlewInitResult = glewInit();
+
+        if (GLEW_OK != GlewInitResult)
+        {
+            std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+            return false;
+        }
     }
 
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    gRenderer = (const char*)glGetString(GL_RENDERER);
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << ", renderer: " << gRenderer << endl;
+
+    // sRGB block formats come from EXT_texture_sRGB
+    gTextureCompressionSupported = GLEW_EXT_texture_compression_s3tc != 0 && (!gOptions.srgbTextures || GLEW_EXT_texture_sRGB);
+    if (!gTextureCompressionSupported && gOptions.textureCompression != COMPRESSION_OFF)
+        cout << "WARNING: S3TC textures are not supported, textures stay uncompressed" << endl;
+
+    // Lighting runs on linear colors from sRGB textures, and the framebuffer encodes them back
+    if (gOptions.srgbTextures)
+        glEnable(GL_FRAMEBUFFER_SRGB);
 
     return true;
 }
@@ -690,22 +1492,22 @@ void UProcessInput(GLFWwindow* window)
 {
     static const float cameraSpeed = 2.5f;
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+    if (UKeyDown(GLFW_KEY_ESCAPE) && window)
         glfwSetWindowShouldClose(window, true);
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+    if (UKeyDown(GLFW_KEY_W))
+        gCamera.ProcessKeyboard(FORWARD, gInputDeltaTime);
+    if (UKeyDown(GLFW_KEY_S))
+        gCamera.ProcessKeyboard(BACKWARD, gInputDeltaTime);
+    if (UKeyDown(GLFW_KEY_A))
+        gCamera.ProcessKeyboard(LEFT, gInputDeltaTime);
+    if (UKeyDown(GLFW_KEY_D))
+        gCamera.ProcessKeyboard(RIGHT, gInputDeltaTime);
+    if (UKeyDown(GLFW_KEY_E))
         gCamera.Position.y += cameraSpeed * 0.01;
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+    if (UKeyDown(GLFW_KEY_Q))
         gCamera.Position.y -= cameraSpeed * 0.01;
-    if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS) {
+    if (UKeyDown(GLFW_KEY_K)) {
         if (changePersp == true) {
             changePersp = false;
         }
@@ -720,32 +1522,84 @@ void UProcessInput(GLFWwindow* window)
 // Window Resizing
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
+    gFramebufferWidth = width;
+    gFramebufferHeight = height;
     glViewport(0, 0, width, height);
 }
 // Mouse postion actions
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 {
-    if (gFirstMouse)
-    {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
-    }
+    if (!gInputReplay.IsLoaded())
+        UHandleInputEvent(InputRecord::Position(INPUT_CURSOR, UGetTime(), xpos, ypos));
+}
+// Mouse scroll actions
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    if (!gInputReplay.IsLoaded())
+        UHandleInputEvent(InputRecord::Position(INPUT_SCROLL, UGetTime(), xoffset, yoffset));
+}
+
+// Key presses and releases
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (!gInputReplay.IsLoaded())
+        UHandleInputEvent(InputRecord::Key(UGetTime(), key, action));
+}
+
+
+// Logs a key, cursor or scroll event when recording and applies it to the camera and key state. Live
+// events and replayed ones both come through here, so a replay drives the same code the recording did.
+void UHandleInputEvent(const InputRecord& event)
+{
+    gInputRecorder.Write(event);
+
+    switch (event.type)
+    {
+    case INPUT_KEY:
+        if (event.key >= 0 && event.key <= GLFW_KEY_LAST)
+            gKeysDown[event.key] = event.action != GLFW_RELEASE;
+        if (event.action == GLFW_PRESS)
+            UKeyPressed(event.key);
+        break;
+
+    case INPUT_CURSOR:
+    {
+        const double xpos = event.x, ypos = event.y;
+        if (gFirstMouse)
+        {
+            gLastX = xpos;
+            gLastY = ypos;
+            gFirstMouse = false;
+        }
+
+        float xoffset = xpos - gLastX;
+        float yoffset = gLastY - ypos;
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos;
+        gLastX = xpos;
+        gLastY = ypos;
+
+        gCamera.ProcessMouseMovement(xoffset, yoffset);
+        break;
+    }
 
-    gLastX = xpos;
-    gLastY = ypos;
+    case INPUT_SCROLL:
+        gCamera.ProcessMouseScroll(event.y);
+        break;
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
+    default:
+        break;
+    }
 }
-// Mouse scroll actions
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+
+
+// Whether a key is held, as its last press or release left it. GLFW sends releases when the window loses
+// focus, so this matches glfwGetKey.
+bool UKeyDown(int key)
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    return gKeysDown[key];
 }
 
+
 // Mouse button actions
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
@@ -754,7 +1608,28 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     case GLFW_MOUSE_BUTTON_LEFT:
     {
         if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
+        {
+            // The cursor is captured for the camera, so picking goes through the middle of the window
+            int width, height;
+            glfwGetWindowSize(window, &width, &height);
+            double x = width * 0.5, y = height * 0.5;
+            if (glfwGetInputMode(window, GLFW_CURSOR) != GLFW_CURSOR_DISABLED)
+                glfwGetCursorPos(window, &x, &y);
+
+            glm::vec3 origin, direction;
+            UPickRay(x, y, origin, direction);
+
+            RayHit hit;
+            auto pickStart = std::chrono::steady_clock::now();
+            const bool picked = URayCast(gScene, origin, direction, hit);
+            const double pickUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - pickStart).count();
+
+            if (picked)
+                cout << "Picked object " << hit.object << " (mesh " << gScene.meshIds[hit.object] << ", instance " << hit.instance
+                    << "), triangle " << hit.triangle << " at distance " << hit.distance << " in " << pickUs << " us" << endl;
+            else
+                cout << "Picked nothing in " << pickUs << " us" << endl;
+        }
         else
             cout << "Left mouse button released" << endl;
     }
@@ -785,413 +1660,1481 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 }
 
 
-// Functioned called to render a frame
-void URender()
+// Moves the lamp and its light along its circle by the step of a frame. The step is the input step, so a
+// replay moves the lamp the same way it moves the camera.
+void UOrbitLamp(float deltaTime)
 {
+    gLampAngle = std::fmod(gLampAngle + LAMP_ORBIT_SPEED * deltaTime, 360.0f);
+    gLightPosition.x = LAMP_ORBIT_RADIUS * std::cos(glm::radians(gLampAngle));
+    gLightPosition.z = LAMP_ORBIT_RADIUS * std::sin(glm::radians(gLampAngle));
+    USetObjectTransform(gScene, gLampObject, glm::translate(gLightPosition) * glm::scale(gLightScale));
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glClearColor(0.95f, 0.82f, 0.46f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Pyramid VOA
-    glBindVertexArray(gMesh.vao);
+// Key press actions that should fire once per press rather than every polled frame
+void UKeyPressed(int key)
+{
+    switch (key)
+    {
+    case GLFW_KEY_M:
+        gUseMultiDraw = !gUseMultiDraw;
+        cout << "Submission: " << (gUseMultiDraw ? "multi-draw indirect" : "per-object draws") << endl;
+        break;
+
+    case GLFW_KEY_C:
+        gUseCulling = !gUseCulling;
+        cout << "Frustum culling: " << (gUseCulling ? "on" : "off") << endl;
+        break;
+
+    case GLFW_KEY_T:
+        UPrintTextureResidency();
+        break;
+
+    case GLFW_KEY_G:
+        UPrintGpuResources();
+        break;
+
+    case GLFW_KEY_P:
+        UWriteProfileTrace();
+        break;
+
+    case GLFW_KEY_L:
+        gIsLampOrbiting = !gIsLampOrbiting;
+        cout << "Lamp orbit: " << (gIsLampOrbiting ? "on" : "off") << endl;
+        break;
+
+    default:
+        break;
+    }
+}
 
 
-    // Set the shader to pyramid
-    glUseProgram(tableProgramId);
+// Functioned called to render a frame
+void URender()
+{
+    PROFILE_SCOPE("Render");
 
-    // Model matrix
-    glm::mat4 model = glm::translate(tablePos) * glm::scale(tableScale);
+    glEnable(GL_DEPTH_TEST);
+    glClearColor(0.95f, 0.82f, 0.46f, 1.0f);
+    {
+        PROFILE_GPU_SCOPE("Clear");
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
 
     // Camera view Matrix
     glm::mat4 view = gCamera.GetViewMatrix();
 
     // Projection set as perspective
-    glm::mat4 projection;
-    if (changePersp == false) {
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    glm::mat4 projection = UGetProjection();
+
+    // Drop objects outside the view frustum before anything is sorted or submitted
+    gRenderStats = RenderStats();
+    {
+        PROFILE_SCOPE("Scene update");
+        UUpdateInstanceMatrices(gScene);
+        if (gScene.boundsDirty)
+            UUpdateSceneBounds(gScene);
+    }
+    if (gUseCulling)
+    {
+        PROFILE_SCOPE("Culling");
+        const glm::mat4 viewProjection = projection * view;
+        CullBounds(gScene.bounds, ExtractFrustumPlanes(glm::value_ptr(viewProjection)), gVisible, gRenderStats.culling);
     }
     else
     {
-        projection = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.0f, 5.0f);
-    }
-    // Pass model, view, and projection to pyramid 
-    GLint modelLoc = glGetUniformLocation(tableProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(tableProgramId, "view");
-    GLint projLoc = glGetUniformLocation(tableProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference Shader for object and light color, and light and view posistion, then pass to Pyramid shader uniforms
-    GLint objectColorLoc = glGetUniformLocation(tableProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(tableProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(tableProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(tableProgramId, "viewPosition");
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+        gVisible.assign(gScene.transforms.size(), 1);
+        gRenderStats.culling = { (unsigned)gVisible.size(), 0, (unsigned)gVisible.size() };
+    }
 
-    GLint UVScaleLoc = glGetUniformLocation(tableProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    // Ask for the mip levels the visible objects need and stream towards them before anything samples
+    {
+        PROFILE_SCOPE("Texture streaming");
+        PROFILE_GPU_SCOPE("Texture streaming");
+        URequestTextureLevels(gScene, gVisible, projection);
+        // Replays and flythroughs stream everything requested at once, so the levels sampled do not depend on how fast frames are
+        UStreamTextureLevels(gInputReplay.IsLoaded() || !gFlightPaths.empty() ? DBL_MAX : TEXTURE_STREAM_BUDGET_MS);
+    }
 
-    // Activate and bind textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+    // Sort the scene so draws sharing a program, texture and VAO end up next to each other
+    {
+        PROFILE_SCOPE("Draw queue");
+        UBuildDrawQueue(gScene, gVisible, gCamera.Position, gCamera.Front, gDrawQueue);
+    }
 
-    // Draw Pyramid
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+    glActiveTexture(GL_TEXTURE0);
 
-    glBindVertexArray(gMesh.vao2);
+    // Time only the CPU side of submitting the queue
+    const int path = gUseMultiDraw ? 1 : 0;
+    auto submitStart = std::chrono::steady_clock::now();
 
+    {
+        PROFILE_SCOPE("Submit");
+        PROFILE_GPU_SCOPE("Scene draws");
+        if (gUseMultiDraw)
+            USubmitMultiDraw(view, projection);
+        else
+            USubmitDrawQueue(view, projection);
+    }
 
-    // Set the shader to pyramid
-    glUseProgram(tableClothProgramId);
+    gSubmitSeconds[path] += std::chrono::duration<double>(std::chrono::steady_clock::now() - submitStart).count();
+    ++gSubmitFrames[path];
 
-    // Pass model, view, and projection to pyramid 
-    modelLoc = glGetUniformLocation(tableClothProgramId, "model");
-    viewLoc = glGetUniformLocation(tableClothProgramId, "view");
-    projLoc = glGetUniformLocation(tableClothProgramId, "projection");
+    // Deactivate VAO and Shader
+    glBindVertexArray(0);
+    glUseProgram(0);
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-    // Reference Shader for object and light color, and light and view posistion, then pass to Pyramid shader uniforms
-    objectColorLoc = glGetUniformLocation(tableClothProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(tableClothProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(tableClothProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(tableClothProgramId, "viewPosition");
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    PROFILE_SCOPE("Present");
+    UPresentFrame();
+}
 
-    UVScaleLoc = glGetUniformLocation(tableClothProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
 
-    // Activate and bind textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTexture2Id);
+// Perspective by default, orthographic after K is pressed
+glm::mat4 UGetProjection()
+{
+    if (changePersp == false) {
+        return glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)gFramebufferWidth / (GLfloat)gFramebufferHeight, 0.1f, 100.0f);
+    }
+    else
+    {
+        return glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.0f, 5.0f);
+    }
+}
 
-    // Draw Pyramid
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices2);
 
-    /////////////////////////
-    glBindVertexArray(gMesh.vao3);
+// Prints the average frame time of the stress scene about once a second
+void UReportStressFrame(float deltaTime)
+{
+    static float elapsed = 0.0f;
+    static unsigned frames = 0;
+
+    elapsed += deltaTime;
+    ++frames;
+    if (elapsed < 1.0f)
+        return;
+
+    cout << "INFO: Stress " << gOptions.stressDice << " dice, " << (gUseMultiDraw ? "instanced multi-draw" : "per-object draws") << ": "
+        << elapsed * 1000.0f / frames << " ms/frame, " << gRenderStats.drawCalls << " draws, "
+        << GpuResources().TotalBytes() / (1024.0 * 1024.0) << " MB GPU memory" << endl;
+    elapsed = 0.0f;
+    frames = 0;
+}
 
 
-    // Set the shader to pyramid
-    glUseProgram(diceProgramId);
+// Binds a program and sets the uniforms that are the same for every object this frame
+void UBindFrameUniforms(const GLProgram* program, const glm::mat4& view, const glm::mat4& projection)
+{
+    const glm::vec3 cameraPosition = gCamera.Position;
 
-    // Pass model, view, and projection to pyramid 
-    modelLoc = glGetUniformLocation(diceProgramId, "model");
-    viewLoc = glGetUniformLocation(diceProgramId, "view");
-    projLoc = glGetUniformLocation(diceProgramId, "projection");
+    glUseProgram(program->id);
+    glUniformMatrix4fv(program->view, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(program->projection, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3f(program->objectColor, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+    glUniform3f(program->lightColor, gLightColor.r, gLightColor.g, gLightColor.b);
+    glUniform3f(program->lightPos, gLightPosition.x, gLightPosition.y, gLightPosition.z);
+    glUniform3f(program->viewPosition, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    ++gRenderStats.programBinds;
+}
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-    // Reference Shader for object and light color, and light and view posistion, then pass to Pyramid shader uniforms
-    objectColorLoc = glGetUniformLocation(diceProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(diceProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(diceProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(diceProgramId, "viewPosition");
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+// Sets the dequantization uniforms of a mesh drawn through the per-object path
+void UBindMeshUniforms(const GLProgram* program, const GLMesh& mesh)
+{
+    glUniform3fv(program->positionOffset, 1, glm::value_ptr(mesh.positionOffset));
+    glUniform3fv(program->positionScale, 1, glm::value_ptr(mesh.positionScale));
+    glUniform4fv(program->uvTransform, 1, glm::value_ptr(mesh.uvTransform));
+}
 
-    UVScaleLoc = glGetUniformLocation(diceProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
 
-    // Activate and bind textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTexture3Id);
+// Uploads a normal matrix stored as three padded columns
+void USetNormalMatrix(const GLProgram* program, const glm::vec4* columns)
+{
+    if (program->normalMatrix < 0)
+        return;
 
-    // Draw Pyramid
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices3);
-    /////////////////////////
-    //********************
-    
-    glBindVertexArray(gMesh.vao4);
+    GLfloat normalMatrix[9];
+    for (int column = 0; column < 3; ++column)
+    {
+        for (int row = 0; row < 3; ++row)
+            normalMatrix[column * 3 + row] = columns[column][row];
+    }
+    glUniformMatrix3fv(program->normalMatrix, 1, GL_FALSE, normalMatrix);
+}
 
 
-    // Set the shader to pyramid
-    glUseProgram(boxProgramId);
+// Binds the VAO of a vertex format unless it is already bound
+void UBindVertexFormat(VertexFormat format, int& boundFormat)
+{
+    if (format == boundFormat)
+        return;
 
-    // Pass model, view, and projection to pyramid 
-    modelLoc = glGetUniformLocation(boxProgramId, "model");
-    viewLoc = glGetUniformLocation(boxProgramId, "view");
-    projLoc = glGetUniformLocation(boxProgramId, "projection");
+    glBindVertexArray(gScene.vaos[format]);
+    boundFormat = format;
+    ++gRenderStats.vaoBinds;
+}
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-    // Reference Shader for object and light color, and light and view posistion, then pass to Pyramid shader uniforms
-    objectColorLoc = glGetUniformLocation(boxProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(boxProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(boxProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(boxProgramId, "viewPosition");
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+// Draws the queue one object at a time, uploading each object's model matrix as a uniform
+void USubmitDrawQueue(const glm::mat4& view, const glm::mat4& projection)
+{
+    const GLProgram* boundProgram = nullptr;
+    GLuint boundTexture = 0;
+    uint32_t boundMaterial = UINT32_MAX;
+    uint32_t boundMesh = UINT32_MAX;
+    int boundFormat = -1;
 
-    UVScaleLoc = glGetUniformLocation(boxProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    for (const DrawItem& item : gDrawQueue)
+    {
+        const uint32_t meshId = gScene.meshIds[item.object];
+        const GLMesh& mesh = gScene.meshes[meshId];
+        const uint32_t materialId = gScene.materialIds[item.object];
+        const GLMaterial& material = gScene.materials[materialId];
+        const GLProgram* program = material.program;
 
-    // Activate and bind textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTexture4Id);
+        if (program != boundProgram)
+        {
+            UBindFrameUniforms(program, view, projection);
+            boundProgram = program;
+            boundMaterial = UINT32_MAX;
+            boundMesh = UINT32_MAX;
+        }
 
-    // Draw Pyramid
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices4);
-    
-    //********************
+        if (meshId != boundMesh)
+        {
+            UBindVertexFormat(mesh.format, boundFormat);
+            UBindMeshUniforms(program, mesh);
+            boundMesh = meshId;
+        }
 
+        if (materialId != boundMaterial)
+        {
+            glUniform2fv(program->uvScale, 1, glm::value_ptr(material.uvScale));
+            glUniform1ui(program->textureLayer, material.textureLayer);
+            glUniform1f(program->textureMinLod, UTextureMinLod(material));
+            boundMaterial = materialId;
+        }
 
+        // Activate and bind textures; materials of one texture class share the array
+        if (material.textureId != 0 && material.textureId != boundTexture)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, material.textureId);
+            boundTexture = material.textureId;
+            ++gRenderStats.textureBinds;
+        }
 
+        // Without instancing every copy of an object is its own draw with its own model matrix upload
+        const uint32_t firstInstance = gScene.firstInstances[item.object];
+        for (uint32_t instance = firstInstance; instance < firstInstance + gScene.instanceCounts[item.object]; ++instance)
+        {
+            glUniformMatrix4fv(program->model, 1, GL_FALSE, glm::value_ptr(gScene.instanceModels[instance]));
+            USetNormalMatrix(program, &gScene.instanceNormalMatrices[instance * 3]);
 
-    glBindVertexArray(gMesh.vao5);
+            glDrawElementsBaseVertex(GL_TRIANGLES, mesh.nIndices, gScene.indexType, (const void*)((size_t)mesh.firstIndex * gScene.indexSize), mesh.baseVertex);
+            ++gRenderStats.drawCalls;
+            ++gRenderStats.objectsDrawn;
+        }
+    }
+}
 
 
-    // Set the shader to pyramid
-    glUseProgram(candleProgramId);
+// Turns the sorted queue into indirect commands and issues one glMultiDrawElementsIndirect per run of
+// objects sharing a program and texture. Objects whose material has no multi-draw variant (the lamp)
+// are drawn individually.
+void USubmitMultiDraw(const glm::mat4& view, const glm::mat4& projection)
+{
+    GLMultiDraw& multiDraw = gMultiDraw;
+    if (gScene.dirty)
+        UUploadMultiDrawData(gScene, multiDraw);
+    else if (gScene.materialsDirty)
+        UUploadMaterialRecords(gScene, multiDraw);
+
+    // One command per object drawing all of its instances; baseInstance is the object's first instance,
+    // which the draw id attribute turns into the index of each instance's ObjectRecord
+    multiDraw.commands.clear();
+    for (const DrawItem& item : gDrawQueue)
+    {
+        const GLMaterial& material = gScene.materials[gScene.materialIds[item.object]];
+        if (!material.multiDrawProgram)
+            continue;
 
-    // Pass model, view, and projection to pyramid 
-    modelLoc = glGetUniformLocation(candleProgramId, "model");
-    viewLoc = glGetUniformLocation(candleProgramId, "view");
-    projLoc = glGetUniformLocation(candleProgramId, "projection");
+        const GLMesh& mesh = gScene.meshes[gScene.meshIds[item.object]];
+        multiDraw.commands.push_back({ mesh.nIndices, gScene.instanceCounts[item.object], mesh.firstIndex, mesh.baseVertex, gScene.firstInstances[item.object] });
+    }
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, multiDraw.indirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, multiDraw.commands.size() * sizeof(DrawElementsIndirectCommand), multiDraw.commands.data(), GL_STREAM_DRAW);
+    multiDraw.indirectBuffer.SetBytes(multiDraw.commands.size() * sizeof(DrawElementsIndirectCommand));
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, multiDraw.objectBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, multiDraw.materialBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, multiDraw.meshBuffer);
 
-    // Reference Shader for object and light color, and light and view posistion, then pass to Pyramid shader uniforms
-    objectColorLoc = glGetUniformLocation(candleProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(candleProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(candleProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(candleProgramId, "viewPosition");
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    // Walk the queue again in the same order, cutting a run whenever the program, texture or vertex format changes
+    const GLProgram* boundProgram = nullptr;
+    GLuint boundTexture = 0;
+    int boundFormat = -1;
+    size_t runStart = 0, command = 0;
 
-    UVScaleLoc = glGetUniformLocation(candleProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    auto flushRun = [&]()
+    {
+        if (command == runStart)
+            return;
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gScene.indexType, (const void*)(runStart * sizeof(DrawElementsIndirectCommand)), (GLsizei)(command - runStart), 0);
+        ++gRenderStats.drawCalls;
+        runStart = command;
+    };
 
-    // Activate and bind textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTexture5Id);
+    for (const DrawItem& item : gDrawQueue)
+    {
+        const uint32_t materialId = gScene.materialIds[item.object];
+        const GLMaterial& material = gScene.materials[materialId];
+        const GLProgram* program = material.multiDrawProgram ? material.multiDrawProgram : material.program;
+        const GLMesh& mesh = gScene.meshes[gScene.meshIds[item.object]];
 
-    // Draw Pyramid
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices5);
+        if (program != boundProgram || (material.textureId != 0 && material.textureId != boundTexture) || mesh.format != boundFormat)
+            flushRun();
 
+        UBindVertexFormat(mesh.format, boundFormat);
 
-    
+        if (program != boundProgram)
+        {
+            UBindFrameUniforms(program, view, projection);
+            boundProgram = program;
+        }
 
-    
+        if (material.textureId != 0 && material.textureId != boundTexture)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, material.textureId);
+            boundTexture = material.textureId;
+            ++gRenderStats.textureBinds;
+        }
 
+        if (material.multiDrawProgram)
+        {
+            gRenderStats.objectsDrawn += gScene.instanceCounts[item.object];
+            ++command;
+        }
+        else
+        {
+            // Per-object fallback, exactly as USubmitDrawQueue does it
+            UBindMeshUniforms(program, mesh);
+            glUniform2fv(program->uvScale, 1, glm::value_ptr(material.uvScale));
+            glUniform1ui(program->textureLayer, material.textureLayer);
+            glUniform1f(program->textureMinLod, UTextureMinLod(material));
+            glUniformMatrix4fv(program->model, 1, GL_FALSE, glm::value_ptr(gScene.instanceModels[gScene.firstInstances[item.object]]));
+            glDrawElementsBaseVertex(GL_TRIANGLES, mesh.nIndices, gScene.indexType, (const void*)((size_t)mesh.firstIndex * gScene.indexSize), mesh.baseVertex);
+            ++gRenderStats.drawCalls;
+            ++gRenderStats.objectsDrawn;
+        }
+    }
+    flushRun();
 
-    glBindVertexArray(gMesh.vao2);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
 
-    // Light shader
-    glUseProgram(lightProgramId);
 
-    //Translate light to be based on prefered size / location
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+// Copies object transforms, material and mesh data into the shader storage buffers the multi-draw shader reads
+void UUploadMultiDrawData(Scene& scene, GLMultiDraw& multiDraw)
+{
+    if (!multiDraw.objectBuffer)
+    {
+        multiDraw.objectBuffer = GpuBuffer::Create("multi-draw objects");
+        multiDraw.materialBuffer = GpuBuffer::Create("multi-draw materials");
+        multiDraw.meshBuffer = GpuBuffer::Create("multi-draw meshes");
+        multiDraw.indirectBuffer = GpuBuffer::Create("multi-draw commands");
+        multiDraw.drawIdBuffer = GpuBuffer::Create("multi-draw draw ids");
+    }
 
-    // Ref light shader for matrix info
-    modelLoc = glGetUniformLocation(lightProgramId, "model");
-    viewLoc = glGetUniformLocation(lightProgramId, "view");
-    projLoc = glGetUniformLocation(lightProgramId, "projection");
+    UUpdateInstanceMatrices(scene);
 
-    // Pass data to Light matrix
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    std::vector<GLObjectRecord> objects(scene.instanceTransforms.size());
+    for (size_t i = 0; i < scene.transforms.size(); ++i)
+    {
+        for (uint32_t instance = scene.firstInstances[i]; instance < scene.firstInstances[i] + scene.instanceCounts[i]; ++instance)
+        {
+            objects[instance].model = scene.instanceModels[instance];
+            for (int column = 0; column < 3; ++column)
+                objects[instance].normalMatrix[column] = scene.instanceNormalMatrices[instance * 3 + column];
+            objects[instance].materialId = scene.materialIds[i];
+            objects[instance].meshId = scene.meshIds[i];
+        }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, multiDraw.objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(GLObjectRecord), objects.data(), GL_STATIC_DRAW);
+    multiDraw.objectBuffer.SetBytes(objects.size() * sizeof(GLObjectRecord));
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices2);
+    UUploadMaterialRecords(scene, multiDraw);
 
+    std::vector<GLMeshRecord> meshes(scene.meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        meshes[i].positionOffset = glm::vec4(scene.meshes[i].positionOffset, 0.0f);
+        meshes[i].positionScale = glm::vec4(scene.meshes[i].positionScale, 0.0f);
+        meshes[i].uvTransform = scene.meshes[i].uvTransform;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, multiDraw.meshBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, meshes.size() * sizeof(GLMeshRecord), meshes.data(), GL_STATIC_DRAW);
+    multiDraw.meshBuffer.SetBytes(meshes.size() * sizeof(GLMeshRecord));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
+    // The draw id attribute needs one entry per instance that can be drawn
+    if (multiDraw.drawIdCapacity < (GLsizei)objects.size())
+    {
+        std::vector<GLuint> drawIds(objects.size());
+        for (size_t i = 0; i < drawIds.size(); ++i)
+            drawIds[i] = (GLuint)i;
 
-    // Deactivate VAO and Shader
-    glBindVertexArray(0);
-    glUseProgram(0);
+        glBindBuffer(GL_ARRAY_BUFFER, multiDraw.drawIdBuffer);
+        glBufferData(GL_ARRAY_BUFFER, drawIds.size() * sizeof(GLuint), drawIds.data(), GL_STATIC_DRAW);
+        multiDraw.drawIdBuffer.SetBytes(drawIds.size() * sizeof(GLuint));
+        multiDraw.drawIdCapacity = (GLsizei)drawIds.size();
 
+        // Attribute 3 advances once per instance, so an instance's value is its baseInstance
+        for (int format = 0; format < VERTEX_FORMAT_COUNT; ++format)
+        {
+            glBindVertexArray(scene.vaos[format]);
+            glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+            glVertexAttribDivisor(3, 1);
+            glEnableVertexAttribArray(3);
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
-    glfwSwapBuffers(gWindow);
+    scene.dirty = false;
 }
 
 
-
-void UCreateMesh(GLMesh& mesh)
+// Copies the material table into its shader storage buffer. Texture residency changes land here on their
+// own, without re-uploading every instance.
+void UUploadMaterialRecords(Scene& scene, GLMultiDraw& multiDraw)
 {
-    // Position and Color data
-    const float repeat = 1.0f;
-
-    //static_meshes_3d::Cylinder C(1, 2, 3, true, true, true);
+    std::vector<GLMaterialRecord> materials(scene.materials.size());
+    for (size_t i = 0; i < materials.size(); ++i)
+    {
+        materials[i].uvScale = glm::vec4(scene.materials[i].uvScale, 0.0f, 0.0f);
+        materials[i].textureLayer = scene.materials[i].textureLayer;
+        materials[i].textureMinLod = UTextureMinLod(scene.materials[i]);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, multiDraw.materialBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(GLMaterialRecord), materials.data(), GL_STATIC_DRAW);
+    multiDraw.materialBuffer.SetBytes(materials.size() * sizeof(GLMaterialRecord));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    scene.materialsDirty = false;
+}
 
-    GLfloat verts[] = {
-        //Positions          //Normals           // Texture Coords
-        // --------------------------------------
 
-        //// UNDER TOP LEFT            VERT 0
-        //-2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
-        //// UNDER TOP RIGHT           VERT 1
-        //2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
-        //// UNDER BOTTOM LEFT         VERT 2
-        //-2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-        //// UNDER BOTTOM RIGHT        VERT 3
-        //2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
-        //// OVER TOP LEFT             VERT 4
-        //-2.0f,  1.0f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        //// OVER TOP RIGHT            VERT 5
-        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        //// OVER BOTTOM LEFT          VERT 6
-        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        //// OVER TOP RIGHT            VERT 7
-        //2.0f,  1.0f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+void UDestroyMultiDraw(GLMultiDraw& multiDraw)
+{
+    multiDraw = GLMultiDraw();
+}
 
 
-        //**************TABLE****************
+// Registers a material, giving its program and texture the small ids the draw key is built from
+uint32_t UAddMaterial(Scene& scene, const GLProgram* program, const GLProgram* multiDrawProgram, GLuint textureId, uint32_t textureLayer, glm::vec2 uvScale)
+{
+    auto keyOf = [](auto& table, auto value) -> uint32_t
+    {
+        auto it = std::find(table.begin(), table.end(), value);
+        if (it != table.end())
+            return (uint32_t)(it - table.begin());
+        table.push_back(value);
+        return (uint32_t)table.size() - 1;
+    };
 
+    GLMaterial material;
+    material.program = program;
+    material.multiDrawProgram = multiDrawProgram;
+    material.textureId = textureId;
+    material.textureLayer = textureLayer;
+    material.uvScale = uvScale;
+    material.programKey = keyOf(scene.programs, program);
+    material.textureKey = keyOf(scene.textures, textureId);
+
+    scene.materials.push_back(material);
+    scene.dirty = true;
+    return (uint32_t)scene.materials.size() - 1;
+}
 
-        // SQUARE 0 verts 046620
-        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
-        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
 
-        // SQUARE 1 verts 154401
+// Adds an object to the scene and returns its id
+uint32_t UAddObject(Scene& scene, uint32_t meshId, uint32_t materialId, const glm::mat4& transform)
+{
+    return UAddInstancedObject(scene, meshId, materialId, transform, { glm::mat4(1.0f) });
+}
 
-        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
-        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
 
-        // SQUARE 2 verts 375513
-        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+// Adds an object drawn once per instance transform, each relative to the object's transform, and returns its id
+uint32_t UAddInstancedObject(Scene& scene, uint32_t meshId, uint32_t materialId, const glm::mat4& transform, const std::vector<glm::mat4>& instances)
+{
+    scene.transforms.push_back(transform);
+    scene.meshIds.push_back(meshId);
+    scene.materialIds.push_back(materialId);
+    scene.firstInstances.push_back((uint32_t)scene.instanceTransforms.size());
+    scene.instanceCounts.push_back((uint32_t)instances.size());
+    scene.instanceTransforms.insert(scene.instanceTransforms.end(), instances.begin(), instances.end());
+    scene.dirty = true;
+    scene.matricesDirty = true;
+    scene.boundsDirty = true;
+    scene.bvhRebuild = true;
+    return (uint32_t)scene.transforms.size() - 1;
+}
 
-        // SQUARE 3 verts 267732
-        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
-        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
 
-        // SQUARE 4 verts 645576
-        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+// Moves an object. Its instances keep their place relative to it, so the BVH only needs a refit.
+void USetObjectTransform(Scene& scene, uint32_t object, const glm::mat4& transform)
+{
+    scene.transforms[object] = transform;
+    scene.dirty = true;
+    scene.matricesDirty = true;
+    scene.boundsDirty = true;
+    scene.bvhRefit = true;
+}
 
-        // SQUARE 5 verts 023310
-        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
-        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
-        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
-        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
 
-        ////  ***********TABLE CLOTH*************
+// Moves copies of a mesh authored on the table top to random spots on it, each turned about its own center.
+// The first copy stays where it was authored. Placement is seeded so every run draws the same scene.
+std::vector<glm::mat4> UScatterOnTable(const GLMesh& mesh, uint32_t count)
+{
+    // Table top extent in the table's model space
+    const glm::vec2 tableMin(-1.9f, -0.9f), tableMax(1.9f, 0.9f);
 
-        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        //-2.0f,  1.0f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        //2.0f,  1.0f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> x(tableMin.x, tableMax.x), z(tableMin.y, tableMax.y), angle(0.0f, glm::radians(360.0f));
 
+    std::vector<glm::mat4> instances(count, glm::mat4(1.0f));
+    const glm::vec3 center(mesh.center.x, 0.0f, mesh.center.z);
+    for (uint32_t i = 1; i < count; ++i)
+    {
+        glm::vec3 spot(x(random), 0.0f, z(random));
+        instances[i] = glm::translate(spot) * glm::rotate(angle(random), glm::vec3(0.0f, 1.0f, 0.0f)) * glm::translate(-center);
+    }
+    return instances;
+}
 
 
-    };
-    GLfloat verts2[] = {
-        //Positions          //Normals           // Texture Coords
-        // --------------------------------------
+// World space box and sphere of a mesh under a transform. The box is the box around the transformed box,
+// which the absolute value of the matrix gives directly; the sphere grows with the largest axis scale.
+void UTransformBounds(const GLMesh& mesh, const glm::mat4& model, glm::vec3& center, glm::vec3& extent, float& radius)
+{
+    center = glm::vec3(model * glm::vec4(mesh.center, 1.0f));
+    extent = glm::vec3(0.0f);
+    float scale = 0.0f;
+    for (int column = 0; column < 3; ++column)
+    {
+        extent += glm::abs(glm::vec3(model[column])) * mesh.extent[column];
+        scale = std::max(scale, glm::length(glm::vec3(model[column])));
+    }
+    radius = mesh.radius * scale;
+}
 
 
-        //  ***********TABLE CLOTH*************
+// Recomputes the world and normal matrix of every instance after objects were added or moved
+void UUpdateInstanceMatrices(Scene& scene)
+{
+    if (!scene.matricesDirty)
+        return;
 
-        -2.0f,  0.1001f,  0.4f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
-        -2.0f,  0.1001f, -0.4f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
-        2.0f,  0.1001f, -0.4f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1001f, -0.4f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
-        2.0f,  0.1001f,  0.4f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
-        -2.0f,  0.1001f,  0.4f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+    scene.instanceModels.resize(scene.instanceTransforms.size());
+    for (size_t i = 0; i < scene.transforms.size(); ++i)
+    {
+        for (uint32_t instance = scene.firstInstances[i]; instance < scene.firstInstances[i] + scene.instanceCounts[i]; ++instance)
+            scene.instanceModels[instance] = scene.transforms[i] * scene.instanceTransforms[instance];
+    }
+
+    scene.instanceNormalMatrices.resize(scene.instanceModels.size() * 3);
+    if (!scene.instanceModels.empty())
+        ComputeNormalMatrices(glm::value_ptr(scene.instanceModels[0]), &scene.instanceNormalMatrices[0].x, scene.instanceModels.size());
+    scene.matricesDirty = false;
+}
+
+
+// Rebuilds the instance BVH after instances were added, or refits it after they moved
+void UUpdateSceneBvh(Scene& scene)
+{
+    if (!scene.bvhRebuild && !scene.bvhRefit)
+        return;
+
+    UUpdateInstanceMatrices(scene);
+    scene.instanceBoxes.resize(scene.instanceTransforms.size());
+    for (size_t i = 0; i < scene.transforms.size(); ++i)
+    {
+        const GLMesh& mesh = scene.meshes[scene.meshIds[i]];
+        for (uint32_t instance = scene.firstInstances[i]; instance < scene.firstInstances[i] + scene.instanceCounts[i]; ++instance)
+        {
+            glm::vec3 center, extent;
+            float radius;
+            UTransformBounds(mesh, scene.instanceModels[instance], center, extent, radius);
+
+            const glm::vec3 lower = center - extent, upper = center + extent;
+            BvhBox& box = scene.instanceBoxes[instance];
+            box = BvhBox();
+            box.Grow(glm::value_ptr(lower));
+            box.Grow(glm::value_ptr(upper));
+        }
+    }
+
+    if (scene.bvhRebuild)
+        scene.instanceBvh.Build(scene.instanceBoxes);
+    else
+        scene.instanceBvh.Refit(scene.instanceBoxes);
+    scene.bvhRebuild = scene.bvhRefit = false;
+}
+
+
+// Finds the closest triangle the ray hits. Candidate instances come from the instance BVH; the ray is then
+// moved into the instance's model space, which keeps distances along it unchanged, and run through the mesh BVH.
+bool URayCast(Scene& scene, const glm::vec3& origin, const glm::vec3& direction, RayHit& hit)
+{
+    UUpdateSceneBvh(scene);
+
+    const BvhRay ray(glm::value_ptr(origin), glm::value_ptr(direction));
+    float distance = FLT_MAX;
+    uint32_t hitTriangle = UINT32_MAX;
+
+    const uint32_t hitInstance = scene.instanceBvh.Intersect(ray, distance, [&](uint32_t instance, float& t)
+    {
+        // Instances are stored in object order, so the owner is the last object starting at or before it
+        const uint32_t object = (uint32_t)(std::upper_bound(scene.firstInstances.begin(), scene.firstInstances.end(), instance) - scene.firstInstances.begin()) - 1;
+        const PickMesh& mesh = scene.pickMeshes[scene.meshIds[object]];
+        const glm::mat4 toModel = glm::inverse(scene.instanceModels[instance]);
+        const glm::vec3 modelOrigin = glm::vec3(toModel * glm::vec4(origin, 1.0f));
+        const glm::vec3 modelDirection = glm::vec3(toModel * glm::vec4(direction, 0.0f));
+        const BvhRay modelRay(glm::value_ptr(modelOrigin), glm::value_ptr(modelDirection));
+
+        const uint32_t triangle = mesh.bvh.Intersect(modelRay, t, [&](uint32_t triangle, float& triangleT)
+        {
+            const uint32_t* corners = &mesh.indices[triangle * 3];
+            return IntersectTriangle(modelRay, &mesh.positions[corners[0] * 3], &mesh.positions[corners[1] * 3], &mesh.positions[corners[2] * 3], triangleT);
+        });
+        if (triangle == UINT32_MAX)
+            return false;
+
+        hitTriangle = triangle;
+        return true;
+    });
+
+    if (hitInstance == UINT32_MAX)
+        return false;
+
+    hit.object = (uint32_t)(std::upper_bound(scene.firstInstances.begin(), scene.firstInstances.end(), hitInstance) - scene.firstInstances.begin()) - 1;
+    hit.instance = hitInstance;
+    hit.triangle = hitTriangle;
+    hit.distance = distance;
+    return true;
+}
+
+
+// Turns a window position into a world space ray through the camera, with a unit direction. Cursor positions
+// are in screen coordinates, so they are measured against the window's current size rather than the
+// framebuffer's, which differs on high DPI displays.
+void UPickRay(double x, double y, glm::vec3& origin, glm::vec3& direction)
+{
+    int width = gOptions.width, height = gOptions.height;
+    if (gWindow)
+        glfwGetWindowSize(gWindow, &width, &height);
+
+    const glm::mat4 inverseViewProjection = glm::inverse(UGetProjection() * gCamera.GetViewMatrix());
+    const float ndcX = (float)(2.0 * x / std::max(width, 1) - 1.0);
+    const float ndcY = (float)(1.0 - 2.0 * y / std::max(height, 1));
+
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+    origin = glm::vec3(nearPoint) / nearPoint.w;
+    direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+}
+
+
+// Microbenchmark for the BVH on a random triangle soup: build, refit and closest hit queries
+void UBenchmarkBvh(uint32_t triangleCount)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f), offset(-0.1f, 0.1f);
+
+    std::vector<float> positions(triangleCount * 9);
+    std::vector<BvhBox> boxes(triangleCount);
+    for (uint32_t triangle = 0; triangle < triangleCount; ++triangle)
+    {
+        const float center[3] = { position(random), position(random), position(random) };
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            float* vertex = &positions[triangle * 9 + corner * 3];
+            for (int axis = 0; axis < 3; ++axis)
+                vertex[axis] = center[axis] + offset(random);
+            boxes[triangle].Grow(vertex);
+        }
+    }
+
+    Bvh bvh;
+    Clock::time_point start = Clock::now();
+    bvh.Build(boxes);
+    const double buildMs = milliseconds(start);
+
+    start = Clock::now();
+    bvh.Refit(boxes);
+    const double refitMs = milliseconds(start);
+
+    // Rays from outside the soup towards random points in it
+    const int rayCount = 100000;
+    unsigned hits = 0;
+    start = Clock::now();
+    for (int i = 0; i < rayCount; ++i)
+    {
+        const glm::vec3 origin(position(random), position(random), -20.0f);
+        const glm::vec3 direction = glm::normalize(glm::vec3(position(random), position(random), 0.0f) - origin);
+        const BvhRay ray(glm::value_ptr(origin), glm::value_ptr(direction));
+        float t = FLT_MAX;
+        const uint32_t hit = bvh.Intersect(ray, t, [&](uint32_t triangle, float& triangleT)
+        {
+            const float* corners = &positions[triangle * 9];
+            return IntersectTriangle(ray, corners, corners + 3, corners + 6, triangleT);
+        });
+        hits += hit != UINT32_MAX;
+    }
+    const double queryMs = milliseconds(start);
+
+    cout << "INFO: BVH " << triangleCount << " triangles, " << bvh.nodes.size() << " nodes: build " << buildMs << " ms ("
+        << triangleCount / buildMs / 1000.0 << " Mtri/s), refit " << refitMs << " ms" << endl;
+    cout << "INFO: BVH " << rayCount << " rays, " << hits << " hits: " << queryMs * 1000.0 / rayCount << " us/ray ("
+        << rayCount / queryMs / 1000.0 << " Mrays/s)" << endl;
+}
+
+
+// Vertex shader benchmark: a UV sphere of about triangleCount triangles drawn into a tiny viewport, so vertex
+// work dominates, with the normal matrix once from the CPU and once inverted per vertex. GPU time comes from
+// GL_TIME_ELAPSED queries around each batch of draws.
+void UBenchmarkVertexThroughput(uint32_t triangleCount)
+{
+    const uint32_t rings = std::max(2u, (uint32_t)std::sqrt(triangleCount / 4.0));
+    const uint32_t segments = rings * 2;
+
+    std::vector<GLfloat> vertices;
+    vertices.reserve((rings + 1) * (segments + 1) * 8);
+    for (uint32_t ring = 0; ring <= rings; ++ring)
+    {
+        const float theta = glm::radians(180.0f) * ring / rings;
+        for (uint32_t segment = 0; segment <= segments; ++segment)
+        {
+            const float phi = glm::radians(360.0f) * segment / segments;
+            const glm::vec3 normal(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            const GLfloat vertex[] = { normal.x, normal.y, normal.z, normal.x, normal.y, normal.z, (float)segment / segments, (float)ring / rings };
+            vertices.insert(vertices.end(), vertex, vertex + 8);
+        }
+    }
+
+    std::vector<GLuint> indices;
+    indices.reserve(rings * segments * 6);
+    for (uint32_t ring = 0; ring < rings; ++ring)
+    {
+        for (uint32_t segment = 0; segment < segments; ++segment)
+        {
+            const GLuint a = ring * (segments + 1) + segment, b = a + segments + 1;
+            const GLuint quad[] = { a, b, a + 1, a + 1, b, b + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    const GpuVertexArray vao = GpuVertexArray::Create("vertex benchmark");
+    const GpuBuffer vertexBuffer = GpuBuffer::Create("vertex benchmark vertices"), indexBuffer = GpuBuffer::Create("vertex benchmark indices");
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+    vertexBuffer.SetBytes(vertices.size() * sizeof(GLfloat));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    indexBuffer.SetBytes(indices.size() * sizeof(GLuint));
+    const GLint stride = sizeof(GLfloat) * 8;
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(GLfloat) * 3));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(GLfloat) * 6));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    // A non-uniform scale, so the CPU side takes the general inverse path
+    const glm::mat4 model = glm::translate(glm::vec3(0.0f, 0.0f, -3.0f)) * glm::scale(glm::vec3(1.0f, 0.5f, 0.8f));
+    glm::vec4 normalMatrix[3];
+    ComputeNormalMatrix(glm::value_ptr(model), &normalMatrix[0].x);
+
+    GLMesh identity;
+    identity.positionOffset = glm::vec3(0.0f);
+    identity.positionScale = glm::vec3(1.0f);
+    identity.uvTransform = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+
+    const glm::mat4 view = gCamera.GetViewMatrix();
+    const glm::mat4 projection = UGetProjection();
+    const int frames = 20, drawsPerFrame = 10;
+    glViewport(0, 0, 8, 8);
+    glDisable(GL_DEPTH_TEST);
+
+    GLuint query;
+    glGenQueries(1, &query);
+    double milliseconds[2] = { 0.0, 0.0 };
+    for (int variant = 0; variant < 2; ++variant)
+    {
+        const GLProgram* program = UGetShaderVariant(phongVertexShaderSource, phongFragmentShaderSource, UPhongDefines(0.2f, 0.8f, 16.0f, variant == 1));
+        if (!program)
+            break;
+
+        UBindFrameUniforms(program, view, projection);
+        UBindMeshUniforms(program, identity);
+        glUniform2fv(program->uvScale, 1, glm::value_ptr(gUVScale));
+        glUniformMatrix4fv(program->model, 1, GL_FALSE, glm::value_ptr(model));
+        USetNormalMatrix(program, normalMatrix);
+
+        // The first frame warms up the program and is not counted
+        for (int frame = -1; frame < frames; ++frame)
+        {
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            for (int draw = 0; draw < drawsPerFrame; ++draw)
+                glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, 0);
+            glEndQuery(GL_TIME_ELAPSED);
+
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+            if (frame >= 0)
+                milliseconds[variant] += nanoseconds / 1.0e6;
+        }
+    }
+    glDeleteQueries(1, &query);
+
+    const double draws = frames * drawsPerFrame;
+    const char* names[2] = { "inverse per vertex", "CPU normal matrix" };
+    cout << "INFO: Vertex benchmark, " << indices.size() / 3 << " triangles, " << vertices.size() / 8 << " vertices" << endl;
+    for (int variant = 0; variant < 2; ++variant)
+    {
+        cout << "INFO: " << names[variant] << ": " << milliseconds[variant] / draws << " ms/draw, "
+            << indices.size() * draws / milliseconds[variant] / 1000.0 << " Mverts/s" << endl;
+    }
+    if (milliseconds[1] > 0.0)
+        cout << "INFO: CPU normal matrix speedup: " << milliseconds[0] / milliseconds[1] << "x" << endl;
+
+    glBindVertexArray(0);
+    glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+}
 
 
+// Texture load benchmark over the given source images. Cold loads start with the cooked entry deleted, so
+// they read, decode, flip, mipmap and write the cache; warm loads hash the source and map the cooked file.
+// Both end with the payload copied out once, as a worker copies it into the pixel buffer ring, so the
+// warm number includes pulling the mapped pages in. Warm runs hit the OS page cache.
+void UBenchmarkTextureCache(const std::vector<std::string>& filenames)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    const int warmRuns = 5;
 
+    std::vector<unsigned char> staging;
+    auto load = [&](const std::string& filename, TextureImage& image)
+    {
+        // Cooked the way the scene cooks its layers
+        image.filename = filename;
+        image.targetSize = TEXTURE_ARRAY_LAYER_SIZE;
+        image.targetChannels = gTextureArrays[TEXTURE_CLASS_OPAQUE].channels;
+        if (!ULoadTextureImage(image))
+            return false;
+        staging.resize((size_t)image.header.payloadSize);
+        memcpy(staging.data(), UTexturePayload(image), staging.size());
+        return true;
     };
-    GLfloat verts3[] = {
-        //Positions          //Normals           // Texture Coords
-        // --------------------------------------
 
-        //  ****************DICE(D4)************************
+    double coldTotal = 0.0, warmTotal = 0.0;
+    uint64_t bytesTotal = 0;
+    for (const std::string& filename : filenames)
+    {
+        TextureImage cold;
+        cold.filename = filename;
+        cold.targetSize = TEXTURE_ARRAY_LAYER_SIZE;
+        cold.targetChannels = gTextureArrays[TEXTURE_CLASS_OPAQUE].channels;
+        std::remove(UTextureCachePath(cold).c_str());
+
+        Clock::time_point start = Clock::now();
+        if (!load(filename, cold))
+        {
+            cout << "ERROR: Failed to load texture " << filename << endl;
+            continue;
+        }
+        const double coldMs = milliseconds(start);
 
-        //  Points
-        // 
-        // Top Point    Point 3
-        //1.6f, 0.2f, 0.2f,    1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
-        // SW Point     Point 2
-        //1.5f, 0.10001f, 0.1f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
-        // SE Point     Point 1
-        //1.7f, 0.10001f, 0.1f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
-        // N Point      Point 0
-        //1.6f, 0.10001f, 0.2f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
+        double warmMs = 0.0;
+        bool warmHits = true;
+        for (int run = 0; run < warmRuns; ++run)
+        {
+            TextureImage warm;
+            start = Clock::now();
+            load(filename, warm);
+            warmMs += milliseconds(start) / warmRuns;
+            warmHits = warmHits && warm.cacheHit;
+        }
 
-        // BOTTOM 012
-        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+        cout << "INFO: Texture " << filename << " " << cold.levels[0].width << "x" << cold.levels[0].height << "x" << cold.header.channels
+            << ", " << cold.header.levelCount << " levels, " << cold.header.payloadSize / 1024 << " KB: cold " << coldMs << " ms, warm "
+            << warmMs << " ms" << (warmHits ? "" : " (WARNING: cache missed, was the entry written?)") << endl;
+        coldTotal += coldMs;
+        warmTotal += warmMs;
+        bytesTotal += cold.header.payloadSize;
+    }
 
-        // SOUTH FACE 123
-        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 1.0f, 0.0f,
+    cout << "INFO: Textures " << filenames.size() << ", " << bytesTotal / (1024 * 1024) << " MB of mip chains: cold " << coldTotal
+        << " ms, warm " << warmTotal << " ms (" << (warmTotal > 0.0 ? coldTotal / warmTotal : 0.0) << "x)" << endl;
+}
 
-        // NW FACE 013
-        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 0.5f, 0.5f,
 
-        // NE FACE 203
-        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 1.0f, 0.0f,
-    
+// Block compression benchmark over the given source images: every mip level is encoded in both qualities
+// on all cores, and once more on one core for the totals. PSNR is of level 0 against the decoded source.
+void UBenchmarkTextureCompression(const std::vector<std::string>& filenames)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    const unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const char* qualityNames[2] = { "fast", "high" };
+
+    uint64_t uncompressedTotal = 0, compressedTotal = 0, pixelTotal = 0;
+    double threadedMs[2] = { 0.0, 0.0 }, singleMs[2] = { 0.0, 0.0 };
+    for (const std::string& filename : filenames)
+    {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+        if (!pixels || (channels != 3 && channels != 4))
+        {
+            cout << "ERROR: Failed to load texture " << filename << endl;
+            stbi_image_free(pixels);
+            continue;
+        }
+
+        std::vector<unsigned char> chain;
+        std::vector<TextureLevel> levels;
+        BuildMipChain(pixels, width, height, channels, chain, levels);
+        stbi_image_free(pixels);
+
+        const BlockFormat format = channels == 4 ? BLOCK_BC3 : BLOCK_BC1;
+        uint64_t pixelCount = 0, compressedSize = 0;
+        for (const TextureLevel& level : levels)
+        {
+            pixelCount += (uint64_t)level.width * level.height;
+            compressedSize += CompressedSize(level.width, level.height, format);
+        }
+
+        std::vector<unsigned char> blocks(compressedSize), decoded((size_t)width * height * 4);
+        for (int quality = BLOCK_FAST; quality <= BLOCK_HIGH; ++quality)
+        {
+            for (unsigned threads : { threadCount, 1u })
+            {
+                Clock::time_point start = Clock::now();
+                size_t offset = 0;
+                for (const TextureLevel& level : levels)
+                {
+                    CompressImage(chain.data() + level.offset, level.width, level.height, channels, format, (BlockQuality)quality, blocks.data() + offset, threads);
+                    offset += CompressedSize(level.width, level.height, format);
+                }
+                const double encodeMs = milliseconds(start);
+                (threads == 1 ? singleMs : threadedMs)[quality] += encodeMs;
+                if (threads == 1)
+                    continue;
+
+                DecompressImage(blocks.data(), width, height, format, decoded.data());
+                cout << "INFO: Texture " << filename << " " << (format == BLOCK_BC3 ? "BC3" : "BC1") << " " << qualityNames[quality] << ": PSNR "
+                    << ImagePsnr(chain.data(), decoded.data(), width, height, channels) << " dB, " << pixelCount / encodeMs / 1000.0 << " MPix/s" << endl;
+            }
+        }
+
+        cout << "INFO: Texture " << filename << " " << width << "x" << height << "x" << channels << ", " << levels.size() << " levels: "
+            << chain.size() / 1024 << " KB uncompressed, " << compressedSize / 1024 << " KB compressed" << endl;
+        uncompressedTotal += chain.size();
+        compressedTotal += compressedSize;
+        pixelTotal += pixelCount;
+    }
+
+    cout << "INFO: Textures " << filenames.size() << ": " << uncompressedTotal / 1024 << " KB uncompressed, " << compressedTotal / 1024
+        << " KB compressed (" << (compressedTotal > 0 ? (double)uncompressedTotal / compressedTotal : 0.0) << "x smaller)" << endl;
+    for (int quality = BLOCK_FAST; quality <= BLOCK_HIGH; ++quality)
+    {
+        cout << "INFO: Encoder " << qualityNames[quality] << ": " << pixelTotal / singleMs[quality] / 1000.0 << " MPix/s on 1 thread, "
+            << pixelTotal / threadedMs[quality] / 1000.0 << " MPix/s on " << threadCount << " threads" << endl;
+    }
+}
+
+
+// Times every image kernel against its scalar version on the scene's textures, expanded to RGBA, plus a
+// synthetic RGBA image with grey texels and translucent alpha so the early outs of the checks are not what
+// gets measured. Byte results have to match exactly; the float filters report their largest difference.
+void UBenchmarkImageKernels(const std::vector<std::string>& filenames)
+{
+    typedef std::chrono::steady_clock Clock;
+    const int repeats = 5;
+
+    struct Image
+    {
+        std::string name;
+        std::vector<unsigned char> pixels;
+        int width, height, channels;
+    };
+    std::vector<Image> images;
+    for (const std::string& filename : filenames)
+    {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+        if (!pixels)
+        {
+            cout << "ERROR: Failed to load texture " << filename << endl;
+            continue;
+        }
+        Image image = { filename, std::vector<unsigned char>((size_t)width * height * 4), width, height, 4 };
+        ConvertChannels(pixels, (size_t)width * height, channels, image.pixels.data(), 4);
+        stbi_image_free(pixels);
+        images.push_back(std::move(image));
+    }
+
+    Image synthetic = { "synthetic 1024x1024", std::vector<unsigned char>(1024 * 1024 * 4), 1024, 1024, 4 };
+    uint32_t random = 12345;
+    for (size_t i = 0; i < synthetic.pixels.size(); i += 4)
+    {
+        random = random * 1664525u + 1013904223u;
+        synthetic.pixels[i] = synthetic.pixels[i + 1] = synthetic.pixels[i + 2] = (unsigned char)(random >> 24);
+        synthetic.pixels[i + 3] = (unsigned char)(random >> 16);
+    }
+    images.push_back(std::move(synthetic));
+
+    // Best of a few runs of one kernel, in MPix/s of the source image
+    auto measure = [&](size_t texels, auto kernel)
+    {
+        double best = DBL_MAX;
+        for (int run = 0; run < repeats; ++run)
+        {
+            const Clock::time_point start = Clock::now();
+            kernel();
+            best = std::min(best, std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        return texels / std::max(best, 1e-3);
+    };
+    auto report = [](const std::string& image, const char* kernel, double scalar, double simd, const std::string& check)
+    {
+        cout << "INFO: " << image << " " << kernel << ": " << scalar << " MPix/s scalar, " << simd << " MPix/s SIMD ("
+            << simd / scalar << "x), " << check << endl;
     };
+    auto matches = [](bool same) { return std::string(same ? "outputs match" : "OUTPUTS DIFFER"); };
 
+    for (const Image& image : images)
+    {
+        const int width = image.width, height = image.height;
+        const size_t texels = (size_t)width * height;
+        const int newWidth = std::max(width / 2, 1), newHeight = std::max(height / 2, 1);
+        std::vector<unsigned char> a(image.pixels), b(image.pixels), rgb(texels * 3), small((size_t)newWidth * newHeight * 4), smallScalar(small.size());
+        ConvertChannels(image.pixels.data(), texels, 4, rgb.data(), 3);
+
+        double scalar = measure(texels, [&]() { FlipRowsScalar(a.data(), width, height, 4); });
+        double simd = measure(texels, [&]() { FlipRows(b.data(), width, height, 4); });
+        report(image.name, "flip rows", scalar, simd, matches(a == b));
+
+        scalar = measure(texels, [&]() { ExpandRgbToRgbaScalar(rgb.data(), texels, a.data()); });
+        simd = measure(texels, [&]() { ExpandRgbToRgba(rgb.data(), texels, b.data()); });
+        report(image.name, "RGB to RGBA", scalar, simd, matches(a == b));
+
+        bool scalarResult = false, simdResult = false;
+        scalar = measure(texels, [&]() { scalarResult = IsGrayscaleScalar(image.pixels.data(), texels, 4); });
+        simd = measure(texels, [&]() { simdResult = IsGrayscale(image.pixels.data(), texels, 4); });
+        report(image.name, "grey check", scalar, simd, matches(scalarResult == simdResult) + (simdResult ? ", grey" : ", color"));
+
+        scalar = measure(texels, [&]() { scalarResult = IsOpaqueScalar(image.pixels.data(), texels, 4); });
+        simd = measure(texels, [&]() { simdResult = IsOpaque(image.pixels.data(), texels, 4); });
+        report(image.name, "opacity check", scalar, simd, matches(scalarResult == simdResult) + (simdResult ? ", opaque" : ", translucent"));
+
+        // In place, so each run starts from a fresh copy, which is timed in both columns alike
+        scalar = measure(texels, [&]() { a = image.pixels; PremultiplyAlphaScalar(a.data(), texels); });
+        simd = measure(texels, [&]() { b = image.pixels; PremultiplyAlpha(b.data(), texels); });
+        report(image.name, "premultiply", scalar, simd, matches(a == b));
+
+        std::vector<float> linear(texels * 4);
+        DecodeImage(image.pixels.data(), texels, 4, true, linear.data());
+        scalar = measure(texels, [&]() { EncodeImageScalar(linear.data(), texels, 4, true, a.data()); });
+        simd = measure(texels, [&]() { EncodeImage(linear.data(), texels, 4, true, b.data()); });
+        report(image.name, "linear to sRGB", scalar, simd, matches(a == b) + ", round trip " + (a == image.pixels ? "exact" : "within a step"));
+
+        scalar = measure(texels, [&]() { DownsampleBoxScalar(image.pixels.data(), width, height, 4, smallScalar.data()); });
+        simd = measure(texels, [&]() { DownsampleBox(image.pixels.data(), width, height, 4, small.data()); });
+        report(image.name, "box downsample", scalar, simd, matches(small == smallScalar));
+
+        std::vector<float> filtered((size_t)newWidth * newHeight * 4), filteredScalar(filtered.size());
+        scalar = measure(texels, [&]() { DownsampleImage<false>(linear.data(), width, height, 4, FILTER_KAISER, filteredScalar.data()); });
+        simd = measure(texels, [&]() { DownsampleImage<true>(linear.data(), width, height, 4, FILTER_KAISER, filtered.data()); });
+        float difference = 0.0f;
+        for (size_t i = 0; i < filtered.size(); ++i)
+            difference = std::max(difference, std::fabs(filtered[i] - filteredScalar[i]));
+        report(image.name, "Kaiser downsample", scalar, simd, "largest difference " + std::to_string(difference));
+
+        cout << "INFO: " << image.name << " " << width << "x" << height << " stores as " << MinimalChannels(image.pixels.data(), texels, 4)
+            << " channels" << endl;
+    }
+}
 
-    const float upY = 0.10001f;
-    GLfloat verts4[] = {
-        
+
+// Builds the mip chain of every scene texture with each filter, in sRGB and linear space, on one thread
+// and on every core, and prints the milliseconds each level took. Level 0 is the conversion to float.
+void UBenchmarkMipGeneration(const std::vector<std::string>& filenames)
+{
+    const unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const char* filterNames[3] = { "box", "kaiser", "lanczos" };
+
+    for (const std::string& filename : filenames)
+    {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+        if (!pixels)
+        {
+            cout << "ERROR: Failed to load texture " << filename << endl;
+            continue;
+        }
+
+        for (int filter = FILTER_BOX; filter <= FILTER_LANCZOS; ++filter)
+        {
+            for (bool srgb : { false, true })
+            {
+                for (unsigned threads : { 1u, threadCount })
+                {
+                    MipSettings settings = UMipSettings(threads);
+                    settings.filter = (ImageFilter)filter;
+                    settings.srgb = srgb;
+                    std::vector<unsigned char> payload;
+                    std::vector<TextureLevel> levels;
+                    std::vector<double> levelMs;
+                    GenerateMipChain(pixels, width, height, channels, settings, payload, levels, &levelMs);
+
+                    double total = 0.0;
+                    std::ostringstream perLevel;
+                    for (size_t level = 0; level < levelMs.size(); ++level)
+                    {
+                        perLevel << (level > 0 ? ", " : "") << levelMs[level];
+                        total += levelMs[level];
+                    }
+                    cout << "INFO: Texture " << filename << " " << width << "x" << height << "x" << channels << " " << filterNames[filter]
+                        << (srgb ? " sRGB" : " linear") << " on " << threads << (threads == 1 ? " thread: " : " threads: ") << total
+                        << " ms, per level " << perLevel.str() << " ms" << endl;
+                }
+            }
+        }
+        stbi_image_free(pixels);
+    }
+}
+
+
+// Decodes every image repeats times with each decoder that accepts it, first on one thread and then spread
+// over every core, each thread reusing one buffer sized from the header. Faster decoders are also checked
+// against stb_image, whose output may differ slightly for JPEGs since IDCTs round differently.
+void UBenchmarkImageDecoders(const std::vector<std::string>& filenames, uint32_t repeats)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    const unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const ImageDecoders& decoders = Decoders();
+
+    std::vector<std::vector<unsigned char>> sources(filenames.size());
+    for (size_t file = 0; file < filenames.size(); ++file)
+    {
+        if (!ReadWholeFile(filenames[file].c_str(), sources[file]))
+            cout << "ERROR: Failed to read " << filenames[file] << endl;
+    }
+
+    for (size_t index = 0; index < decoders.Count(); ++index)
+    {
+        const ImageDecoder& decoder = decoders[index];
+        uint64_t pixelTotal = 0;
+        double singleMs = 0.0, threadedMs = 0.0;
+        for (size_t file = 0; file < filenames.size(); ++file)
+        {
+            const std::vector<unsigned char>& source = sources[file];
+            ImageInfo info;
+            if (source.empty() || !decoder.Probe(source.data(), source.size(), info))
+            {
+                cout << "INFO: " << decoder.Name() << " does not decode " << filenames[file] << endl;
+                continue;
+            }
+
+            std::vector<unsigned char> pixels(info.Bytes());
+            Clock::time_point start = Clock::now();
+            bool decoded = true;
+            for (uint32_t repeat = 0; repeat < repeats; ++repeat)
+                decoded = decoder.Decode(source.data(), source.size(), info, pixels.data()) && decoded;
+            const double fileSingleMs = milliseconds(start);
+
+            // Decodes are handed out one at a time, so every core stays busy to the end
+            start = Clock::now();
+            ForEachTile((int)repeats, threadCount, UCookPool(), [&](int)
+            {
+                thread_local std::vector<unsigned char> buffer;
+                buffer.resize(info.Bytes());
+                decoder.Decode(source.data(), source.size(), info, buffer.data());
+            });
+            const double fileThreadedMs = milliseconds(start);
+
+            std::string check = decoded ? "" : ", FAILED";
+            std::vector<unsigned char> reference(info.Bytes());
+            if (decoded && &decoder != &decoders.Fallback() && decoders.Fallback().Decode(source.data(), source.size(), info, reference.data()))
+            {
+                int difference = 0;
+                for (size_t i = 0; i < pixels.size(); ++i)
+                    difference = std::max(difference, std::abs(pixels[i] - reference[i]));
+                check = ", largest difference from stb_image " + std::to_string(difference);
+            }
+
+            const uint64_t pixelCount = (uint64_t)info.width * info.height * repeats;
+            cout << "INFO: " << decoder.Name() << " " << filenames[file] << " " << info.width << "x" << info.height << "x" << info.channels << ": "
+                << fileSingleMs / repeats << " ms per decode, " << pixelCount / fileSingleMs / 1000.0 << " MPix/s on 1 thread, "
+                << pixelCount / fileThreadedMs / 1000.0 << " MPix/s on " << threadCount << " threads" << check << endl;
+            pixelTotal += pixelCount;
+            singleMs += fileSingleMs;
+            threadedMs += fileThreadedMs;
+        }
+
+        if (pixelTotal > 0)
+        {
+            cout << "INFO: " << decoder.Name() << " total: " << pixelTotal / singleMs / 1000.0 << " MPix/s on 1 thread, " << pixelTotal / threadedMs / 1000.0
+                << " MPix/s on " << threadCount << " threads (" << singleMs / threadedMs << "x)" << endl;
+        }
+    }
+}
+
+
+// Recomputes the world space box and sphere of every object from its mesh bounds and instance transforms
+void UUpdateSceneBounds(Scene& scene)
+{
+    const size_t objectCount = scene.transforms.size();
+    scene.bounds.Resize(objectCount);
+
+    for (size_t i = 0; i < objectCount; ++i)
+    {
+        const GLMesh& mesh = scene.meshes[scene.meshIds[i]];
+        glm::vec3 lower(FLT_MAX), upper(-FLT_MAX);
+
+        const uint32_t firstInstance = scene.firstInstances[i];
+        const uint32_t instanceCount = scene.instanceCounts[i];
+        float largestRadius = 0.0f;
+        for (uint32_t instance = firstInstance; instance < firstInstance + instanceCount; ++instance)
+        {
+            glm::vec3 center, extent;
+            float radius;
+            UTransformBounds(mesh, scene.instanceModels[instance], center, extent, radius);
+
+            lower = glm::min(lower, center - extent);
+            upper = glm::max(upper, center + extent);
+            largestRadius = std::max(largestRadius, radius);
+        }
+
+        const glm::vec3 center = (lower + upper) * 0.5f;
+        const glm::vec3 extent = (upper - lower) * 0.5f;
+
+        // One instance keeps its own sphere; a group of instances gets the sphere around its box
+        const float radius = instanceCount == 1 ? largestRadius : glm::length(extent);
+        scene.bounds.Set(i, glm::value_ptr(center), glm::value_ptr(extent), radius);
+    }
+
+    scene.boundsDirty = false;
+}
+
+
+// Fills the queue with one item per visible object, sorted by program, texture, mesh and then front to back
+void UBuildDrawQueue(const Scene& scene, const std::vector<uint8_t>& visible, const glm::vec3& viewPosition, const glm::vec3& viewDirection, std::vector<DrawItem>& queue)
+{
+    const float farPlane = 100.0f;
+    const uint64_t depthMax = (1u << 24) - 1;
+
+    const size_t objectCount = scene.transforms.size();
+    queue.clear();
+
+    for (size_t i = 0; i < objectCount; ++i)
+    {
+        if (!visible[i])
+            continue;
+
+        const GLMaterial& material = scene.materials[scene.materialIds[i]];
+        const uint32_t meshId = scene.meshIds[i];
+
+        // Distance along the view direction, quantized to 24 bits
+        glm::vec3 center = glm::vec3(scene.transforms[i] * glm::vec4(scene.meshes[meshId].center, 1.0f));
+        float depth = glm::dot(center - viewPosition, viewDirection) / farPlane;
+        depth = depth < 0.0f ? 0.0f : (depth > 1.0f ? 1.0f : depth);
+
+        DrawItem item;
+        item.key = ((uint64_t)(material.programKey & 0x3ff) << 54)
+            | ((uint64_t)(material.textureKey & 0xfff) << 42)
+            | ((uint64_t)(scene.meshes[meshId].format & 0x1) << 41)
+            | ((uint64_t)(meshId & 0x1fff) << 28)
+            | ((uint64_t)(depth * depthMax) << 4);
+        item.object = (uint32_t)i;
+        queue.push_back(item);
+    }
+
+    std::sort(queue.begin(), queue.end());
+}
+
+
+// Releases the scene's vertex arrays and buffers along with everything else it holds
+void UDestroyScene(Scene& scene)
+{
+    scene = Scene();
+}
+
+
+// Holds the hand authored vertex data and creates one mesh per object type, in SceneMesh order
+void UCreateSceneMeshes(Scene& scene)
+{
+    // Position and Color data
+    const float repeat = 1.0f;
+
+    //static_meshes_3d::Cylinder C(1, 2, 3, true, true, true);
+
+    GLfloat verts[] = {
         //Positions          //Normals           // Texture Coords
         // --------------------------------------
 
-        //  ****************BOX************************
+        //// UNDER TOP LEFT            VERT 0
+        //-2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+        //// UNDER TOP RIGHT           VERT 1
+        //2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
+        //// UNDER BOTTOM LEFT         VERT 2
+        //-2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+        //// UNDER BOTTOM RIGHT        VERT 3
+        //2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+        //// OVER TOP LEFT             VERT 4
+        //-2.0f,  1.0f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        //// OVER TOP RIGHT            VERT 5
+        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        //// OVER BOTTOM LEFT          VERT 6
+        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        //// OVER TOP RIGHT            VERT 7
+        //2.0f,  1.0f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+
+
+        //**************TABLE****************
+
+
+        // SQUARE 0 verts 046620
+        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+
+        // SQUARE 1 verts 154401
+
+        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
+
+        // SQUARE 2 verts 375513
+        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+
+        // SQUARE 3 verts 267732
+        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+
+        // SQUARE 4 verts 645576
+        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.1f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        -2.0f,  0.1f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+
+        // SQUARE 5 verts 023310
+        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+        -2.0f,  0.0f,  1.0f,  -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.0f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f, repeat,
+        2.0f,  0.0f, -1.0f,  1.0f, 0.0f, -1.0f,  repeat, repeat,
+        -2.0f,  0.0f, -1.0f, -1.0f, 0.0f, -1.0f,  repeat, 0.0f,
+
+        ////  ***********TABLE CLOTH*************
+
+        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        //-2.0f,  1.0f, -1.0f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        //2.0f,  1.0f, -1.0f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        //2.0f,  1.0f,  1.0f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        //-2.0f,  1.0f,  1.0f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+
+
+
+    };
+    GLfloat verts2[] = {
+        //Positions          //Normals           // Texture Coords
+        // --------------------------------------
+
+
+        //  ***********TABLE CLOTH*************
+
+        -2.0f,  0.1001f,  0.4f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+        -2.0f,  0.1001f, -0.4f,   -1.0f, 1.0f, -1.0f, repeat, 0.0f,
+        2.0f,  0.1001f, -0.4f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1001f, -0.4f,  1.0f, 1.0f, -1.0f,  repeat, repeat,
+        2.0f,  0.1001f,  0.4f,  1.0f, 1.0f, 1.0f,  0.0f, repeat,
+        -2.0f,  0.1001f,  0.4f,  -1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
+
+
+
+    };
+    GLfloat verts3[] = {
+        //Positions          //Normals           // Texture Coords
+        // --------------------------------------
+
+        //  ****************DICE(D4)************************
+
+        //  Points
+        // 
+        // Top Point    Point 3
+        //1.6f, 0.2f, 0.2f,    1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
+        // SW Point     Point 2
+        //1.5f, 0.10001f, 0.1f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
+        // SE Point     Point 1
+        //1.7f, 0.10001f, 0.1f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
+        // N Point      Point 0
+        //1.6f, 0.10001f, 0.2f, 1.0f, 1.0f, 1.0f, 0.5f, 0.5f,
+
+        // BOTTOM 012
+        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+
+        // SOUTH FACE 123
+        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 1.0f, 0.0f,
+
+        // NW FACE 013
+        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+        1.65f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 0.5f, 0.5f,
+
+        // NE FACE 203
+        1.55f, 0.10001f, -0.15f, 1.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+        1.6f, 0.10001f, -0.25f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+        1.6f, 0.2f, -0.2f,     1.0f, 1.0f, 0.0f, 1.0f, 0.0f,
+    
+    };
+
+
+    const float upY = 0.10001f;
+    GLfloat verts4[] = {
+        
+        //Positions          //Normals           // Texture Coords
+        // --------------------------------------
+
+        //  ****************BOX************************
 
         //  Points
         // Point 0
@@ -1255,287 +3198,1548 @@ void UCreateMesh(GLMesh& mesh)
         1.2f, upY, -0.8f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
 
 
-    
-    };
-    GLfloat verts5[]{
-        //Positions          //Normals           // Texture Coords
-        // --------------------------------------
+    
+    };
+    GLfloat verts5[]{
+        //Positions          //Normals           // Texture Coords
+        // --------------------------------------
+
+        //  ****************CANDLE************************
+
+        // SIDE 0 01 8890
+        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+
+        // SIDE 1 12 99 10 1
+        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+
+        // SIDE 2 23 10 10 11 3
+        1.2f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+
+        // SIDE 3 34 11 11 12 3
+        1.2f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        // SIDE 4 45 12 12 13 4
+        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        // SIDE 5 56 13 13 14 5
+        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        // SIDE 6 67 14 14 15 6
+        1.1f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        // SIDE 7 70 15 15 8 7
+        1.1f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        //BASE
+        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.1f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+    };
+    
+    
+
+    struct MeshSource { const char* name; const GLfloat* verts; GLsizeiptr size; };
+    const MeshSource sources[] = {
+        { "table", verts, sizeof(verts) },
+        { "table runner", verts2, sizeof(verts2) },
+        { "dice", verts3, sizeof(verts3) },
+        { "box", verts4, sizeof(verts4) },
+        { "candle", verts5, sizeof(verts5) },
+    };
+
+    // Weld and optimize every mesh, suballocating them from one vertex array per format and one index array
+    MeshData meshData;
+    GLuint largestMesh = 0;
+    for (const MeshSource& source : sources)
+    {
+        GLMesh mesh;
+        PickMesh pickMesh;
+        UAppendMesh(source.name, source.verts, source.size, meshData, mesh, pickMesh);
+        scene.meshes.push_back(mesh);
+        scene.pickMeshes.push_back(std::move(pickMesh));
+        largestMesh = std::max(largestMesh, mesh.nVertices);
+    }
+
+    // Indices are relative to each mesh's base vertex, so 16 bits are enough unless a single mesh is larger
+    scene.ebo = GpuBuffer::Create("scene indices");
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene.ebo);
+    if (largestMesh <= 0xffff)
+    {
+        std::vector<GLushort> shortIndices(meshData.indices.begin(), meshData.indices.end());
+        glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(GLushort), shortIndices.data(), 0);
+        scene.indexType = GL_UNSIGNED_SHORT;
+        scene.indexSize = sizeof(GLushort);
+    }
+    else
+    {
+        glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, meshData.indices.size() * sizeof(GLuint), meshData.indices.data(), 0);
+        scene.indexType = GL_UNSIGNED_INT;
+        scene.indexSize = sizeof(GLuint);
+    }
+    scene.ebo.SetBytes(meshData.indices.size() * scene.indexSize);
+
+    // One immutable buffer per vertex format holds every static mesh stored in that format
+    const GLsizeiptr bufferSizes[VERTEX_FORMAT_COUNT] = {
+        (GLsizeiptr)(meshData.floatVertices.size() * sizeof(GLfloat)),
+        (GLsizeiptr)(meshData.compactVertices.size() * sizeof(CompactVertex))
+    };
+    const void* bufferData[VERTEX_FORMAT_COUNT] = { meshData.floatVertices.data(), meshData.compactVertices.data() };
+
+    const char* const formatNames[VERTEX_FORMAT_COUNT] = { "float", "compact" };
+    for (int format = 0; format < VERTEX_FORMAT_COUNT; ++format)
+    {
+        scene.vaos[format] = GpuVertexArray::Create((std::string("scene ") + formatNames[format] + " vertex array").c_str());
+        scene.vbos[format] = GpuBuffer::Create((std::string("scene ") + formatNames[format] + " vertices").c_str());
+        glBindVertexArray(scene.vaos[format]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene.ebo); // The VAO keeps the element buffer binding
+
+        glBindBuffer(GL_ARRAY_BUFFER, scene.vbos[format]); // Activates the buffer
+        if (bufferSizes[format] > 0)
+            glBufferStorage(GL_ARRAY_BUFFER, bufferSizes[format], bufferData[format], 0); // Sends vertex or coordinate data to the GPU
+        scene.vbos[format].SetBytes(bufferSizes[format]);
+
+        if (format == FLOAT_VERTICES)
+        {
+            const GLuint floatsPerVertex = 3;
+            const GLuint floatsPerNormal = 3;
+            const GLuint floatsPerUV = 2;
+
+            // Strides between vertex coordinates is 8 (x, y, z, nx, ny, nz, u, v)
+            GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+
+            // Create Vertex Attribute Pointers
+            glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+            glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+            glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+        }
+        else
+        {
+            // Normalized integers arrive in the shader as [0, 1] (positions, UVs) and [-1, 1] (normals)
+            GLint stride = sizeof(CompactVertex);
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, position));
+            glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offsetof(CompactVertex, normal));
+            glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, uv));
+        }
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+    }
+
+    glBindVertexArray(0);
+
+    cout << "INFO: Vertex memory " << bufferSizes[FLOAT_VERTICES] + bufferSizes[COMPACT_VERTICES] << " bytes ("
+        << meshData.compactVertices.size() << " of " << meshData.floatVertices.size() / 8 + meshData.compactVertices.size() << " vertices compact)" << endl;
+}
+
+
+// Welds one interleaved position / normal / UV triangle soup into an indexed mesh, reorders it for the
+// post-transform cache and vertex fetch, picks its vertex format and appends it to the shared mesh data
+void UAppendMesh(const char* name, const GLfloat* verts, GLsizeiptr size, MeshData& meshData, GLMesh& mesh, PickMesh& pickMesh)
+{
+    const GLuint floatsPerEntry = 8;
+    const size_t soupVertices = size / (sizeof(verts[0]) * floatsPerEntry);
+
+    IndexedMesh indexed = WeldVertices(verts, soupVertices, floatsPerEntry);
+    const float weldedACMR = ComputeACMR(indexed.indices, indexed.VertexCount());
+    OptimizeVertexCache(indexed.indices, indexed.VertexCount());
+    OptimizeVertexFetch(indexed);
+    const float optimizedACMR = ComputeACMR(indexed.indices, indexed.VertexCount());
+
+    // An unindexed soup transforms every corner, an ACMR of 3
+    cout << "INFO: Mesh " << name << ": " << soupVertices << " -> " << indexed.VertexCount() << " vertices, ACMR 3.00 (soup) / "
+        << weldedACMR << " (welded) / " << optimizedACMR << " (optimized)" << endl;
+
+    mesh.firstIndex = (GLuint)meshData.indices.size();
+    mesh.nIndices = (GLuint)indexed.indices.size();
+    mesh.nVertices = (GLuint)indexed.VertexCount();
+
+    // Bounding box, used to sort the object by depth and to cull it, and the sphere around its center
+    auto positionOf = [&](GLuint i) { return glm::vec3(indexed.vertices[i * floatsPerEntry], indexed.vertices[i * floatsPerEntry + 1], indexed.vertices[i * floatsPerEntry + 2]); };
+    glm::vec3 lower = positionOf(0), upper = lower;
+    for (GLuint i = 0; i < mesh.nVertices; ++i)
+    {
+        lower = glm::min(lower, positionOf(i));
+        upper = glm::max(upper, positionOf(i));
+    }
+    mesh.center = (lower + upper) * 0.5f;
+    mesh.extent = (upper - lower) * 0.5f;
+    mesh.radius = 0.0f;
+    for (GLuint i = 0; i < mesh.nVertices; ++i)
+        mesh.radius = std::max(mesh.radius, glm::length(positionOf(i) - mesh.center));
+
+    // Full precision copy of the positions and a BVH over the triangles for ray queries
+    pickMesh.positions.resize(mesh.nVertices * 3);
+    for (GLuint i = 0; i < mesh.nVertices; ++i)
+        memcpy(&pickMesh.positions[i * 3], &indexed.vertices[i * floatsPerEntry], 3 * sizeof(float));
+    pickMesh.indices = indexed.indices;
+
+    std::vector<BvhBox> triangleBoxes(mesh.nIndices / 3);
+    for (size_t triangle = 0; triangle < triangleBoxes.size(); ++triangle)
+    {
+        for (int corner = 0; corner < 3; ++corner)
+            triangleBoxes[triangle].Grow(&pickMesh.positions[pickMesh.indices[triangle * 3 + corner] * 3]);
+    }
+    pickMesh.bvh.Build(triangleBoxes);
+
+    // Quantize when asked to and keep the result only if it decodes within tolerance of the float path
+    bool compact = false;
+    std::vector<CompactVertex> compactVertices;
+    QuantizationInfo quantization;
+    if (gOptions.compactVertices == COMPACT_ALWAYS || (gOptions.compactVertices == COMPACT_AUTO && mesh.nVertices >= COMPACT_MIN_VERTICES))
+    {
+        QuantizeVertices(indexed, compactVertices, quantization);
+        QuantizationError error = MeasureQuantizationError(indexed, compactVertices, quantization);
+        compact = error.position <= COMPACT_POSITION_TOLERANCE && error.normalDegrees <= COMPACT_NORMAL_TOLERANCE && error.uv <= COMPACT_UV_TOLERANCE;
+
+        cout << "INFO: Mesh " << name << " quantization error: position " << error.position << ", normal " << error.normalDegrees
+            << " deg, uv " << error.uv << (compact ? "" : " -> over tolerance, keeping float vertices") << endl;
+    }
+
+    if (compact)
+    {
+        mesh.format = COMPACT_VERTICES;
+        mesh.baseVertex = (GLint)meshData.compactVertices.size();
+        mesh.positionOffset = glm::vec3(quantization.positionOffset[0], quantization.positionOffset[1], quantization.positionOffset[2]);
+        mesh.positionScale = glm::vec3(quantization.positionScale[0], quantization.positionScale[1], quantization.positionScale[2]);
+        mesh.uvTransform = glm::vec4(quantization.uvOffset[0], quantization.uvOffset[1], quantization.uvScale[0], quantization.uvScale[1]);
+        meshData.compactVertices.insert(meshData.compactVertices.end(), compactVertices.begin(), compactVertices.end());
+    }
+    else
+    {
+        mesh.format = FLOAT_VERTICES;
+        mesh.baseVertex = (GLint)(meshData.floatVertices.size() / floatsPerEntry);
+        mesh.positionOffset = glm::vec3(0.0f);
+        mesh.positionScale = glm::vec3(1.0f);
+        mesh.uvTransform = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+        meshData.floatVertices.insert(meshData.floatVertices.end(), indexed.vertices.begin(), indexed.vertices.end());
+    }
+
+    meshData.indices.insert(meshData.indices.end(), indexed.indices.begin(), indexed.indices.end());
+}
+
+
+/*Generate and load the texture*/
+bool UCreateTexture(const char* filename, GpuTexture& texture)
+{
+    // Nothing else runs on the main thread meanwhile, so a cook can use every core
+    TextureImage image;
+    image.filename = filename;
+    if (!ULoadTextureImage(image, std::thread::hardware_concurrency()))
+        return false; // Error loading the image
+
+    texture = GpuTexture::Create(filename);
+    return UUploadTextureLevels(texture, image.header, image.levels.data(), UTexturePayload(image));
+}
+
+
+// GL formats for 8-bit images of the given channel count. One and two channel images are grey and grey
+// with alpha, which UUploadTextureLevels swizzles back to RGBA. Color is sRGB encoded with --srgb-textures;
+// GL has no core single channel sRGB format, so in that mode grey images are expanded before they get here.
+bool UGetTextureFormat(int channels, GLenum& internalFormat, GLenum& format)
+{
+    if (channels == 1)
+    {
+        internalFormat = GL_R8;
+        format = GL_RED;
+    }
+    else if (channels == 2)
+    {
+        internalFormat = GL_RG8;
+        format = GL_RG;
+    }
+    else if (channels == 3)
+    {
+        internalFormat = gOptions.srgbTextures ? GL_SRGB8 : GL_RGB8;
+        format = GL_RGB;
+    }
+    else if (channels == 4)
+    {
+        internalFormat = gOptions.srgbTextures ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+        format = GL_RGBA;
+    }
+    else
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Cooked file of a source image; directory separators are flattened so every entry sits in one directory.
+// Resized or converted cooks get their own entry, so a 2D texture and an array layer of the same source
+// do not keep replacing each other.
+std::string UTextureCachePath(const TextureImage& image)
+{
+    std::string name = image.filename;
+    std::replace(name.begin(), name.end(), '/', '_');
+    std::replace(name.begin(), name.end(), '\\', '_');
+    if (image.targetSize > 0 || image.targetChannels > 0)
+        name += "." + std::to_string(image.targetSize) + "x" + std::to_string(image.targetChannels);
+    return std::string(TEXTURE_CACHE_DIR) + "/" + name + ".gvtx";
+}
+
+
+// Whether textures are cooked to block compressed formats
+bool UCompressTextures()
+{
+    return gTextureCompressionSupported && gOptions.textureCompression != COMPRESSION_OFF;
+}
+
+
+// Encoder quality textures are cooked with, or false when they stay uncompressed
+bool UGetCookQuality(BlockQuality& quality)
+{
+    if (!UCompressTextures())
+        return false;
+
+    if (gOptions.textureCompression == COMPRESSION_AUTO)
+        quality = gOptions.textureCache ? BLOCK_HIGH : BLOCK_FAST;
+    else
+        quality = gOptions.textureCompression == COMPRESSION_HIGH ? BLOCK_HIGH : BLOCK_FAST;
+    return true;
+}
+
+
+// Mip generation settings of cooked textures, from the command line
+MipSettings UMipSettings(unsigned threadCount)
+{
+    MipSettings settings;
+    settings.filter = gOptions.mipFilter;
+    settings.srgb = gOptions.srgbTextures;
+    settings.alphaCutoff = gOptions.alphaCoverage;
+    settings.threadCount = threadCount;
+    settings.pool = threadCount > 1 ? UCookPool() : nullptr;
+    return settings;
+}
+
+
+// The pool multithreaded cooks take their helpers from. Only the main thread cooks on more than one
+// thread, so it is the only one that gets here.
+ThreadPool* UCookPool()
+{
+    if (!gCookPool)
+        gCookPool.reset(new ThreadPool());
+    return gCookPool.get();
+}
+
+
+// Mip generation time of the textures cooked so far, summed per level
+void UPrintMipTimings()
+{
+    std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+    if (gTextureLoader.mipLevelMs.empty())
+        return;
+
+    const char* filterNames[3] = { "box", "kaiser", "lanczos" };
+    double total = 0.0;
+    cout << "INFO: Mip generation (" << filterNames[gOptions.mipFilter] << (gOptions.srgbTextures ? ", linear" : "") << ") per level:";
+    for (size_t level = 0; level < gTextureLoader.mipLevelMs.size(); ++level)
+    {
+        cout << " " << level << ": " << gTextureLoader.mipLevelMs[level] << " ms";
+        total += gTextureLoader.mipLevelMs[level];
+    }
+    cout << ", " << total << " ms in all" << endl;
+}
+
+
+// Fills image with the full mip chain of image.filename, without touching OpenGL so workers can call it.
+// The source bytes are always read and hashed together with the cook settings; when the cooked file
+// carries the same hash it is mapped and used as is. Otherwise the image is decoded, converted and resized
+// to the image's targets, flipped, mipmapped, compressed when the context allows and written back to the
+// cache, replacing the stale entry.
+bool ULoadTextureImage(TextureImage& image, unsigned encodeThreads)
+{
+    std::vector<unsigned char> source;
+    if (!ReadWholeFile(image.filename.c_str(), source))
+        return false;
+
+    // The decoder counts as a setting too, since faster ones may round differently from stb_image
+    ImageInfo info;
+    const ImageDecoder* decoder = Decoders().Probe(source.data(), source.size(), info, gOptions.stbDecoderOnly);
+    if (!decoder)
+        return false;
+
+    BlockQuality quality = BLOCK_FAST;
+    const bool compress = UGetCookQuality(quality);
+    const uint32_t cookSettings[6] = { compress ? 1u + quality : 0u, (uint32_t)image.targetSize, (uint32_t)image.targetChannels, gOptions.srgbTextures ? 1u : 0u,
+        (uint32_t)gOptions.mipFilter, (uint32_t)(gOptions.alphaCoverage * 255.0f + 0.5f) };
+    uint64_t sourceHash = HashBytes((const unsigned char*)cookSettings, sizeof(cookSettings), HashBytes(source.data(), source.size()));
+    sourceHash = HashBytes((const unsigned char*)decoder->Name(), strlen(decoder->Name()), sourceHash);
+    const std::string cachePath = UTextureCachePath(image);
+    if (gOptions.textureCache)
+    {
+        std::shared_ptr<MappedFile> mapping = std::make_shared<MappedFile>();
+        const TextureLevel* levels = nullptr;
+        const unsigned char* payload = nullptr;
+        if (mapping->Open(cachePath.c_str()) && ParseCookedTexture(mapping->Data(), mapping->Size(), sourceHash, image.header, levels, payload))
+        {
+            image.levels.assign(levels, levels + image.header.levelCount);
+            image.mapping = mapping;
+            image.mappedPayload = payload;
+            image.cacheHit = true;
+            image.loaded = true;
+            ++gTextureLoader.cacheHits;
+            return true;
+        }
+    }
+
+    std::vector<unsigned char> pixels(info.Bytes());
+    {
+        PROFILE_SCOPE("Decode");
+        if (!decoder->Decode(source.data(), source.size(), info, pixels.data()))
+            return false;
+    }
+    int width = info.width, height = info.height, channels = info.channels;
+
+    // Without a target the texture gets the smallest format that loses nothing: grey sources saved as
+    // RGB drop to one channel and opaque alpha is dropped
+    int newChannels = image.targetChannels;
+    if (newChannels == 0)
+    {
+        newChannels = MinimalChannels(pixels.data(), (size_t)width * height, channels);
+        if (gOptions.srgbTextures && newChannels < 3)
+            newChannels += 2;
+    }
+    if (newChannels != channels)
+    {
+        std::vector<unsigned char> converted((size_t)width * height * newChannels);
+        ConvertChannels(pixels.data(), (size_t)width * height, channels, converted.data(), newChannels);
+        pixels.swap(converted);
+        channels = newChannels;
+    }
+    if (image.targetSize > 0 && (width != image.targetSize || height != image.targetSize))
+    {
+        std::vector<unsigned char> resized((size_t)image.targetSize * image.targetSize * channels);
+        ResizeImage(pixels.data(), width, height, channels, resized.data(), image.targetSize, image.targetSize);
+        pixels.swap(resized);
+        width = height = image.targetSize;
+    }
+
+    // Images are stored top row first, but OpenGL's first row is the bottom one
+    FlipRows(pixels.data(), width, height, channels);
+    if (!UCookTextureImage(image, pixels.data(), width, height, channels, compress, quality, encodeThreads))
+        return false;
+
+    image.header.sourceHash = sourceHash;
+    image.cacheHit = false;
+    image.loaded = true;
+    ++gTextureLoader.cacheMisses;
+
+    if (gOptions.textureCache && !(MakeDirectory(TEXTURE_CACHE_DIR) && WriteCookedTexture(cachePath, image.header, image.levels, image.cookedPayload.data())))
+        cout << "WARNING: Could not write cooked texture " << cachePath << endl;
+    return true;
+}
+
+
+// Builds the mip chain of an image that is already the right way up into image, compressing it when asked
+bool UCookTextureImage(TextureImage& image, const unsigned char* pixels, int width, int height, int channels, bool compress, BlockQuality quality, unsigned encodeThreads)
+{
+    GLenum internalFormat, format;
+    if (!UGetTextureFormat(channels, internalFormat, format))
+        return false;
+
+    image.levels.clear();
+    image.cookedPayload.clear();
+    std::vector<double> levelMs;
+    PROFILE_SCOPE("Mip chain");
+    GenerateMipChain(pixels, width, height, channels, UMipSettings(encodeThreads), image.cookedPayload, image.levels, &levelMs);
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        if (gTextureLoader.mipLevelMs.size() < levelMs.size())
+            gTextureLoader.mipLevelMs.resize(levelMs.size());
+        for (size_t level = 0; level < levelMs.size(); ++level)
+            gTextureLoader.mipLevelMs[level] += levelMs[level];
+    }
+
+    image.header.internalFormat = internalFormat;
+    image.header.format = format;
+    image.header.channels = channels;
+    image.header.blockBytes = 0;
+    image.header.levelCount = (uint32_t)image.levels.size();
+    image.header.payloadSize = image.cookedPayload.size();
+    // The block encoder takes color, so grey images stay uncompressed; at a byte or two per texel they
+    // are already smaller than RGB would be
+    if (compress && channels >= 3)
+        UCompressTextureImage(image, quality, encodeThreads);
+    return true;
+}
+
+
+// Replaces an uncompressed chain with BC1 blocks, or BC3 when it has alpha, level by level
+void UCompressTextureImage(TextureImage& image, BlockQuality quality, unsigned encodeThreads)
+{
+    PROFILE_SCOPE("Compress");
+    const int channels = image.header.channels;
+    const BlockFormat format = channels == 4 ? BLOCK_BC3 : BLOCK_BC1;
+
+    std::vector<unsigned char> blocks;
+    std::vector<TextureLevel> levels;
+    for (const TextureLevel& source : image.levels)
+    {
+        TextureLevel level = { blocks.size(), CompressedSize(source.width, source.height, format), source.width, source.height };
+        blocks.resize(blocks.size() + level.size);
+        CompressImage(image.cookedPayload.data() + source.offset, source.width, source.height, channels, format, quality,
+            blocks.data() + level.offset, encodeThreads);
+        levels.push_back(level);
+    }
+
+    if (gOptions.srgbTextures)
+        image.header.internalFormat = format == BLOCK_BC3 ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;
+    else
+        image.header.internalFormat = format == BLOCK_BC3 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    image.header.blockBytes = BlockBytes(format);
+    image.header.payloadSize = blocks.size();
+    image.levels.swap(levels);
+    image.cookedPayload.swap(blocks);
+}
+
+
+// Client memory holding the image's payload, or nullptr when it is in a pixel buffer slot
+const unsigned char* UTexturePayload(const TextureImage& image)
+{
+    if (image.slot >= 0)
+        return nullptr;
+    return image.mapping ? image.mappedPayload : image.cookedPayload.data();
+}
+
+
+// Replaces a texture's image with a single level, for images that have no mip chain such as placeholders
+bool UUploadTextureImage(GLuint textureId, const unsigned char* image, int width, int height, int channels)
+{
+    CookedTextureHeader header = {};
+    GLenum internalFormat, format;
+    if (!UGetTextureFormat(channels, internalFormat, format))
+        return false;
+
+    header.internalFormat = internalFormat;
+    header.format = format;
+    header.channels = channels;
+    header.levelCount = 1;
+    const TextureLevel level = { 0, (uint64_t)width * height * channels, (uint32_t)width, (uint32_t)height };
+    return UUploadTextureLevels(textureId, header, &level, image);
+}
+
+
+// Sets the sampling state of a texture and replaces its image, one level at a time from a cooked chain, so
+// nothing is decoded or mipmapped here. With a pixel buffer, payload is the offset of the chain in it.
+bool UUploadTextureLevels(GLuint textureId, const CookedTextureHeader& header, const TextureLevel* levels, const unsigned char* payload, GLuint pixelBuffer)
+{
+    glBindTexture(GL_TEXTURE_2D, textureId);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.levelCount - 1);
+
+    // Grey and grey with alpha images sample as RGBA like the others
+    const GLint greySwizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+    const GLint greyAlphaSwizzle[4] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
+    const GLint rgbaSwizzle[4] = { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA };
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, header.channels == 1 ? greySwizzle : header.channels == 2 ? greyAlphaSwizzle : rgbaSwizzle);
+
+    // Rows are tightly packed, and 3 channel rows are often not a multiple of the default 4 byte alignment
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (pixelBuffer != 0)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+    for (uint32_t level = 0; level < header.levelCount; ++level)
+    {
+        if (header.blockBytes != 0)
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, header.internalFormat, levels[level].width, levels[level].height, 0,
+                (GLsizei)levels[level].size, payload + levels[level].offset);
+        else
+            glTexImage2D(GL_TEXTURE_2D, level, header.internalFormat, levels[level].width, levels[level].height, 0, header.format,
+                GL_UNSIGNED_BYTE, payload + levels[level].offset);
+    }
+    if (pixelBuffer != 0)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+
+    uint64_t bytes = 0;
+    for (uint32_t level = 0; level < header.levelCount; ++level)
+        bytes += levels[level].size;
+    GpuResources().SetBytes(GPU_TEXTURE, textureId, bytes);
+    return true;
+}
+
+
+// Creates the texture with a grey placeholder texel right away and queues the file for loading on a
+// worker thread. UUploadDecodedTextures replaces the placeholder once the mip chain is ready.
+void UCreateTextureAsync(const char* filename, GpuTexture& texture)
+{
+    static const unsigned char placeholder[3] = { 128, 128, 128 };
+    texture = GpuTexture::Create(filename);
+    UUploadTextureImage(texture, placeholder, 1, 1, 3);
+
+    TextureImage request;
+    request.textureId = texture;
+    request.filename = filename;
+    UQueueTextureLoad(request);
+}
+
+
+// Loads a texture on a worker thread. request names the file, the cook targets and where the result
+// goes; the finished image waits in the loader for UUploadDecodedTextures.
+void UQueueTextureLoad(const TextureImage& request)
+{
+    if (!gTextureLoader.pool)
+    {
+        UCreatePixelBufferRing();
+        gTextureLoader.pool.reset(new ThreadPool());
+    }
+
+    ++gTextureLoader.pending;
+    gTextureLoader.pool->Submit([request]()
+    {
+        PROFILE_THREAD("texture worker");
+        PROFILE_SCOPE("Texture load");
+        TextureImage image = request;
+        ULoadTextureImage(image);
+
+        // Copy the whole chain into a free pixel buffer slot, which also pulls a mapped cooked file in from
+        // disk on this thread. When no slot is free it is uploaded from client memory instead of waiting.
+        if (image.loaded && gTextureLoader.pixelBufferMemory && image.header.payloadSize <= PIXEL_BUFFER_SLOT_SIZE)
+        {
+            std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+            if (!gTextureLoader.freeSlots.empty())
+            {
+                image.slot = gTextureLoader.freeSlots.back();
+                gTextureLoader.freeSlots.pop_back();
+            }
+        }
+
+        // A streamed array layer keeps its chain, the finer levels are uploaded from it later
+        if (image.slot >= 0)
+        {
+            memcpy(gTextureLoader.pixelBufferMemory + image.slot * PIXEL_BUFFER_SLOT_SIZE,
+                image.mapping ? image.mappedPayload : image.cookedPayload.data(), (size_t)image.header.payloadSize);
+            if (image.layer < 0 || !gOptions.textureStreaming)
+            {
+                image.mapping.reset();
+                image.mappedPayload = nullptr;
+                std::vector<unsigned char>().swap(image.cookedPayload);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.decoded.push_back(std::move(image));
+    });
+}
+
+
+// Reserves a layer for a source image in its class's texture array and returns it. An image added before
+// keeps its layer, so materials sharing a texture share the layer too.
+uint32_t UAddTextureLayer(TextureClass textureClass, const char* filename)
+{
+    GLTextureArray& array = gTextureArrays[textureClass];
+    array.channels = textureClass == TEXTURE_CLASS_ALPHA ? 4 : 3;
+
+    auto it = std::find(array.layers.begin(), array.layers.end(), filename);
+    if (it != array.layers.end())
+        return (uint32_t)(it - array.layers.begin());
+    array.layers.push_back(filename);
+    return (uint32_t)array.layers.size() - 1;
+}
+
+
+// Allocates the texture array of every class that has layers, fills each layer with grey and loads the
+// layers: on worker threads, or right here with --sync-textures. The grey chain goes through the same cook
+// as the layers, which also settles the format all of them are cooked to. When streaming, layers start with
+// the levels up to TEXTURE_STREAM_START_SIZE and the rest is left to UStreamTextureLevels; with sparse
+// texture support the finer levels are not even committed until then.
+bool UCreateTextureArrays()
+{
+    gTextureStreaming = TextureStreaming();
+    gTextureStreaming.budgetBytes = (uint64_t)gOptions.textureBudgetMB * 1024 * 1024;
+
+    for (int textureClass = 0; textureClass < TEXTURE_CLASS_COUNT; ++textureClass)
+    {
+        GLTextureArray& array = gTextureArrays[textureClass];
+        if (array.layers.empty())
+            continue;
+
+        const int size = TEXTURE_ARRAY_LAYER_SIZE;
+        std::vector<unsigned char> grey((size_t)size * size * array.channels, 128);
+        if (array.channels == 4)
+        {
+            for (size_t i = 3; i < grey.size(); i += 4)
+                grey[i] = 255;
+        }
+
+        // Only whether the layers are compressed matters here, not how well: flat grey encodes exactly at any
+        // quality, so the placeholder always takes the fast encoder
+        TextureImage placeholder;
+        if (!UCookTextureImage(placeholder, grey.data(), size, size, array.channels, UCompressTextures(), BLOCK_FAST, std::thread::hardware_concurrency()))
+            return false;
+        array.format = placeholder.header;
+        const int levelCount = (int)array.format.levelCount;
+
+        array.sparse = false;
+        if (gOptions.textureStreaming && GLEW_ARB_sparse_texture)
+        {
+            GLint pageSizes = 0;
+            glGetInternalformativ(GL_TEXTURE_2D_ARRAY, array.format.internalFormat, GL_NUM_VIRTUAL_PAGE_SIZES_ARB, 1, &pageSizes);
+            array.sparse = pageSizes > 0;
+        }
+
+        array.id = GpuTexture::Create(textureClass == TEXTURE_CLASS_ALPHA ? "alpha texture array" : "opaque texture array");
+        glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+        if (array.sparse)
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levelCount, array.format.internalFormat, size, size, (GLsizei)array.layers.size());
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        array.sparseLevels = levelCount;
+        if (array.sparse)
+            glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_NUM_SPARSE_LEVELS_ARB, &array.sparseLevels);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        // A sparse array holds only what is committed, which UCommitTextureLevel keeps count of
+        if (!array.sparse)
+        {
+            uint64_t bytes = 0;
+            for (int level = 0; level < levelCount; ++level)
+                bytes += UTextureLevelBytes(array, level) * array.layers.size();
+            array.id.SetBytes(bytes);
+        }
+
+        // The levels every layer keeps: the small ones, and all of the mip tail since it is committed as a whole
+        array.tailLevel = 0;
+        if (gOptions.textureStreaming)
+        {
+            while (array.tailLevel + 1 < levelCount && (size >> array.tailLevel) > TEXTURE_STREAM_START_SIZE)
+                ++array.tailLevel;
+            array.tailLevel = std::min(array.tailLevel, array.sparseLevels);
+        }
+
+        array.residency.assign(array.layers.size(), TextureLayerResidency());
+        for (size_t layer = 0; layer < array.layers.size(); ++layer)
+        {
+            array.residency[layer].residentLevel = array.residency[layer].requestedLevel = array.tailLevel;
+            for (int level = array.tailLevel; level < levelCount; ++level)
+            {
+                UCommitTextureLevel(array, (int)layer, level, true);
+                gTextureStreaming.residentBytes += UTextureLevelBytes(array, level);
+            }
+            UUploadTextureLayer(array, (int)layer, placeholder.header, placeholder.levels.data(), UTexturePayload(placeholder), 0, array.tailLevel);
+
+            TextureImage request;
+            request.textureId = array.id;
+            request.filename = array.layers[layer];
+            request.targetSize = size;
+            request.targetChannels = array.channels;
+            request.arrayClass = textureClass;
+            request.layer = (int)layer;
+            if (!gOptions.syncTextures)
+                UQueueTextureLoad(request);
+            else if (!ULoadTextureImage(request, std::thread::hardware_concurrency())
+                || !UUploadTextureLayer(array, request.layer, request.header, request.levels.data(), UTexturePayload(request), 0, array.tailLevel))
+            {
+                cout << "Failed to load texture " << request.filename << endl;
+                return false;
+            }
+            else if (gOptions.textureStreaming)
+                array.residency[layer].source = std::move(request);
+        }
+
+        cout << "INFO: Texture array of " << array.layers.size() << " layers, " << size << "x" << size << ", "
+            << (array.format.blockBytes != 0 ? (array.channels == 4 ? "BC3" : "BC1") : (array.channels == 4 ? "RGBA8" : "RGB8"));
+        if (gOptions.textureStreaming)
+            cout << ", streaming from " << (size >> array.tailLevel) << "x" << (size >> array.tailLevel)
+                << (array.sparse ? " (sparse, mip tail from level " + std::to_string(array.sparseLevels) + ")" : " (fully allocated)");
+        cout << endl;
+    }
+    return true;
+}
+
+
+// Replaces levels firstLevel up to endLevel of one layer of a texture array from a chain cooked to the
+// array's format. With a pixel buffer, payload is the offset of the chain in it.
+bool UUploadTextureLayer(const GLTextureArray& array, int layer, const CookedTextureHeader& header, const TextureLevel* levels, const unsigned char* payload,
+    GLuint pixelBuffer, uint32_t firstLevel, uint32_t endLevel)
+{
+    if (header.internalFormat != array.format.internalFormat || header.levelCount != array.format.levelCount
+        || levels[0].width != (uint32_t)TEXTURE_ARRAY_LAYER_SIZE || levels[0].height != (uint32_t)TEXTURE_ARRAY_LAYER_SIZE)
+    {
+        cout << "ERROR: Texture was not cooked to the format of its texture array" << endl;
+        return false;
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (pixelBuffer != 0)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+    for (uint32_t level = firstLevel; level < std::min(endLevel, header.levelCount); ++level)
+    {
+        if (header.blockBytes != 0)
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levels[level].width, levels[level].height, 1,
+                header.internalFormat, (GLsizei)levels[level].size, payload + levels[level].offset);
+        else
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levels[level].width, levels[level].height, 1,
+                header.format, GL_UNSIGNED_BYTE, payload + levels[level].offset);
+    }
+    if (pixelBuffer != 0)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return true;
+}
+
+
+void UDestroyTextureArrays()
+{
+    for (GLTextureArray& array : gTextureArrays)
+        array = GLTextureArray();
+    gTextureStreaming = TextureStreaming();
+}
+
+
+// Memory one level of one layer of a texture array takes
+uint64_t UTextureLevelBytes(const GLTextureArray& array, int level)
+{
+    const uint64_t size = std::max(TEXTURE_ARRAY_LAYER_SIZE >> level, 1);
+    if (array.format.blockBytes != 0)
+        return ((size + 3) / 4) * ((size + 3) / 4) * array.format.blockBytes;
+    return size * size * array.channels;
+}
+
+
+// Commits or releases the pages of one level of one layer of a sparse array. Levels in the mip tail go
+// with the first of them, which commits the whole tail. Arrays that are not sparse keep every level.
+void UCommitTextureLevel(GLTextureArray& array, int layer, int level, bool commit)
+{
+    if (!array.sparse || level > array.sparseLevels || level >= (int)array.format.levelCount)
+        return;
+
+    const GLsizei size = std::max(TEXTURE_ARRAY_LAYER_SIZE >> level, 1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+    glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, size, size, 1, commit ? GL_TRUE : GL_FALSE);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    uint64_t bytes = UTextureLevelBytes(array, level);
+    for (int tail = level + 1; level == array.sparseLevels && tail < (int)array.format.levelCount; ++tail)
+        bytes += UTextureLevelBytes(array, tail);
+    array.id.SetBytes(commit ? array.id.Bytes() + bytes : array.id.Bytes() - bytes);
+}
+
+
+// Finest level of a material's texture layer the shaders may sample, 0 for untextured materials
+float UTextureMinLod(const GLMaterial& material)
+{
+    for (const GLTextureArray& array : gTextureArrays)
+    {
+        if (array.id != 0 && array.id == material.textureId && material.textureLayer < array.residency.size())
+            return (float)array.residency[material.textureLayer].residentLevel;
+    }
+    return 0.0f;
+}
+
+
+// Sets the finest level every texture array layer needs this frame from the visible objects using it.
+// An object covers about the diameter of its bounding sphere on screen, measured at the sphere's nearest
+// point, and the layer is tiled uvScale times across it; each halving of texels per pixel below one is a
+// level that is never sampled. Instanced objects are measured by their combined bounds, which errs on the
+// side of finer levels.
+void URequestTextureLevels(const Scene& scene, const std::vector<uint8_t>& visible, const glm::mat4& projection)
+{
+    if (!gOptions.textureStreaming)
+        return;
+
+    ++gTextureStreaming.frame;
+    for (GLTextureArray& array : gTextureArrays)
+    {
+        for (TextureLayerResidency& residency : array.residency)
+            residency.requestedLevel = (int)array.format.levelCount - 1;
+    }
+
+    // projection[2][3] is -1 for a perspective projection, which divides by depth, and 0 for orthographic
+    const bool perspective = projection[2][3] != 0.0f;
+    const float pixelsPerUnit = projection[1][1] * gFramebufferHeight * 0.5f;
+    const glm::vec3 cameraPosition = gCamera.Position;
+    for (size_t object = 0; object < scene.transforms.size(); ++object)
+    {
+        if (!visible[object])
+            continue;
+
+        const GLMaterial& material = scene.materials[scene.materialIds[object]];
+        GLTextureArray* array = nullptr;
+        for (GLTextureArray& candidate : gTextureArrays)
+        {
+            if (candidate.id != 0 && candidate.id == material.textureId && material.textureLayer < candidate.residency.size())
+                array = &candidate;
+        }
+        if (!array)
+            continue;
+
+        const glm::mat4& transform = scene.transforms[object];
+        const float scale = std::max(std::max(glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1]))), glm::length(glm::vec3(transform[2])));
+        const float radius = scene.meshes[scene.meshIds[object]].radius * scale;
+        const glm::vec3 center(scene.bounds.centerX[object], scene.bounds.centerY[object], scene.bounds.centerZ[object]);
+        const float distance = std::max(glm::length(center - cameraPosition) - scene.bounds.radius[object], 0.1f);
+
+        const float pixels = std::max(2.0f * radius * pixelsPerUnit / (perspective ? distance : 1.0f), 1.0f);
+        const float texels = TEXTURE_ARRAY_LAYER_SIZE * std::max(material.uvScale.x, material.uvScale.y);
+        const int level = std::min(std::max((int)std::floor(std::log2(texels / pixels)), 0), (int)array->format.levelCount - 1);
+
+        TextureLayerResidency& residency = array->residency[material.textureLayer];
+        residency.requestedLevel = std::min(residency.requestedLevel, level);
+        residency.lastUsedFrame = gTextureStreaming.frame;
+    }
+}
+
+
+// Uploads finer levels towards what URequestTextureLevels asked for, one level at a time to the layer
+// missing the most, until the frame's budget is used up. A level that does not fit in the memory budget
+// first evicts levels nobody asked for, then the finest level of the least recently used layer; when only
+// layers in use this frame are left, streaming waits for the view to change.
+void UStreamTextureLevels(double budgetMs)
+{
+    if (!gOptions.textureStreaming)
+        return;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (;;)
+    {
+        GLTextureArray* array = nullptr;
+        int layer = -1, missing = 0;
+        for (GLTextureArray& candidate : gTextureArrays)
+        {
+            for (size_t i = 0; i < candidate.residency.size(); ++i)
+            {
+                const TextureLayerResidency& residency = candidate.residency[i];
+                if (residency.source.loaded && residency.residentLevel - residency.requestedLevel > missing)
+                {
+                    array = &candidate;
+                    layer = (int)i;
+                    missing = residency.residentLevel - residency.requestedLevel;
+                }
+            }
+        }
+        if (!array || std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() > budgetMs)
+            return;
+
+        TextureLayerResidency& residency = array->residency[layer];
+        const int level = residency.residentLevel - 1;
+        const uint64_t bytes = UTextureLevelBytes(*array, level);
+        while (gTextureStreaming.residentBytes + bytes > gTextureStreaming.budgetBytes)
+        {
+            GLTextureArray* victimArray = nullptr;
+            int victim = -1;
+            bool victimUnneeded = false;
+            uint64_t victimFrame = 0;
+            for (GLTextureArray& candidate : gTextureArrays)
+            {
+                for (size_t i = 0; i < candidate.residency.size(); ++i)
+                {
+                    const TextureLayerResidency& other = candidate.residency[i];
+                    if (other.residentLevel >= candidate.tailLevel || (&candidate == array && (int)i == layer))
+                        continue;
+
+                    // A level finer than requested is never sampled, so it goes before anything in use
+                    const bool unneeded = other.residentLevel < other.requestedLevel;
+                    if (!unneeded && other.lastUsedFrame == gTextureStreaming.frame)
+                        continue;
+                    if (!victimArray || (unneeded && !victimUnneeded) || (unneeded == victimUnneeded && other.lastUsedFrame < victimFrame))
+                    {
+                        victimArray = &candidate;
+                        victim = (int)i;
+                        victimUnneeded = unneeded;
+                        victimFrame = other.lastUsedFrame;
+                    }
+                }
+            }
+            if (!victimArray)
+                return;
+            UEvictTextureLevel(*victimArray, victim);
+        }
+
+        UCommitTextureLevel(*array, layer, level, true);
+        UUploadTextureLayer(*array, layer, residency.source.header, residency.source.levels.data(), UTexturePayload(residency.source), 0, level, level + 1);
+        residency.residentLevel = level;
+        gTextureStreaming.residentBytes += bytes;
+        ++gTextureStreaming.streamedLevels;
+        gScene.materialsDirty = true;
+    }
+}
+
+
+// Drops the finest resident level of a layer. The shaders stop sampling it from the next draw on, and a
+// sparse array gives its pages back.
+void UEvictTextureLevel(GLTextureArray& array, int layer)
+{
+    TextureLayerResidency& residency = array.residency[layer];
+    UCommitTextureLevel(array, layer, residency.residentLevel, false);
+    gTextureStreaming.residentBytes -= UTextureLevelBytes(array, residency.residentLevel);
+    ++residency.residentLevel;
+    ++gTextureStreaming.evictedLevels;
+    gScene.materialsDirty = true;
+}
+
+
+// Prints resident against requested levels of every texture array layer (T key)
+void UPrintTextureResidency()
+{
+    const double megabyte = 1024.0 * 1024.0;
+    cout << "INFO: Texture residency: " << gTextureStreaming.residentBytes / megabyte << " of " << gTextureStreaming.budgetBytes / megabyte
+        << " MB budget, " << gTextureStreaming.streamedLevels << " levels streamed, " << gTextureStreaming.evictedLevels << " evicted"
+        << (gOptions.textureStreaming ? "" : " (streaming off)") << endl;
+
+    for (const GLTextureArray& array : gTextureArrays)
+    {
+        for (size_t layer = 0; layer < array.residency.size(); ++layer)
+        {
+            const TextureLayerResidency& residency = array.residency[layer];
+            uint64_t bytes = 0;
+            for (int level = residency.residentLevel; level < (int)array.format.levelCount; ++level)
+                bytes += UTextureLevelBytes(array, level);
+
+            const int resident = TEXTURE_ARRAY_LAYER_SIZE >> residency.residentLevel, requested = TEXTURE_ARRAY_LAYER_SIZE >> residency.requestedLevel;
+            cout << "INFO:   " << array.layers[layer] << ": resident level " << residency.residentLevel << " (" << resident << "x" << resident
+                << "), requested " << residency.requestedLevel << " (" << requested << "x" << requested << "), " << bytes / 1024 << " KB, "
+                << (residency.source.loaded ? "" : "loading, ");
+            if (residency.lastUsedFrame == 0)
+                cout << "never drawn" << endl;
+            else
+                cout << "drawn " << gTextureStreaming.frame - residency.lastUsedFrame << " frames ago" << endl;
+        }
+    }
+}
+
+
+// Uploads the images the workers have finished, oldest first, until the frame's budget is used up.
+// At least one image goes up every frame so loading always makes progress.
+void UUploadDecodedTextures(double budgetMs)
+{
+    URecyclePixelBufferSlots();
+    if (gTextureLoader.pending == 0)
+        return;
 
-        //  ****************CANDLE************************
+    std::vector<TextureImage> ready;
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        ready.swap(gTextureLoader.decoded);
+    }
 
-        // SIDE 0 01 8890
-        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+    const auto start = std::chrono::steady_clock::now();
+    size_t uploaded = 0;
+    for (; uploaded < ready.size(); ++uploaded)
+    {
+        if (uploaded > 0 && std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() > budgetMs)
+            break;
+
+        // Array layers only get the levels they already have resident; finer ones are streamed from the
+        // chain the layer keeps
+        TextureImage& image = ready[uploaded];
+        const int firstLevel = image.layer >= 0 ? gTextureArrays[image.arrayClass].residency[image.layer].residentLevel : 0;
+        bool uploadedImage = false;
+        if (image.slot >= 0)
+        {
+            // The copies out of the slot are queued now; the fence tells when the slot can be reused
+            const unsigned char* offset = (const unsigned char*)(image.slot * PIXEL_BUFFER_SLOT_SIZE);
+            uploadedImage = image.layer >= 0
+                ? UUploadTextureLayer(gTextureArrays[image.arrayClass], image.layer, image.header, image.levels.data(), offset, gTextureLoader.pixelBuffer, firstLevel)
+                : UUploadTextureLevels(image.textureId, image.header, image.levels.data(), offset, gTextureLoader.pixelBuffer);
+            if (!uploadedImage)
+                cout << "Failed to upload texture " << image.filename << endl;
+            gTextureLoader.slotFences[image.slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            ++gTextureLoader.ringUploads;
+        }
+        else if (!image.loaded)
+            cout << "Failed to load texture " << image.filename << endl;
+        else
+        {
+            uploadedImage = image.layer >= 0
+                ? UUploadTextureLayer(gTextureArrays[image.arrayClass], image.layer, image.header, image.levels.data(), UTexturePayload(image), 0, firstLevel)
+                : UUploadTextureLevels(image.textureId, image.header, image.levels.data(), UTexturePayload(image));
+            if (!uploadedImage)
+                cout << "Failed to upload texture " << image.filename << endl;
+            ++gTextureLoader.clientUploads;
+        }
 
-        // SIDE 1 12 99 10 1
-        1.0f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        if (uploadedImage && image.layer >= 0 && gOptions.textureStreaming)
+        {
+            image.slot = -1;
+            gTextureArrays[image.arrayClass].residency[image.layer].source = std::move(image);
+        }
 
-        // SIDE 2 23 10 10 11 3
-        1.2f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
+        --gTextureLoader.pending;
+    }
 
-        // SIDE 3 34 11 11 12 3
-        1.2f, upY, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        // SIDE 4 45 12 12 13 4
-        1.3f, upY, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        // SIDE 5 56 13 13 14 5
-        1.3f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        // SIDE 6 67 14 14 15 6
-        1.1f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        // SIDE 7 70 15 15 8 7
-        1.1f, upY, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.5f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.5f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, upY, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        //BASE
-        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.3f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.3f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.4f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.1f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.0f, 0.102f, -0.2f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-        1.2f, 0.102f, -0.1f, 1.0f, 1.0f, -1.0f, 0.0f, 0.0f,
-    };
-    
-    
+    // Whatever did not fit goes back in front of anything decoded meanwhile
+    if (uploaded < ready.size())
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.decoded.insert(gTextureLoader.decoded.begin(), std::make_move_iterator(ready.begin() + uploaded), std::make_move_iterator(ready.end()));
+    }
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
-    // TABLE
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
 
-    glGenVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);
+// Creates one buffer for every slot, mapped once for the lifetime of the loader. The mapping is coherent,
+// so worker writes are visible to the GPU without flushes.
+void UCreatePixelBufferRing()
+{
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    const GLsizeiptr size = PIXEL_BUFFER_SLOT_COUNT * PIXEL_BUFFER_SLOT_SIZE;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    gTextureLoader.pixelBuffer = GpuBuffer::Create("texture upload ring");
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gTextureLoader.pixelBuffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+    gTextureLoader.pixelBuffer.SetBytes(size);
+    gTextureLoader.pixelBufferMemory = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a)
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+    if (!gTextureLoader.pixelBufferMemory)
+    {
+        cout << "WARNING: Could not map the texture upload ring, uploading from client memory" << endl;
+        return;
+    }
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    for (int slot = 0; slot < PIXEL_BUFFER_SLOT_COUNT; ++slot)
+        gTextureLoader.freeSlots.push_back(slot);
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// Returns the slots whose uploads the GPU has finished to the free list, without waiting on any of them
+void URecyclePixelBufferSlots()
+{
+    for (int slot = 0; slot < PIXEL_BUFFER_SLOT_COUNT; ++slot)
+    {
+        GLsync& fence = gTextureLoader.slotFences[slot];
+        if (!fence)
+            continue;
+
+        const GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            continue;
+
+        glDeleteSync(fence);
+        fence = nullptr;
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.freeSlots.push_back(slot);
+    }
+}
 
-    // TABLE RUNNER
-    mesh.nVertices2 = sizeof(verts2) / (sizeof(verts2[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
 
-    glGenVertexArrays(1, &mesh.vao2);
-    glBindVertexArray(mesh.vao2);
+// Stops the decode threads, drops images that were never uploaded and releases the pixel buffer ring and
+// the synthetic textures
+void UDestroyTextureLoader()
+{
+    gTextureLoader.pool.reset();
+    gCookPool.reset();
+    gTextureLoader.decoded.clear();
+    gTextureLoader.pending = 0;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo2);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo2); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts2), verts2, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    for (GLsync& fence : gTextureLoader.slotFences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if (gTextureLoader.pixelBuffer)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gTextureLoader.pixelBuffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    gTextureLoader.pixelBuffer.Reset();
+    gTextureLoader.pixelBufferMemory = nullptr;
+    gTextureLoader.freeSlots.clear();
+    gTextureLoader.syntheticTextures.clear();
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Prints the live GL objects and the memory they hold per kind (G key)
+void UPrintGpuResources()
+{
+    const GpuResourceManager& resources = GpuResources();
+    const double megabyte = 1024.0 * 1024.0;
+    cout << "INFO: GPU memory: " << resources.TotalBytes() / megabyte << " MB live, " << resources.PeakBytes() / megabyte << " MB peak, "
+        << resources.LiveCount() << " objects (" << resources.CreatedCount() << " created, " << resources.DestroyedCount() << " destroyed)" << endl;
+    for (int kind = 0; kind < GPU_RESOURCE_KIND_COUNT; ++kind)
+    {
+        if (resources.KindCount((GpuResourceKind)kind) > 0)
+            cout << "INFO:   " << GPU_RESOURCE_KIND_NAMES[kind] << ": " << resources.KindCount((GpuResourceKind)kind) << ", "
+                << resources.KindBytes((GpuResourceKind)kind) / megabyte << " MB" << endl;
+    }
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
-    // DICE
-    mesh.nVertices3 = sizeof(verts3) / (sizeof(verts3[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+// Writes the profiler's ring as a Chrome trace (P key, and at exit with --profile-trace)
+void UWriteProfileTrace()
+{
+#if PROFILER_ENABLED
+    if (PROFILE_EXPORT(gOptions.profileTrace.c_str()))
+        cout << "INFO: Wrote " << Profiler::Instance().EventCount() << " profiler events to " << gOptions.profileTrace << " ("
+            << Profiler::Instance().DroppedGpuScopes() << " GPU scopes dropped unread)" << endl;
+    else
+        cout << "ERROR: Could not write profiler trace " << gOptions.profileTrace << endl;
+#else
+    cout << "WARNING: The profiler is compiled out (PROFILER_ENABLED is 0)" << endl;
+#endif
+}
 
-    glGenVertexArrays(1, &mesh.vao3);
-    glBindVertexArray(mesh.vao3);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo3);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo3); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts3), verts3, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Makes a GL context current without a window and points drawing at a framebuffer object the size of
+// --resolution. The context was not made by GLFW, so GLEW loads its functions without asking the window system.
+bool UCreateHeadlessContext()
+{
+    if (!HeadlessContext::Available())
+    {
+        cout << "ERROR: Headless rendering needs EGL or OSMesa, build with HEADLESS_EGL or HEADLESS_OSMESA (the CMake build on Linux defines HEADLESS_EGL)" << endl;
+        return false;
+    }
+    if (!gHeadless.Create(gOptions.width, gOptions.height))
+    {
+        cout << "ERROR: Could not create a headless OpenGL 4.4 core context" << endl;
+        return false;
+    }
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewContextInit();
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    // Same formats a window would get: 8-bit color, sRGB when the window would ask for it, and depth with stencil
+    gHeadlessColor = GpuRenderbuffer::Create("headless color");
+    glBindRenderbuffer(GL_RENDERBUFFER, gHeadlessColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, gOptions.srgbTextures ? GL_SRGB8_ALPHA8 : GL_RGBA8, gOptions.width, gOptions.height);
+    gHeadlessColor.SetBytes((uint64_t)gOptions.width * gOptions.height * 4);
+
+    gHeadlessDepth = GpuRenderbuffer::Create("headless depth");
+    glBindRenderbuffer(GL_RENDERBUFFER, gHeadlessDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, gOptions.width, gOptions.height);
+    gHeadlessDepth.SetBytes((uint64_t)gOptions.width * gOptions.height * 4);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    gHeadlessFramebuffer = GpuFramebuffer::Create("headless framebuffer");
+    glBindFramebuffer(GL_FRAMEBUFFER, gHeadlessFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gHeadlessColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, gHeadlessDepth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "ERROR: Headless framebuffer is incomplete" << endl;
+        return false;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // A context without a surface starts with an empty viewport
+    glViewport(0, 0, gOptions.width, gOptions.height);
+    cout << "INFO: Headless " << gOptions.width << "x" << gOptions.height << " framebuffer through " << gHeadless.Api() << endl;
+    return true;
+}
 
-    // BOX
-    mesh.nVertices4 = sizeof(verts4) / (sizeof(verts4[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
 
-    glGenVertexArrays(1, &mesh.vao4);
-    glBindVertexArray(mesh.vao4);
+// Releases the headless framebuffer and then its context; does nothing for a window
+void UDestroyHeadlessContext()
+{
+    if (!gHeadless.Api())
+        return;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    gHeadlessFramebuffer.Reset();
+    gHeadlessColor.Reset();
+    gHeadlessDepth.Reset();
+    gHeadless.Destroy();
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo4);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo4); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts4), verts4, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Seconds since GLFW started, or since the program started when there is no window
+double UGetTime()
+{
+    if (gWindow)
+        return glfwGetTime();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - gStartTime).count();
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// True once the window was closed, a replay or flythrough ran out of frames or, with --frames, that many
+// frames were drawn
+bool UShouldClose(uint32_t framesDrawn)
+{
+    if (gOptions.frames > 0 && framesDrawn >= gOptions.frames)
+        return true;
+    if (gInputReplay.IsLoaded() && gInputReplay.Finished())
+        return true;
+    if (!gFlightPaths.empty() && gFlightPath == gFlightPaths.size())
+        return true;
+    return gWindow && glfwWindowShouldClose(gWindow);
+}
 
-    // CANDLE
-    mesh.nVertices5 = sizeof(verts5) / (sizeof(verts5[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
 
-    glGenVertexArrays(1, &mesh.vao5);
-    glBindVertexArray(mesh.vao5);
+// True when the run ends by itself or writes its timing out, and so reports its frame times
+bool UReportsFrameTimes()
+{
+    return gOptions.headless || gOptions.frames > 0 || !gOptions.timingOutput.empty() || gInputReplay.IsLoaded() || !gFlightPaths.empty();
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo5);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo5); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts5), verts5, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Shows the frame. A headless frame goes nowhere, so it is finished instead, which keeps the frame times
+// counting the GPU work like a swap that waits for it would.
+void UPresentFrame()
+{
+    if (gOptions.frameHash)
+        UHashFrame();
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    if (gWindow)
+    {
+        glfwSwapBuffers(gWindow);
+        if (gInputPollNs > 0)
+            gPresentLatency.FramePresented(gInputPollNs);
+    }
+    else
+        glFinish();
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
+// Folds the pixels of the frame just drawn into gFrameHash. Reading back stalls until the GPU is done, so
+// hashed runs are for checking frames match, not for timing them.
+void UHashFrame()
+{
+    static std::vector<uint8_t> pixels;
+    pixels.resize((size_t)gFramebufferWidth * gFramebufferHeight * 4);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, gFramebufferWidth, gFramebufferHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    for (uint8_t value : pixels)
+        gFrameHash = (gFrameHash ^ value) * 1099511628211ull;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Sets the swap interval for --vsync: 1 waits for every vertical blank, 0 for none, and -1 (adaptive) only
+// for frames that are on time
+void UApplyVsync()
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    int interval = gOptions.vsync == VSYNC_OFF ? 0 : 1;
+    if (gOptions.vsync == VSYNC_ADAPTIVE)
+    {
+        if (glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+            interval = -1;
+        else
+            cout << "WARNING: Adaptive vsync needs EXT_swap_control_tear, vsync stays on" << endl;
+    }
+    glfwSwapInterval(interval);
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Prints how long the frame limiter slept and spun, and the input to present latency
+void UPrintFramePacing()
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    if (gFrameLimiter.WaitCount() > 0)
     {
-        flipImageVertically(image, width, height, channels);
+        const double waits = (double)gFrameLimiter.WaitCount();
+        cout << "INFO: Frame limiter at " << gOptions.fpsLimit << " Hz: " << gFrameLimiter.SleptMs() / waits << " ms slept and "
+            << gFrameLimiter.SpunMs() / waits << " ms spun per frame, spin margin " << gFrameLimiter.MarginMs() << " ms" << endl;
+    }
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    const FrameTimeSummary latency = SummarizeFrameTimes(gPresentLatency.LatencyMs());
+    if (latency.count > 0)
+        cout << "INFO: Input to present (vsync " << VSYNC_MODE_NAMES[gOptions.vsync] << "): mean " << latency.meanMs << " ms, p50 " << latency.p50Ms
+            << " ms, p95 " << latency.p95Ms << " ms, p99 " << latency.p99Ms << " ms over the last " << latency.count << " of "
+            << gPresentLatency.MeasuredCount() << " frames (" << gPresentLatency.DroppedCount() << " timestamps dropped unread)" << endl;
+}
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
+// Adds the pacing settings, the limiter's time and the input to present latency to the timing JSON, as
+// "pacing" and "inputToPresentMs" members
+void UWriteFramePacingJson(std::ostream& json)
+{
+    json << "\"pacing\":{\"vsync\":\"" << (gWindow ? VSYNC_MODE_NAMES[gOptions.vsync] : "none") << "\",\"fpsLimit\":" << gOptions.fpsLimit
+        << ",\"smoothingFrames\":" << gOptions.frameSmoothing;
+    if (gFrameLimiter.WaitCount() > 0)
+    {
+        const double waits = (double)gFrameLimiter.WaitCount();
+        json << ",\"sleptMsPerFrame\":" << gFrameLimiter.SleptMs() / waits << ",\"spunMsPerFrame\":" << gFrameLimiter.SpunMs() / waits;
+    }
+    json << "},";
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+    const FrameTimeSummary latency = SummarizeFrameTimes(gPresentLatency.LatencyMs());
+    if (latency.count > 0)
+        json << "\"inputToPresentMs\":{\"frames\":" << latency.count << ",\"measured\":" << gPresentLatency.MeasuredCount() << ",\"mean\":" << latency.meanMs << ",\"p50\":" << latency.p50Ms
+            << ",\"p95\":" << latency.p95Ms << ",\"p99\":" << latency.p99Ms << ",\"max\":" << latency.maxMs << "},";
+}
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
 
-        return true;
+// Text as a JSON string, quotes included
+std::string UJsonString(const std::string& text)
+{
+    std::string result = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        result += c;
+    }
+    return result + "\"";
+}
+
+
+// Puts the camera where the current flight path has it this frame and moves on, to the next path once
+// this one has drawn all its frames
+void UFlyCamera()
+{
+    if (gFlightPath >= gFlightPaths.size())
+        return;
+
+    const FlightPath& path = gFlightPaths[gFlightPath];
+    size_t segment;
+    const CameraKey key = path.Frame(gFlightFrame, segment);
+    gCamera.Set(key.position, key.yaw, key.pitch, key.zoom);
+    gFlightSegments.emplace_back((uint32_t)gFlightPath, (uint32_t)segment);
+
+    if (++gFlightFrame == path.frames)
+    {
+        ++gFlightPath;
+        gFlightFrame = 0;
     }
+}
+
 
-    // Error loading the image
-    return false;
+// Adds a "paths" member to the timing JSON with the frame times of every segment of every flight path, and
+// prints a line per segment
+void UReportFlightTimes(std::ostream& json)
+{
+    json << "\"paths\":[";
+    for (size_t pathIndex = 0; pathIndex < gFlightPaths.size(); ++pathIndex)
+    {
+        const FlightPath& path = gFlightPaths[pathIndex];
+        json << (pathIndex > 0 ? "," : "") << "{\"name\":" << UJsonString(path.name) << ",\"segments\":[";
+        for (size_t segment = 0; segment < path.SegmentCount(); ++segment)
+        {
+            std::vector<float> frameMs;
+            for (size_t frame = 0; frame < gFlightSegments.size() && frame < gFrameTimesMs.size(); ++frame)
+            {
+                if (gFlightSegments[frame].first == pathIndex && gFlightSegments[frame].second == segment)
+                    frameMs.push_back(gFrameTimesMs[frame]);
+            }
+
+            const FrameTimeSummary summary = SummarizeFrameTimes(frameMs);
+            cout << "INFO: " << path.name << " / " << path.SegmentName(segment) << ": " << summary.count << " frames, p50 " << summary.p50Ms
+                << " ms, p95 " << summary.p95Ms << " ms, p99 " << summary.p99Ms << " ms, max " << summary.maxMs << " ms" << endl;
+            json << (segment > 0 ? "," : "") << "{\"name\":" << UJsonString(path.SegmentName(segment)) << ",";
+            WriteFrameTimeJson(json, summary);
+            json << "}";
+        }
+        json << "]}";
+    }
+    json << "],";
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Prints the frame times of the run as one JSON line after "TIMING: ", and with --timing-output writes the
+// same object to a file with every frame time added
+void UReportFrameTimes()
 {
-    glGenTextures(1, &textureId);
+    std::ostringstream json;
+    json << "{\"mode\":" << UJsonString(gOptions.headless ? "headless" : "window")
+        << ",\"context\":" << UJsonString(gHeadless.Api() ? gHeadless.Api() : "GLFW")
+        << ",\"renderer\":" << UJsonString(gRenderer)
+        << ",\"width\":" << gFramebufferWidth << ",\"height\":" << gFramebufferHeight << ",";
+    if (gOptions.frameHash)
+        json << "\"frameHash\":\"" << std::hex << gFrameHash << std::dec << "\",";
+    if (!gFlightPaths.empty())
+        UReportFlightTimes(json);
+    UWriteFramePacingJson(json);
+    WriteFrameTimeJson(json, SummarizeFrameTimes(gFrameTimesMs));
+    cout << "TIMING: " << json.str() << "}" << endl;
+
+    if (gOptions.timingOutput.empty())
+        return;
+
+    std::ofstream file(gOptions.timingOutput);
+    file << json.str() << ",\"frameMs\":[";
+    for (size_t i = 0; i < gFrameTimesMs.size(); ++i)
+        file << (i > 0 ? "," : "") << gFrameTimesMs[i];
+    file << "]}\n";
+    if (file)
+        cout << "INFO: Wrote " << gFrameTimesMs.size() << " frame times to " << gOptions.timingOutput << endl;
+    else
+        cout << "ERROR: Could not write timing output " << gOptions.timingOutput << endl;
 }
 
 
 // Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLProgram& program)
 {
     // Compilation and linkage error reporting
     int success = 0;
     char infoLog[512];
 
     // Create a Shader program object.
-    programId = glCreateProgram();
+    program = GLProgram();
+    program.id = GpuProgram::Create("shader program");
+    GLuint programId = program.id;
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    // Create the vertex and fragment shader objects. They are only needed until the program is linked, and
+    // are deleted when this function returns, on failure too.
+    const GpuVertexShader vertexShader = GpuVertexShader::Create("vertex shader");
+    const GpuFragmentShader fragmentShader = GpuFragmentShader::Create("fragment shader");
+    GLuint vertexShaderId = vertexShader;
+    GLuint fragmentShaderId = fragmentShader;
 
     // Retrive the shader source
     glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
@@ -1578,6 +4782,11 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
 
         return false;
     }
+    glDetachShader(programId, vertexShaderId);
+    glDetachShader(programId, fragmentShaderId);
+
+    // Resolve every uniform handle now so rendering never looks one up by name
+    UReflectShaderProgram(program);
 
     glUseProgram(programId);    // Uses the shader program
 
@@ -1585,7 +4794,151 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+// Queries every active uniform and uniform block of a linked program and caches their handles
+void UReflectShaderProgram(GLProgram& program)
+{
+    GLint uniformCount = 0, maxNameLength = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &uniformCount);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+    std::string name(maxNameLength > 0 ? maxNameLength : 1, '\0');
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program.id, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+        std::string uniformName(name.c_str(), length);
+
+        // Uniforms inside a block have no location of their own
+        GLint location = UGetUniformLocation(program.id, uniformName.c_str());
+        if (location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]"; also store them under the bare name
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            program.uniforms[uniformName.substr(0, bracket)] = location;
+        program.uniforms[uniformName] = location;
+
+        if ((type == GL_SAMPLER_2D || type == GL_SAMPLER_2D_ARRAY) && program.texture < 0)
+            program.texture = location;
+    }
+
+    GLint blockCount = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxNameLength);
+    name.assign(maxNameLength > 0 ? maxNameLength : 1, '\0');
+    for (GLint i = 0; i < blockCount; ++i)
+    {
+        GLsizei length = 0;
+        glGetActiveUniformBlockName(program.id, (GLuint)i, (GLsizei)name.size(), &length, &name[0]);
+        program.blocks[std::string(name.c_str(), length)] = (GLuint)i;
+    }
+
+    // Fill in the typed handles used by the render loop
+    auto find = [&program](const char* uniformName) -> GLint
+    {
+        auto it = program.uniforms.find(uniformName);
+        return it != program.uniforms.end() ? it->second : -1;
+    };
+    program.model = find("model");
+    program.normalMatrix = find("normalMatrix");
+    program.view = find("view");
+    program.projection = find("projection");
+    program.objectColor = find("objectColor");
+    program.lightColor = find("lightColor");
+    program.lightPos = find("lightPos");
+    program.viewPosition = find("viewPosition");
+    program.uvScale = find("uvScale");
+    program.positionOffset = find("positionOffset");
+    program.positionScale = find("positionScale");
+    program.uvTransform = find("uvTransform");
+    program.textureLayer = find("textureLayer");
+    program.textureMinLod = find("textureMinLod");
+}
+
+
+// Single entry point for name based uniform lookups so they can be counted
+GLint UGetUniformLocation(GLuint programId, const char* name)
+{
+    ++gUniformLookups;
+    return glGetUniformLocation(programId, name);
+}
+
+
+void UDestroyShaderProgram(GLProgram& program)
+{
+    program = GLProgram();
+}
+
+
+// Builds the #defines the Phong fragment shader is specialized on
+std::vector<std::string> UPhongDefines(float ambientStrength, float specularIntensity, float highlightSize, bool cpuNormalMatrix)
+{
+    return {
+        "AMBIENT_STRENGTH " + std::to_string(ambientStrength),
+        "SPECULAR_INTENSITY " + std::to_string(specularIntensity),
+        "HIGHLIGHT_SIZE " + std::to_string(highlightSize),
+        cpuNormalMatrix ? "NORMAL_MATRIX normalMatrix" : "NORMAL_MATRIX mat3(transpose(inverse(model)))"
+    };
+}
+
+
+// Returns the program for a set of sources specialized with the given #defines, compiling and linking it
+// only the first time that exact combination is requested. Returns nullptr if the variant fails to build.
+const GLProgram* UGetShaderVariant(const char* vtxShaderSource, const char* fragShaderSource, std::vector<std::string> defines)
+{
+    // Define order does not change the program, so hash them sorted (64-bit FNV-1a)
+    std::sort(defines.begin(), defines.end());
+
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const char* text)
+    {
+        for (; *text; ++text)
+            hash = (hash ^ (unsigned char)*text) * 1099511628211ull;
+        hash = (hash ^ 0xffu) * 1099511628211ull; // Separator so "ab"+"c" differs from "a"+"bc"
+    };
+    mix(vtxShaderSource);
+    mix(fragShaderSource);
+    for (const std::string& define : defines)
+        mix(define.c_str());
+
+    auto cached = gProgramCache.find(hash);
+    if (cached != gProgramCache.end())
+        return &cached->second;
+
+    // The GLSL macro puts "#version" on the first line, and #defines have to come after it
+    std::string header;
+    for (const std::string& define : defines)
+        header += "#define " + define + "\n";
+
+    auto specialize = [&header](const char* source)
+    {
+        std::string text(source);
+        size_t firstLine = text.find('\n');
+        text.insert(firstLine == std::string::npos ? text.size() : firstLine + 1, header);
+        return text;
+    };
+    std::string vertexSource = specialize(vtxShaderSource);
+    std::string fragmentSource = specialize(fragShaderSource);
+
+    GLProgram program;
+    if (!UCreateShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), program))
+        return nullptr;
+
+    // Every material samples its texture from unit 0 (the program is still bound after linking)
+    if (program.texture >= 0)
+        glUniform1i(program.texture, 0);
+
+    return &gProgramCache.emplace(hash, program).first->second;
+}
+
+
+// Deletes every program the variant cache has linked
+void UDestroyShaderVariants()
 {
-    glDeleteProgram(programId);
+    for (auto& entry : gProgramCache)
+        UDestroyShaderProgram(entry.second);
+    gProgramCache.clear();
 }
@@ -0,0 +1,470 @@
+#ifndef BLOCKCOMPRESSION_H
+#define BLOCKCOMPRESSION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLOCKCOMPRESSION_SSE 1
+#endif
+
+// BC1 stores a 4x4 block of opaque texels in 8 bytes: two RGB565 endpoints and a 2-bit index per texel
+// into the endpoints and the two colors a third and two thirds between them. BC3 adds 8 bytes of alpha in
+// front: two 8-bit endpoints and a 3-bit index per texel into eight alphas between them.
+enum BlockFormat
+{
+    BLOCK_BC1,
+    BLOCK_BC3
+};
+
+// Fast takes the block's bounding box as the endpoints. High fits the endpoints to the block's principal
+// axis and refines them by least squares, keeping whichever of the two has the lower error.
+enum BlockQuality
+{
+    BLOCK_FAST,
+    BLOCK_HIGH
+};
+
+inline uint32_t BlockBytes(BlockFormat format)
+{
+    return format == BLOCK_BC1 ? 8 : 16;
+}
+
+inline size_t CompressedSize(int width, int height, BlockFormat format)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(format);
+}
+
+inline uint16_t PackColor565(int r, int g, int b)
+{
+    return (uint16_t)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+// Expands by bit replication, which is what the hardware does
+inline void UnpackColor565(uint16_t color, int rgb[3])
+{
+    const int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Indices of 16 RGBA texels for the four color palette from c0 to c1. The palette lies on a line, so
+// each texel is projected onto it and the projection rounded to the nearest third.
+inline uint32_t Bc1Indices(const uint8_t* rgba, const int c0[3], const int c1[3])
+{
+    static const uint32_t stepToIndex[4] = { 1, 3, 2, 0 };
+    const int axis[3] = { c0[0] - c1[0], c0[1] - c1[1], c0[2] - c1[2] };
+    const int lengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    if (lengthSquared == 0)
+        return 0;
+
+    int steps[16];
+#ifdef BLOCKCOMPRESSION_SSE
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i origin = _mm_setr_epi16((short)c1[0], (short)c1[1], (short)c1[2], 0, (short)c1[0], (short)c1[1], (short)c1[2], 0);
+    const __m128i direction = _mm_setr_epi16((short)axis[0], (short)axis[1], (short)axis[2], 0, (short)axis[0], (short)axis[1], (short)axis[2], 0);
+    const __m128i threshold1 = _mm_set1_epi32(lengthSquared), threshold2 = _mm_set1_epi32(3 * lengthSquared), threshold3 = _mm_set1_epi32(5 * lengthSquared);
+    for (int i = 0; i < 16; i += 4)
+    {
+        // Two texels per register as 16-bit lanes; madd leaves r*dr + g*dg and b*db per texel to add up
+        const __m128i texels = _mm_loadu_si128((const __m128i*)(rgba + i * 4));
+        const __m128i low = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(texels, zero), origin), direction);
+        const __m128i high = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(texels, zero), origin), direction);
+        const __m128 lowFloat = _mm_castsi128_ps(low), highFloat = _mm_castsi128_ps(high);
+        const __m128i dot = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lowFloat, highFloat, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm_castps_si128(_mm_shuffle_ps(lowFloat, highFloat, _MM_SHUFFLE(3, 1, 3, 1))));
+
+        // 6 * dot against 1, 3 and 5 times the squared length; each passed threshold is one step up
+        const __m128i dot6 = _mm_add_epi32(_mm_slli_epi32(dot, 2), _mm_slli_epi32(dot, 1));
+        const __m128i step = _mm_sub_epi32(_mm_sub_epi32(_mm_sub_epi32(zero, _mm_cmpgt_epi32(dot6, threshold1)),
+            _mm_cmpgt_epi32(dot6, threshold2)), _mm_cmpgt_epi32(dot6, threshold3));
+        _mm_storeu_si128((__m128i*)(steps + i), step);
+    }
+#else
+    for (int i = 0; i < 16; ++i)
+    {
+        const uint8_t* texel = rgba + i * 4;
+        const int dot6 = 6 * ((texel[0] - c1[0]) * axis[0] + (texel[1] - c1[1]) * axis[1] + (texel[2] - c1[2]) * axis[2]);
+        steps[i] = (dot6 > lengthSquared) + (dot6 > 3 * lengthSquared) + (dot6 > 5 * lengthSquared);
+    }
+#endif
+
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; ++i)
+        indices |= stepToIndex[steps[i]] << (i * 2);
+    return indices;
+}
+
+// Squared RGB error of 16 texels against the four color palette they were indexed into
+inline int Bc1Error(const uint8_t* rgba, const int c0[3], const int c1[3], uint32_t indices)
+{
+    int palette[4][3];
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[0][c] = c0[c];
+        palette[1][c] = c1[c];
+        palette[2][c] = (2 * c0[c] + c1[c]) / 3;
+        palette[3][c] = (c0[c] + 2 * c1[c]) / 3;
+    }
+
+    int error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        const int* color = palette[(indices >> (i * 2)) & 3];
+        for (int c = 0; c < 3; ++c)
+            error += (rgba[i * 4 + c] - color[c]) * (rgba[i * 4 + c] - color[c]);
+    }
+    return error;
+}
+
+// Quantizes two endpoints and indexes the block with them, always in four color mode (c0 > c1)
+inline int QuantizeBc1(const uint8_t* rgba, const float end0[3], const float end1[3], uint16_t& color0, uint16_t& color1, uint32_t& indices)
+{
+    auto clampByte = [](float value) { return std::min(255, std::max(0, (int)(value + 0.5f))); };
+    color0 = PackColor565(clampByte(end0[0]), clampByte(end0[1]), clampByte(end0[2]));
+    color1 = PackColor565(clampByte(end1[0]), clampByte(end1[1]), clampByte(end1[2]));
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    int c0[3], c1[3];
+    UnpackColor565(color0, c0);
+    UnpackColor565(color1, c1);
+    indices = color0 == color1 ? 0 : Bc1Indices(rgba, c0, c1);
+    return Bc1Error(rgba, c0, c1, indices);
+}
+
+// Least squares endpoints for fixed indices: every texel is a * c0 + b * c1 with a + b = 1
+inline bool RefineBc1Endpoints(const uint8_t* rgba, uint32_t indices, float end0[3], float end1[3])
+{
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        const float a = weights[(indices >> (i * 2)) & 3], b = 1.0f - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for (int c = 0; c < 3; ++c)
+        {
+            ax[c] += a * rgba[i * 4 + c];
+            bx[c] += b * rgba[i * 4 + c];
+        }
+    }
+
+    const float determinant = aa * bb - ab * ab;
+    if (std::fabs(determinant) < 1e-6f)
+        return false;
+
+    for (int c = 0; c < 3; ++c)
+    {
+        end0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+        end1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+    }
+    return true;
+}
+
+// Encodes the RGB of 16 RGBA texels into an 8 byte BC1 color block
+inline void EncodeBc1Colors(const uint8_t* rgba, BlockQuality quality, uint8_t* out)
+{
+    // Bounding box, inset by a sixteenth of its size so the endpoints land on the texels rather than past them
+    uint8_t minimum[4], maximum[4];
+#ifdef BLOCKCOMPRESSION_SSE
+    __m128i low = _mm_loadu_si128((const __m128i*)rgba), high = low;
+    for (int i = 1; i < 4; ++i)
+    {
+        const __m128i texels = _mm_loadu_si128((const __m128i*)(rgba + i * 16));
+        low = _mm_min_epu8(low, texels);
+        high = _mm_max_epu8(high, texels);
+    }
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 8));
+    low = _mm_min_epu8(low, _mm_srli_si128(low, 4));
+    high = _mm_max_epu8(high, _mm_srli_si128(high, 8));
+    high = _mm_max_epu8(high, _mm_srli_si128(high, 4));
+    const int lowBits = _mm_cvtsi128_si32(low), highBits = _mm_cvtsi128_si32(high);
+    memcpy(minimum, &lowBits, 4);
+    memcpy(maximum, &highBits, 4);
+#else
+    memcpy(minimum, rgba, 4);
+    memcpy(maximum, rgba, 4);
+    for (int i = 1; i < 16; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            minimum[c] = std::min(minimum[c], rgba[i * 4 + c]);
+            maximum[c] = std::max(maximum[c], rgba[i * 4 + c]);
+        }
+    }
+#endif
+
+    float end0[3], end1[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        const float inset = (maximum[c] - minimum[c]) / 16.0f;
+        end0[c] = maximum[c] - inset;
+        end1[c] = minimum[c] + inset;
+    }
+
+    uint16_t color0, color1;
+    uint32_t indices;
+    int error = QuantizeBc1(rgba, end0, end1, color0, color1, indices);
+
+    if (quality == BLOCK_HIGH && error > 0)
+    {
+        // Principal axis of the texels by power iteration on their covariance
+        float mean[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < 16; ++i)
+        {
+            for (int c = 0; c < 3; ++c)
+                mean[c] += rgba[i * 4 + c] / 16.0f;
+        }
+        float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };  // rr, rg, rb, gg, gb, bb
+        for (int i = 0; i < 16; ++i)
+        {
+            const float r = rgba[i * 4] - mean[0], g = rgba[i * 4 + 1] - mean[1], b = rgba[i * 4 + 2] - mean[2];
+            covariance[0] += r * r;
+            covariance[1] += r * g;
+            covariance[2] += r * b;
+            covariance[3] += g * g;
+            covariance[4] += g * b;
+            covariance[5] += b * b;
+        }
+        float axis[3] = { (float)(maximum[0] - minimum[0]), (float)(maximum[1] - minimum[1]), (float)(maximum[2] - minimum[2]) };
+        for (int iteration = 0; iteration < 8; ++iteration)
+        {
+            const float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+            const float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+            const float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+            const float length = std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
+            if (length <= 0.0f)
+                break;
+            axis[0] = x / length;
+            axis[1] = y / length;
+            axis[2] = z / length;
+        }
+
+        // Endpoints at the texels furthest along the axis either way
+        float lowest = 0.0f, highest = 0.0f;
+        for (int i = 0; i < 16; ++i)
+        {
+            const float t = (rgba[i * 4] - mean[0]) * axis[0] + (rgba[i * 4 + 1] - mean[1]) * axis[1] + (rgba[i * 4 + 2] - mean[2]) * axis[2];
+            lowest = std::min(lowest, t);
+            highest = std::max(highest, t);
+        }
+        const float axisLengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        if (axisLengthSquared > 0.0f)
+        {
+            float fit0[3], fit1[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                fit0[c] = mean[c] + axis[c] * highest / axisLengthSquared;
+                fit1[c] = mean[c] + axis[c] * lowest / axisLengthSquared;
+            }
+
+            for (int iteration = 0; iteration < 3; ++iteration)
+            {
+                uint16_t fitColor0, fitColor1;
+                uint32_t fitIndices;
+                const int fitError = QuantizeBc1(rgba, fit0, fit1, fitColor0, fitColor1, fitIndices);
+                if (fitError < error)
+                {
+                    error = fitError;
+                    color0 = fitColor0;
+                    color1 = fitColor1;
+                    indices = fitIndices;
+                }
+                if (error == 0 || !RefineBc1Endpoints(rgba, fitIndices, fit0, fit1))
+                    break;
+            }
+        }
+    }
+
+    out[0] = (uint8_t)color0;
+    out[1] = (uint8_t)(color0 >> 8);
+    out[2] = (uint8_t)color1;
+    out[3] = (uint8_t)(color1 >> 8);
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = (uint8_t)(indices >> (i * 8));
+}
+
+// Encodes the alpha of 16 RGBA texels into an 8 byte BC3 alpha block, in eight alpha mode
+inline void EncodeBc3Alpha(const uint8_t* rgba, uint8_t* out)
+{
+    int minimum = 255, maximum = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        minimum = std::min(minimum, (int)rgba[i * 4 + 3]);
+        maximum = std::max(maximum, (int)rgba[i * 4 + 3]);
+    }
+
+    out[0] = (uint8_t)maximum;
+    out[1] = (uint8_t)minimum;
+    uint64_t indices = 0;
+    if (maximum > minimum)
+    {
+        // Step 7 is alpha 0 (the maximum), step 0 is alpha 1, and steps 6 to 1 are indices 2 to 7
+        const int range = maximum - minimum;
+        for (int i = 0; i < 16; ++i)
+        {
+            const int step = ((rgba[i * 4 + 3] - minimum) * 7 + range / 2) / range;
+            const uint64_t index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+            indices |= index << (i * 3);
+        }
+    }
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = (uint8_t)(indices >> (i * 8));
+}
+
+inline void DecodeBc1Colors(const uint8_t* block, bool fourColorOnly, uint8_t* rgba)
+{
+    const uint16_t color0 = (uint16_t)(block[0] | block[1] << 8), color1 = (uint16_t)(block[2] | block[3] << 8);
+    int palette[4][4];
+    UnpackColor565(color0, palette[0]);
+    UnpackColor565(color1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+    for (int c = 0; c < 3; ++c)
+    {
+        if (color0 > color1 || fourColorOnly)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        else
+        {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    if (color0 <= color1 && !fourColorOnly)
+        palette[3][3] = 0;
+
+    const uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 | (uint32_t)block[7] << 24;
+    for (int i = 0; i < 16; ++i)
+    {
+        const int* color = palette[(indices >> (i * 2)) & 3];
+        for (int c = 0; c < 4; ++c)
+            rgba[i * 4 + c] = (uint8_t)color[c];
+    }
+}
+
+inline void DecodeBc3Alpha(const uint8_t* block, uint8_t* rgba)
+{
+    int alphas[8] = { block[0], block[1] };
+    for (int i = 1; i < 7; ++i)
+    {
+        if (alphas[0] > alphas[1])
+            alphas[i + 1] = ((7 - i) * alphas[0] + i * alphas[1]) / 7;
+        else if (i < 5)
+            alphas[i + 1] = ((5 - i) * alphas[0] + i * alphas[1]) / 5;
+    }
+    if (alphas[0] <= alphas[1])
+    {
+        alphas[6] = 0;
+        alphas[7] = 255;
+    }
+
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; ++i)
+        indices |= (uint64_t)block[2 + i] << (i * 8);
+    for (int i = 0; i < 16; ++i)
+        rgba[i * 4 + 3] = (uint8_t)alphas[(indices >> (i * 3)) & 7];
+}
+
+// Compresses a tightly packed 8-bit image with 3 or 4 channels into blocks, row of blocks after row of
+// blocks. Blocks past the right or bottom edge repeat the last column or row. With more than one thread
+// the rows of blocks are split into contiguous bands.
+inline void CompressImage(const uint8_t* pixels, int width, int height, int channels, BlockFormat format, BlockQuality quality,
+    uint8_t* out, unsigned threadCount = 1)
+{
+    const int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    const uint32_t blockBytes = BlockBytes(format);
+
+    auto compressRows = [=](int firstRow, int endRow)
+    {
+        uint8_t rgba[64];
+        for (int blockY = firstRow; blockY < endRow; ++blockY)
+        {
+            for (int blockX = 0; blockX < blocksWide; ++blockX)
+            {
+                for (int i = 0; i < 16; ++i)
+                {
+                    const int x = std::min(blockX * 4 + (i & 3), width - 1), y = std::min(blockY * 4 + (i >> 2), height - 1);
+                    const uint8_t* texel = pixels + ((size_t)y * width + x) * channels;
+                    rgba[i * 4] = texel[0];
+                    rgba[i * 4 + 1] = texel[1];
+                    rgba[i * 4 + 2] = texel[2];
+                    rgba[i * 4 + 3] = channels == 4 ? texel[3] : 255;
+                }
+
+                uint8_t* block = out + ((size_t)blockY * blocksWide + blockX) * blockBytes;
+                if (format == BLOCK_BC3)
+                {
+                    EncodeBc3Alpha(rgba, block);
+                    block += 8;
+                }
+                EncodeBc1Colors(rgba, quality, block);
+            }
+        }
+    };
+
+    threadCount = std::max(1u, std::min(threadCount, (unsigned)blocksHigh));
+    std::vector<std::thread> threads;
+    const int bandRows = (blocksHigh + threadCount - 1) / threadCount;
+    for (unsigned thread = 1; thread < threadCount; ++thread)
+        threads.emplace_back(compressRows, std::min(blocksHigh, (int)thread * bandRows), std::min(blocksHigh, (int)(thread + 1) * bandRows));
+    compressRows(0, std::min(blocksHigh, bandRows));
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// Expands blocks back into a tightly packed RGBA image, to measure what the compression lost
+inline void DecompressImage(const uint8_t* blocks, int width, int height, BlockFormat format, uint8_t* rgba)
+{
+    const int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    uint8_t texels[64];
+    for (int blockY = 0; blockY < blocksHigh; ++blockY)
+    {
+        for (int blockX = 0; blockX < blocksWide; ++blockX)
+        {
+            const uint8_t* block = blocks + ((size_t)blockY * blocksWide + blockX) * BlockBytes(format);
+            if (format == BLOCK_BC3)
+            {
+                DecodeBc1Colors(block + 8, true, texels);
+                DecodeBc3Alpha(block, texels);
+            }
+            else
+                DecodeBc1Colors(block, false, texels);
+
+            for (int i = 0; i < 16; ++i)
+            {
+                const int x = blockX * 4 + (i & 3), y = blockY * 4 + (i >> 2);
+                if (x < width && y < height)
+                    memcpy(rgba + ((size_t)y * width + x) * 4, texels + i * 4, 4);
+            }
+        }
+    }
+}
+
+// Peak signal to noise ratio in dB of a decompressed RGBA image against the source, over the source's channels
+inline double ImagePsnr(const uint8_t* pixels, const uint8_t* rgba, int width, int height, int channels)
+{
+    double squaredError = 0.0;
+    for (size_t i = 0; i < (size_t)width * height; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            const double difference = (double)pixels[i * channels + c] - rgba[i * 4 + c];
+            squaredError += difference * difference;
+        }
+    }
+    const double meanSquaredError = squaredError / ((double)width * height * channels);
+    return meanSquaredError > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / meanSquaredError) : 99.0;
+}
+
+#endif
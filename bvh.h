@@ -0,0 +1,354 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Axis aligned box used for BVH primitives and nodes
+struct BvhBox
+{
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    void Grow(const BvhBox& box)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            min[axis] = std::min(min[axis], box.min[axis]);
+            max[axis] = std::max(max[axis], box.max[axis]);
+        }
+    }
+
+    void Grow(const float point[3])
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            min[axis] = std::min(min[axis], point[axis]);
+            max[axis] = std::max(max[axis], point[axis]);
+        }
+    }
+
+    float Center(int axis) const { return (min[axis] + max[axis]) * 0.5f; }
+
+    // Half the surface area, which is all the SAH needs
+    float HalfArea() const
+    {
+        const float x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+        return (x < 0.0f) ? 0.0f : x * y + y * z + z * x;
+    }
+};
+
+// A ray with a precomputed reciprocal direction for the slab test
+struct BvhRay
+{
+    float origin[3];
+    float direction[3];
+    float invDirection[3];
+
+    BvhRay(const float rayOrigin[3], const float rayDirection[3])
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            origin[axis] = rayOrigin[axis];
+            direction[axis] = rayDirection[axis];
+            invDirection[axis] = 1.0f / rayDirection[axis];
+        }
+    }
+};
+
+// 32 byte node. Interior nodes have count 0 and their children at first and first + 1;
+// leaves hold count primitives starting at first in Bvh::primitives.
+struct BvhNode
+{
+    BvhBox bounds;
+    uint32_t first;
+    uint32_t count;
+};
+
+// Returns the distance at which the ray enters the box, or FLT_MAX when it misses it before tMax
+inline float IntersectBox(const BvhRay& ray, const BvhBox& box, float tMax)
+{
+    float tNear = 0.0f, tFar = tMax;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float t0 = (box.min[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        float t1 = (box.max[axis] - ray.origin[axis]) * ray.invDirection[axis];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        tNear = std::max(tNear, t0);
+        tFar = std::min(tFar, t1);
+    }
+    return tNear <= tFar ? tNear : FLT_MAX;
+}
+
+// Moller-Trumbore. Returns true and shortens t when the ray hits the triangle closer than t.
+inline bool IntersectTriangle(const BvhRay& ray, const float* a, const float* b, const float* c, float& t)
+{
+    const float edge1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+    const float edge2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+    const float* d = ray.direction;
+    const float p[3] = { d[1] * edge2[2] - d[2] * edge2[1], d[2] * edge2[0] - d[0] * edge2[2], d[0] * edge2[1] - d[1] * edge2[0] };
+    const float determinant = edge1[0] * p[0] + edge1[1] * p[1] + edge1[2] * p[2];
+    if (std::fabs(determinant) < 1e-12f)
+        return false;
+
+    const float invDeterminant = 1.0f / determinant;
+    const float s[3] = { ray.origin[0] - a[0], ray.origin[1] - a[1], ray.origin[2] - a[2] };
+    const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDeterminant;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    const float q[3] = { s[1] * edge1[2] - s[2] * edge1[1], s[2] * edge1[0] - s[0] * edge1[2], s[0] * edge1[1] - s[1] * edge1[0] };
+    const float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDeterminant;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    const float hit = (edge2[0] * q[0] + edge2[1] * q[1] + edge2[2] * q[2]) * invDeterminant;
+    if (hit <= 0.0f || hit >= t)
+        return false;
+
+    t = hit;
+    return true;
+}
+
+// Bounding volume hierarchy over primitives described only by their boxes. Built top down with a
+// binned surface area heuristic; when primitives move without being added or removed, Refit updates
+// the node bounds bottom up in linear time instead of rebuilding.
+struct Bvh
+{
+    static const int BIN_COUNT = 16;
+    static const uint32_t MAX_LEAF_SIZE = 4;
+    static const int MAX_SAH_DEPTH = 48;        // Deeper nodes split at the median, which bounds the tree depth
+    static const int MAX_TRAVERSAL_DEPTH = 128;
+
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> primitives;
+
+    void Build(const std::vector<BvhBox>& boxes)
+    {
+        nodes.clear();
+        primitives.resize(boxes.size());
+        for (uint32_t i = 0; i < (uint32_t)boxes.size(); ++i)
+            primitives[i] = i;
+        if (boxes.empty())
+            return;
+
+        nodes.reserve(boxes.size() * 2);
+        nodes.push_back(BvhNode());
+        nodes[0].first = 0;
+        nodes[0].count = (uint32_t)boxes.size();
+
+        // Split nodes from an explicit stack of (node, depth), children are always allocated as a pair
+        std::vector<std::pair<uint32_t, int>> stack(1, std::make_pair(0u, 0));
+        while (!stack.empty())
+        {
+            const uint32_t nodeIndex = stack.back().first;
+            const int depth = stack.back().second;
+            stack.pop_back();
+            if (Split(nodeIndex, boxes, depth >= MAX_SAH_DEPTH))
+            {
+                stack.push_back(std::make_pair(nodes[nodeIndex].first, depth + 1));
+                stack.push_back(std::make_pair(nodes[nodeIndex].first + 1, depth + 1));
+            }
+        }
+    }
+
+    // Children always come after their parent, so walking backwards visits them first
+    void Refit(const std::vector<BvhBox>& boxes)
+    {
+        for (size_t i = nodes.size(); i-- > 0;)
+        {
+            BvhNode& node = nodes[i];
+            node.bounds = BvhBox();
+            if (node.count > 0)
+            {
+                for (uint32_t p = node.first; p < node.first + node.count; ++p)
+                    node.bounds.Grow(boxes[primitives[p]]);
+            }
+            else
+            {
+                node.bounds.Grow(nodes[node.first].bounds);
+                node.bounds.Grow(nodes[node.first + 1].bounds);
+            }
+        }
+    }
+
+    // Visits the leaves the ray reaches, nearest child first. intersectPrimitive(primitive, t) returns
+    // true and shortens t on a hit; the primitive of the closest hit is returned, or UINT32_MAX.
+    template <typename IntersectPrimitive>
+    uint32_t Intersect(const BvhRay& ray, float& t, IntersectPrimitive intersectPrimitive) const
+    {
+        uint32_t hit = UINT32_MAX;
+        if (nodes.empty() || IntersectBox(ray, nodes[0].bounds, t) == FLT_MAX)
+            return hit;
+
+        uint32_t stack[MAX_TRAVERSAL_DEPTH];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BvhNode& node = nodes[stack[--stackSize]];
+            if (node.count > 0)
+            {
+                for (uint32_t p = node.first; p < node.first + node.count; ++p)
+                {
+                    if (intersectPrimitive(primitives[p], t))
+                        hit = primitives[p];
+                }
+                continue;
+            }
+
+            uint32_t nearChild = node.first, farChild = node.first + 1;
+            float nearT = IntersectBox(ray, nodes[nearChild].bounds, t);
+            float farT = IntersectBox(ray, nodes[farChild].bounds, t);
+            if (farT < nearT)
+            {
+                std::swap(nearChild, farChild);
+                std::swap(nearT, farT);
+            }
+
+            // Pushed far first so the near child is popped next
+            if (farT != FLT_MAX)
+                stack[stackSize++] = farChild;
+            if (nearT != FLT_MAX)
+                stack[stackSize++] = nearChild;
+        }
+        return hit;
+    }
+
+private:
+    // Computes the node's bounds and splits it in two when the SAH says it pays off. Returns false for leaves.
+    bool Split(uint32_t nodeIndex, const std::vector<BvhBox>& boxes, bool medianSplit)
+    {
+        const uint32_t first = nodes[nodeIndex].first;
+        const uint32_t count = nodes[nodeIndex].count;
+
+        BvhBox bounds, centroidBounds;
+        for (uint32_t p = first; p < first + count; ++p)
+        {
+            const BvhBox& box = boxes[primitives[p]];
+            const float centroid[3] = { box.Center(0), box.Center(1), box.Center(2) };
+            bounds.Grow(box);
+            centroidBounds.Grow(centroid);
+        }
+        nodes[nodeIndex].bounds = bounds;
+        if (count <= 2)
+            return false;
+
+        if (medianSplit)
+        {
+            // Largest centroid axis, halved by count
+            int axis = 0;
+            for (int a = 1; a < 3; ++a)
+            {
+                if (centroidBounds.max[a] - centroidBounds.min[a] > centroidBounds.max[axis] - centroidBounds.min[axis])
+                    axis = a;
+            }
+            const uint32_t middle = first + count / 2;
+            std::nth_element(primitives.begin() + first, primitives.begin() + middle, primitives.begin() + first + count,
+                [&](uint32_t a, uint32_t b) { return boxes[a].Center(axis) < boxes[b].Center(axis); });
+            AddChildren(nodeIndex, middle);
+            return true;
+        }
+
+        // Bin the centroids along every axis and keep the cheapest split plane
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+            if (extent <= 0.0f)
+                continue;
+
+            BvhBox binBounds[BIN_COUNT];
+            uint32_t binCounts[BIN_COUNT] = {};
+            const float scale = BIN_COUNT / extent;
+            for (uint32_t p = first; p < first + count; ++p)
+            {
+                const BvhBox& box = boxes[primitives[p]];
+                const int bin = std::min(BIN_COUNT - 1, (int)((box.Center(axis) - centroidBounds.min[axis]) * scale));
+                binBounds[bin].Grow(box);
+                ++binCounts[bin];
+            }
+
+            // Sweep from the right to get the area and count of everything past each plane
+            float rightAreas[BIN_COUNT];
+            uint32_t rightCounts[BIN_COUNT];
+            BvhBox right;
+            uint32_t rightCount = 0;
+            for (int bin = BIN_COUNT - 1; bin > 0; --bin)
+            {
+                right.Grow(binBounds[bin]);
+                rightCount += binCounts[bin];
+                rightAreas[bin] = right.HalfArea();
+                rightCounts[bin] = rightCount;
+            }
+
+            BvhBox left;
+            uint32_t leftCount = 0;
+            for (int split = 1; split < BIN_COUNT; ++split)
+            {
+                left.Grow(binBounds[split - 1]);
+                leftCount += binCounts[split - 1];
+                if (leftCount == 0 || rightCounts[split] == 0)
+                    continue;
+
+                const float cost = leftCount * left.HalfArea() + rightCounts[split] * rightAreas[split];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        // Stay a leaf when splitting is not cheaper than testing every primitive, unless the leaf would be too big
+        const float leafCost = count * bounds.HalfArea();
+        uint32_t middle;
+        if (bestAxis >= 0 && (bestCost < leafCost || count > MAX_LEAF_SIZE))
+        {
+            const float scale = BIN_COUNT / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+            const float minimum = centroidBounds.min[bestAxis];
+            const int axis = bestAxis, split = bestSplit;
+            middle = (uint32_t)(std::partition(primitives.begin() + first, primitives.begin() + first + count, [&](uint32_t primitive)
+            {
+                return std::min(BIN_COUNT - 1, (int)((boxes[primitive].Center(axis) - minimum) * scale)) < split;
+            }) - primitives.begin());
+        }
+        else if (count > MAX_LEAF_SIZE)
+        {
+            // Every centroid is in the same place; any even split is as good as another
+            middle = first + count / 2;
+        }
+        else
+        {
+            return false;
+        }
+
+        AddChildren(nodeIndex, middle);
+        return true;
+    }
+
+    // Turns a leaf into an interior node whose children hold its primitives before and after middle
+    void AddChildren(uint32_t nodeIndex, uint32_t middle)
+    {
+        const uint32_t first = nodes[nodeIndex].first;
+        const uint32_t count = nodes[nodeIndex].count;
+        const uint32_t leftChild = (uint32_t)nodes.size();
+        nodes.push_back(BvhNode());
+        nodes.push_back(BvhNode());
+        nodes[leftChild].first = first;
+        nodes[leftChild].count = middle - first;
+        nodes[leftChild + 1].first = middle;
+        nodes[leftChild + 1].count = first + count - middle;
+        nodes[nodeIndex].first = leftChild;
+        nodes[nodeIndex].count = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE2 1
+#endif
+
+// World space bounds of many objects, stored as one array per component so four objects can be
+// tested at a time. Each object has an axis aligned box (center and half extent) and a sphere
+// around the same center.
+struct BoundsSoA
+{
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    std::vector<float> radius;
+
+    size_t Size() const { return centerX.size(); }
+
+    void Resize(size_t count)
+    {
+        centerX.resize(count); centerY.resize(count); centerZ.resize(count);
+        extentX.resize(count); extentY.resize(count); extentZ.resize(count);
+        radius.resize(count);
+    }
+
+    void Set(size_t i, const float center[3], const float extent[3], float sphereRadius)
+    {
+        centerX[i] = center[0]; centerY[i] = center[1]; centerZ[i] = center[2];
+        extentX[i] = extent[0]; extentY[i] = extent[1]; extentZ[i] = extent[2];
+        radius[i] = sphereRadius;
+    }
+};
+
+// Six planes (left, right, bottom, top, near, far) as a, b, c, d with a unit normal pointing inside,
+// so a point p is inside a plane when a * p.x + b * p.y + c * p.z + d >= 0
+struct Frustum
+{
+    float planes[6][4];
+};
+
+// Counts from the last CullBounds call
+struct CullStats
+{
+    unsigned tested;
+    unsigned culled;
+    unsigned drawn;
+};
+
+// Extracts the world space frustum from a column major projection * view matrix (Gribb / Hartmann).
+// Works for perspective and orthographic projections alike.
+inline Frustum ExtractFrustumPlanes(const float* m)
+{
+    // Row r of the matrix is m[r], m[4 + r], m[8 + r], m[12 + r]
+    auto row = [m](int r, int column) { return m[column * 4 + r]; };
+
+    Frustum frustum;
+    for (int i = 0; i < 6; ++i)
+    {
+        const int axis = i / 2;
+        const float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        float length = 0.0f;
+        for (int column = 0; column < 4; ++column)
+        {
+            frustum.planes[i][column] = row(3, column) + sign * row(axis, column);
+            if (column < 3)
+                length += frustum.planes[i][column] * frustum.planes[i][column];
+        }
+
+        length = std::sqrt(length);
+        for (int column = 0; column < 4; ++column)
+            frustum.planes[i][column] /= length;
+    }
+    return frustum;
+}
+
+// Tests every object against the frustum and writes 1 to visible for the ones that may be on screen.
+// An object is culled when it lies entirely outside any plane. Per plane the test uses whichever of the
+// box or the sphere reaches less far towards the plane, so the tighter of the two volumes wins.
+inline void CullBounds(const BoundsSoA& bounds, const Frustum& frustum, std::vector<uint8_t>& visible, CullStats& stats)
+{
+    const size_t count = bounds.Size();
+    visible.resize(count);
+    size_t i = 0;
+
+#ifdef CULLING_SSE2
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6], planeAbsX[6], planeAbsY[6], planeAbsZ[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p][0]);
+        planeY[p] = _mm_set1_ps(frustum.planes[p][1]);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p][2]);
+        planeW[p] = _mm_set1_ps(frustum.planes[p][3]);
+        planeAbsX[p] = _mm_andnot_ps(signMask, planeX[p]);
+        planeAbsY[p] = _mm_andnot_ps(signMask, planeY[p]);
+        planeAbsZ[p] = _mm_andnot_ps(signMask, planeZ[p]);
+    }
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 cx = _mm_loadu_ps(&bounds.centerX[i]);
+        const __m128 cy = _mm_loadu_ps(&bounds.centerY[i]);
+        const __m128 cz = _mm_loadu_ps(&bounds.centerZ[i]);
+        const __m128 ex = _mm_loadu_ps(&bounds.extentX[i]);
+        const __m128 ey = _mm_loadu_ps(&bounds.extentY[i]);
+        const __m128 ez = _mm_loadu_ps(&bounds.extentZ[i]);
+        const __m128 r = _mm_loadu_ps(&bounds.radius[i]);
+
+        __m128 outside = _mm_setzero_ps();
+        for (int p = 0; p < 6; ++p)
+        {
+            const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], cx), _mm_mul_ps(planeY[p], cy)),
+                _mm_add_ps(_mm_mul_ps(planeZ[p], cz), planeW[p]));
+            const __m128 boxReach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeAbsX[p], ex), _mm_mul_ps(planeAbsY[p], ey)), _mm_mul_ps(planeAbsZ[p], ez));
+            const __m128 reach = _mm_min_ps(boxReach, r);
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+        }
+
+        const int mask = _mm_movemask_ps(outside);
+        visible[i] = !(mask & 1);
+        visible[i + 1] = !(mask & 2);
+        visible[i + 2] = !(mask & 4);
+        visible[i + 3] = !(mask & 8);
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; ++p)
+        {
+            const float* plane = frustum.planes[p];
+            const float distance = plane[0] * bounds.centerX[i] + plane[1] * bounds.centerY[i] + plane[2] * bounds.centerZ[i] + plane[3];
+            const float boxReach = std::fabs(plane[0]) * bounds.extentX[i] + std::fabs(plane[1]) * bounds.extentY[i] + std::fabs(plane[2]) * bounds.extentZ[i];
+            outside = distance + (boxReach < bounds.radius[i] ? boxReach : bounds.radius[i]) < 0.0f;
+        }
+        visible[i] = !outside;
+    }
+
+    stats.tested = (unsigned)count;
+    stats.drawn = 0;
+    for (uint8_t v : visible)
+        stats.drawn += v;
+    stats.culled = stats.tested - stats.drawn;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef FLYTHROUGH_H
+#define FLYTHROUGH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Where a camera is and where it looks, in the terms Camera uses: degrees of yaw and pitch, and the zoom
+// that is its vertical field of view
+struct CameraKey
+{
+    glm::vec3 position = glm::vec3(0.0f);
+    float yaw = 0.0f;
+    float pitch = 0.0f;
+    float zoom = 45.0f;
+};
+
+// Arc length samples per segment. Steps between them are treated as straight, and the parameter is
+// interpolated linearly across each, so fewer samples let the speed wobble where the spline bends; at this
+// count the frame to frame steps of the shipped paths stay within half a percent of each other.
+const int FLIGHT_ARC_SAMPLES = 256;
+
+// Uniform Catmull-Rom between p1 and p2, with p0 and p3 as the neighbouring keys
+template <typename T>
+inline T CatmullRom(const T& p0, const T& p1, const T& p2, const T& p3, float t)
+{
+    const float t2 = t * t, t3 = t2 * t;
+    return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+// A camera flight through keyframes, drawn in a fixed number of frames. The spline passes through every key,
+// and frames are spaced evenly along its length, so the camera flies at constant speed however unevenly the
+// keys are placed. When the keys only turn the camera, frames are spaced evenly between keys instead.
+// Segment i runs from key i to key i + 1 and is reported under the label of key i.
+class FlightPath
+{
+public:
+    std::string name;
+    uint32_t frames = 0;
+    std::vector<CameraKey> keys;
+    std::vector<std::string> labels;    // One per key, empty when the segment starting there has no name
+
+    size_t SegmentCount() const { return keys.size() > 1 ? keys.size() - 1 : 0; }
+    float Length() const { return mLengths.empty() ? 0.0f : mLengths.back(); }
+
+    // Measures the spline; call once the keys are in
+    void Build()
+    {
+        mLengths.assign(1, 0.0f);
+        glm::vec3 previous = keys.empty() ? glm::vec3(0.0f) : keys[0].position;
+        for (size_t segment = 0; segment < SegmentCount(); ++segment)
+        {
+            for (int sample = 1; sample <= FLIGHT_ARC_SAMPLES; ++sample)
+            {
+                const glm::vec3 position = Evaluate(segment, (float)sample / FLIGHT_ARC_SAMPLES).position;
+                mLengths.push_back(mLengths.back() + glm::length(position - previous));
+                previous = position;
+            }
+        }
+    }
+
+    // The camera of a frame, and the segment it is in
+    CameraKey Frame(uint32_t frame, size_t& segment) const
+    {
+        segment = 0;
+        if (SegmentCount() == 0)
+            return keys.empty() ? CameraKey() : keys[0];
+
+        const float fraction = frames > 1 ? (float)std::min(frame, frames - 1) / (frames - 1) : 0.0f;
+        float parameter = fraction * SegmentCount();
+        if (Length() > 1e-5f)
+        {
+            // Find the samples around the distance and interpolate the spline parameter between them
+            const float distance = fraction * Length();
+            const size_t upper = std::min((size_t)(std::upper_bound(mLengths.begin(), mLengths.end(), distance) - mLengths.begin()), mLengths.size() - 1);
+            const size_t lower = upper > 0 ? upper - 1 : 0;
+            const float span = mLengths[upper] - mLengths[lower];
+            const float t = span > 0.0f ? (distance - mLengths[lower]) / span : 0.0f;
+            parameter = (lower + t * (upper - lower)) / FLIGHT_ARC_SAMPLES;
+        }
+
+        segment = std::min((size_t)parameter, SegmentCount() - 1);
+        return Evaluate(segment, parameter - segment);
+    }
+
+    std::string SegmentName(size_t segment) const
+    {
+        return segment < labels.size() && !labels[segment].empty() ? labels[segment] : "segment " + std::to_string(segment);
+    }
+
+private:
+    // The end keys are mirrored to give the first and last segment a neighbour
+    CameraKey Evaluate(size_t segment, float t) const
+    {
+        const CameraKey& k1 = keys[segment];
+        const CameraKey& k2 = keys[segment + 1];
+        const CameraKey k0 = segment > 0 ? keys[segment - 1] : Mirror(k1, k2);
+        const CameraKey k3 = segment + 2 < keys.size() ? keys[segment + 2] : Mirror(k2, k1);
+
+        CameraKey key;
+        key.position = CatmullRom(k0.position, k1.position, k2.position, k3.position, t);
+        key.yaw = CatmullRom(k0.yaw, k1.yaw, k2.yaw, k3.yaw, t);
+        key.pitch = std::max(-89.0f, std::min(CatmullRom(k0.pitch, k1.pitch, k2.pitch, k3.pitch, t), 89.0f));
+        key.zoom = std::max(1.0f, std::min(CatmullRom(k0.zoom, k1.zoom, k2.zoom, k3.zoom, t), 45.0f));
+        return key;
+    }
+
+    static CameraKey Mirror(const CameraKey& end, const CameraKey& next)
+    {
+        CameraKey key;
+        key.position = 2.0f * end.position - next.position;
+        key.yaw = 2.0f * end.yaw - next.yaw;
+        key.pitch = 2.0f * end.pitch - next.pitch;
+        key.zoom = 2.0f * end.zoom - next.zoom;
+        return key;
+    }
+
+    std::vector<float> mLengths;    // Distance along the spline at every arc sample
+};
+
+// Reads flight paths from a text file. Blank lines and lines starting with # are skipped, the rest are
+//   path <name> <frames>
+//   key <x> <y> <z> <yaw> <pitch> <zoom> [label of the segment starting here]
+// with every key belonging to the path above it. Yaw is not wrapped, so a turn past 180 degrees is written
+// as such (-90 to -270, not -90 to 90). On failure, error says which line was wrong.
+inline bool LoadFlightPaths(const char* filename, std::vector<FlightPath>& paths, std::string& error)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        error = std::string("cannot open ") + filename;
+        return false;
+    }
+
+    paths.clear();
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber)
+    {
+        std::istringstream fields(line);
+        std::string command;
+        if (!(fields >> command) || command[0] == '#')
+            continue;
+
+        if (command == "path")
+        {
+            FlightPath path;
+            if (!(fields >> path.name >> path.frames) || path.frames == 0)
+            {
+                error = "line " + std::to_string(lineNumber) + ": expected path <name> <frames>";
+                return false;
+            }
+            paths.push_back(path);
+        }
+        else if (command == "key" && !paths.empty())
+        {
+            CameraKey key;
+            if (!(fields >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch >> key.zoom))
+            {
+                error = "line " + std::to_string(lineNumber) + ": expected key <x> <y> <z> <yaw> <pitch> <zoom> [label]";
+                return false;
+            }
+            std::string label;
+            fields >> label;
+            paths.back().keys.push_back(key);
+            paths.back().labels.push_back(label);
+        }
+        else
+        {
+            error = "line " + std::to_string(lineNumber) + ": unknown " + command + (command == "key" ? " before any path" : "");
+            return false;
+        }
+    }
+
+    for (FlightPath& path : paths)
+    {
+        if (path.keys.size() < 2)
+        {
+            error = "path " + path.name + " needs at least two keys";
+            return false;
+        }
+        path.Build();
+    }
+    if (paths.empty())
+        error = "no paths";
+    return !paths.empty();
+}
+
+#endif
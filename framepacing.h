@@ -0,0 +1,208 @@
+#ifndef FRAMEPACING_H
+#define FRAMEPACING_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "gpuresources.h"
+
+// Steady clock in nanoseconds, the time base of everything pacing measures
+inline uint64_t PacingNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Least time FrameLimiter spins for, which covers the wake up delay of a fine grained timer
+const uint64_t FRAME_LIMITER_MIN_MARGIN_NS = 200000;
+
+// Holds frames to a target rate. The OS only wakes a sleeping thread somewhat after it asked to, so Wait
+// sleeps until a margin before the deadline and spins through the rest. The margin follows the worst
+// oversleep seen lately: it grows at once when a wake up is late and shrinks slowly, so a coarse timer
+// (Windows' default 15.6 ms tick) costs spinning instead of missed deadlines.
+class FrameLimiter
+{
+public:
+    void SetRate(double hz)
+    {
+        mPeriodNs = hz > 0.0 ? (uint64_t)(1e9 / hz) : 0;
+        mDeadlineNs = 0;
+    }
+
+    bool IsActive() const { return mPeriodNs > 0; }
+
+    // Returns once the next frame is due, a period after the previous one was. A frame that ran over starts
+    // the schedule again from now, rather than rushing the frames after it to catch up.
+    void Wait()
+    {
+        if (!IsActive())
+            return;
+
+        uint64_t now = PacingNow();
+        mDeadlineNs = mDeadlineNs == 0 ? now : mDeadlineNs + mPeriodNs;
+        if (now >= mDeadlineNs)
+        {
+            mDeadlineNs = now;
+            return;
+        }
+
+        if (mDeadlineNs - now > mMarginNs)
+        {
+            const uint64_t wakeNs = mDeadlineNs - mMarginNs;
+            std::this_thread::sleep_for(std::chrono::nanoseconds(wakeNs - now));
+            const uint64_t woken = PacingNow();
+            const uint64_t oversleepNs = woken > wakeNs ? woken - wakeNs : 0;
+            mMarginNs = std::max(std::max(oversleepNs + oversleepNs / 4, mMarginNs - mMarginNs / 16), FRAME_LIMITER_MIN_MARGIN_NS);
+            mSleptNs += woken - now;
+            now = woken;
+        }
+
+        const uint64_t spinStart = now;
+        while (now < mDeadlineNs)
+        {
+            std::this_thread::yield();
+            now = PacingNow();
+        }
+        mSpunNs += now - spinStart;
+        ++mWaits;
+    }
+
+    double SleptMs() const { return mSleptNs / 1e6; }
+    double SpunMs() const { return mSpunNs / 1e6; }
+    uint64_t WaitCount() const { return mWaits; }
+    double MarginMs() const { return mMarginNs / 1e6; }
+
+private:
+    uint64_t mPeriodNs = 0;
+    uint64_t mDeadlineNs = 0;
+    uint64_t mMarginNs = 1000000;
+    uint64_t mSleptNs = 0, mSpunNs = 0, mWaits = 0;
+};
+
+// Mean of the last few frame times, for moving things by a step that does not jitter with every frame
+class FrameTimeSmoother
+{
+public:
+    void SetFrames(uint32_t frames)
+    {
+        mHistory.assign(frames, 0.0f);
+        mCount = 0;
+        mSum = 0.0;
+    }
+
+    bool IsActive() const { return !mHistory.empty(); }
+
+    float Smooth(float deltaTime)
+    {
+        if (mHistory.empty())
+            return deltaTime;
+
+        float& slot = mHistory[mCount++ % mHistory.size()];
+        mSum += deltaTime - slot;
+        slot = deltaTime;
+        return (float)(mSum / std::min<size_t>(mCount, mHistory.size()));
+    }
+
+private:
+    std::vector<float> mHistory;
+    size_t mCount = 0;
+    double mSum = 0.0;
+};
+
+// Frames of present timestamps in flight before the oldest is read back; later ones are dropped
+const int LATENCY_FRAMES = 4;
+
+// Latencies kept for the summary, a little over two minutes at 60 Hz. Older ones are overwritten.
+const size_t LATENCY_SAMPLES = 8192;
+
+// Measures input to present latency: from when a frame polled its input to when it was presented. GL
+// cannot see the display, so presented means the later of the swap call returning (where vsync blocks)
+// and the GPU reaching a timestamp placed after the swap, moved onto the CPU clock. Any scan out delay
+// after that is not counted. Context thread only.
+class PresentLatency
+{
+public:
+    void CreateQueries()
+    {
+        for (Slot& slot : mSlots)
+        {
+            slot.query = GpuQuery::Create("present latency timestamp");
+            slot.pending = false;
+        }
+    }
+
+    void DestroyQueries()
+    {
+        for (Slot& slot : mSlots)
+            slot = Slot();
+    }
+
+    // Right after the swap of a frame whose input was polled at inputNs (PacingNow time)
+    void FramePresented(uint64_t inputNs)
+    {
+        const uint64_t swapNs = PacingNow();
+        Slot& slot = mSlots[mNext];
+        mNext = (mNext + 1) % LATENCY_FRAMES;
+        if (!slot.query)
+            return;
+        Read(slot);
+
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        slot.clockOffsetNs = (int64_t)swapNs - gpuNow;
+        glQueryCounter(slot.query, GL_TIMESTAMP);
+        slot.inputNs = inputNs;
+        slot.swapNs = swapNs;
+        slot.pending = true;
+    }
+
+    // The most recent LATENCY_SAMPLES latencies, in no particular order
+    const std::vector<float>& LatencyMs() const { return mLatencyMs; }
+    uint64_t MeasuredCount() const { return mMeasured; }
+    uint64_t DroppedCount() const { return mDropped; }
+
+private:
+    struct Slot
+    {
+        GpuQuery query;
+        bool pending = false;
+        uint64_t inputNs = 0;
+        uint64_t swapNs = 0;
+        int64_t clockOffsetNs = 0;
+    };
+
+    void Read(Slot& slot)
+    {
+        if (!slot.pending)
+            return;
+        slot.pending = false;
+
+        GLint available = 0;
+        glGetQueryObjectiv(slot.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            ++mDropped;
+            return;
+        }
+
+        GLuint64 gpuNs = 0;
+        glGetQueryObjectui64v(slot.query, GL_QUERY_RESULT, &gpuNs);
+        const int64_t presentedNs = std::max((int64_t)gpuNs + slot.clockOffsetNs, (int64_t)slot.swapNs);
+        const float latencyMs = (float)((presentedNs - (int64_t)slot.inputNs) / 1e6);
+        if (mLatencyMs.size() < LATENCY_SAMPLES)
+            mLatencyMs.push_back(latencyMs);
+        else
+            mLatencyMs[mMeasured % LATENCY_SAMPLES] = latencyMs;
+        ++mMeasured;
+    }
+
+    Slot mSlots[LATENCY_FRAMES];
+    int mNext = 0;
+    std::vector<float> mLatencyMs;
+    uint64_t mMeasured = 0;
+    uint64_t mDropped = 0;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef FRAMETIMING_H
+#define FRAMETIMING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+// Distribution of a run of frame times, in milliseconds
+struct FrameTimeSummary
+{
+    size_t count = 0;
+    double totalMs = 0.0;
+    double meanMs = 0.0;
+    double minMs = 0.0;
+    double p50Ms = 0.0;
+    double p90Ms = 0.0;
+    double p95Ms = 0.0;
+    double p99Ms = 0.0;
+    double maxMs = 0.0;
+};
+
+// Nearest rank percentiles, so every reported time is one a frame really took. Takes the times by value
+// to sort them.
+inline FrameTimeSummary SummarizeFrameTimes(std::vector<float> frameMs)
+{
+    FrameTimeSummary summary;
+    summary.count = frameMs.size();
+    if (frameMs.empty())
+        return summary;
+
+    std::sort(frameMs.begin(), frameMs.end());
+    for (float ms : frameMs)
+        summary.totalMs += ms;
+
+    auto percentile = [&](double p)
+    {
+        const size_t rank = (size_t)std::ceil(p / 100.0 * frameMs.size());
+        return (double)frameMs[std::min(std::max(rank, (size_t)1), frameMs.size()) - 1];
+    };
+    summary.meanMs = summary.totalMs / frameMs.size();
+    summary.minMs = frameMs.front();
+    summary.p50Ms = percentile(50.0);
+    summary.p90Ms = percentile(90.0);
+    summary.p95Ms = percentile(95.0);
+    summary.p99Ms = percentile(99.0);
+    summary.maxMs = frameMs.back();
+    return summary;
+}
+
+// The summary as JSON members, without braces, so callers can add their own around it
+inline void WriteFrameTimeJson(std::ostream& out, const FrameTimeSummary& summary)
+{
+    out << "\"frames\":" << summary.count << ",\"totalMs\":" << summary.totalMs << ",\"meanMs\":" << summary.meanMs
+        << ",\"minMs\":" << summary.minMs << ",\"p50Ms\":" << summary.p50Ms << ",\"p90Ms\":" << summary.p90Ms
+        << ",\"p95Ms\":" << summary.p95Ms << ",\"p99Ms\":" << summary.p99Ms << ",\"maxMs\":" << summary.maxMs
+        << ",\"fps\":" << (summary.totalMs > 0.0 ? summary.count * 1000.0 / summary.totalMs : 0.0);
+}
+
+#endif
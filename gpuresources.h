@@ -0,0 +1,219 @@
+#ifndef GPURESOURCES_H
+#define GPURESOURCES_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <GL/glew.h>
+
+// Kinds of GL object the resource manager owns
+enum GpuResourceKind
+{
+    GPU_BUFFER,
+    GPU_TEXTURE,
+    GPU_VERTEX_ARRAY,
+    GPU_PROGRAM,
+    GPU_VERTEX_SHADER,
+    GPU_FRAGMENT_SHADER,
+    GPU_QUERY,
+    GPU_FRAMEBUFFER,
+    GPU_RENDERBUFFER,
+    GPU_RESOURCE_KIND_COUNT
+};
+
+const char* const GPU_RESOURCE_KIND_NAMES[GPU_RESOURCE_KIND_COUNT] = { "buffer", "texture", "vertex array", "program", "vertex shader", "fragment shader", "query", "framebuffer", "renderbuffer" };
+
+// Every GL object the program creates goes through here, so each one is deleted with the call matching its
+// kind, the memory it holds is counted per kind, and whatever is still alive at shutdown can be listed.
+// Objects are reference counted by GpuHandle. Like the GL calls themselves, only the context thread may
+// use it.
+class GpuResourceManager
+{
+public:
+    // Creates an object with one reference, owned by the caller
+    GLuint Create(GpuResourceKind kind, const char* label)
+    {
+        GLuint id = 0;
+        switch (kind)
+        {
+        case GPU_BUFFER: glGenBuffers(1, &id); break;
+        case GPU_TEXTURE: glGenTextures(1, &id); break;
+        case GPU_VERTEX_ARRAY: glGenVertexArrays(1, &id); break;
+        case GPU_PROGRAM: id = glCreateProgram(); break;
+        case GPU_VERTEX_SHADER: id = glCreateShader(GL_VERTEX_SHADER); break;
+        case GPU_FRAGMENT_SHADER: id = glCreateShader(GL_FRAGMENT_SHADER); break;
+        case GPU_QUERY: glGenQueries(1, &id); break;
+        case GPU_FRAMEBUFFER: glGenFramebuffers(1, &id); break;
+        case GPU_RENDERBUFFER: glGenRenderbuffers(1, &id); break;
+        default: break;
+        }
+        if (id == 0)
+            return 0;
+
+        Resource& resource = mLive[Key(kind, id)];
+        resource = Resource();
+        resource.label = label;
+        ++mCounts[kind];
+        ++mCreated;
+        return id;
+    }
+
+    void Retain(GpuResourceKind kind, GLuint id)
+    {
+        auto it = mLive.find(Key(kind, id));
+        if (it != mLive.end())
+            ++it->second.references;
+    }
+
+    // Drops one reference and deletes the object with the last one
+    void Release(GpuResourceKind kind, GLuint id)
+    {
+        auto it = mLive.find(Key(kind, id));
+        if (it == mLive.end() || --it->second.references > 0)
+            return;
+
+        switch (kind)
+        {
+        case GPU_BUFFER: glDeleteBuffers(1, &id); break;
+        case GPU_TEXTURE: glDeleteTextures(1, &id); break;
+        case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &id); break;
+        case GPU_PROGRAM: glDeleteProgram(id); break;
+        case GPU_VERTEX_SHADER:
+        case GPU_FRAGMENT_SHADER: glDeleteShader(id); break;
+        case GPU_QUERY: glDeleteQueries(1, &id); break;
+        case GPU_FRAMEBUFFER: glDeleteFramebuffers(1, &id); break;
+        case GPU_RENDERBUFFER: glDeleteRenderbuffers(1, &id); break;
+        default: break;
+        }
+
+        mBytes[kind] -= it->second.bytes;
+        mTotalBytes -= it->second.bytes;
+        --mCounts[kind];
+        ++mDestroyed;
+        mLive.erase(it);
+    }
+
+    // Records how much memory an object holds after its storage was (re)specified
+    void SetBytes(GpuResourceKind kind, GLuint id, uint64_t bytes)
+    {
+        auto it = mLive.find(Key(kind, id));
+        if (it == mLive.end())
+            return;
+
+        mBytes[kind] += bytes - it->second.bytes;
+        mTotalBytes += bytes - it->second.bytes;
+        it->second.bytes = bytes;
+        if (mTotalBytes > mPeakBytes)
+            mPeakBytes = mTotalBytes;
+    }
+
+    uint64_t Bytes(GpuResourceKind kind, GLuint id) const
+    {
+        auto it = mLive.find(Key(kind, id));
+        return it != mLive.end() ? it->second.bytes : 0;
+    }
+
+    uint64_t TotalBytes() const { return mTotalBytes; }
+    uint64_t PeakBytes() const { return mPeakBytes; }
+    uint64_t KindBytes(GpuResourceKind kind) const { return mBytes[kind]; }
+    size_t KindCount(GpuResourceKind kind) const { return mCounts[kind]; }
+    size_t LiveCount() const { return mLive.size(); }
+    uint64_t CreatedCount() const { return mCreated; }
+    uint64_t DestroyedCount() const { return mDestroyed; }
+
+    // One line per live object: kind, GL name, label, references and bytes
+    void ReportLive(std::ostream& out) const
+    {
+        for (const auto& entry : mLive)
+        {
+            const GpuResourceKind kind = (GpuResourceKind)(entry.first >> 32);
+            out << "  " << GPU_RESOURCE_KIND_NAMES[kind] << " " << (GLuint)entry.first << " \"" << entry.second.label << "\", "
+                << entry.second.references << (entry.second.references == 1 ? " reference, " : " references, ") << entry.second.bytes << " bytes\n";
+        }
+    }
+
+private:
+    struct Resource
+    {
+        std::string label;
+        uint32_t references = 1;
+        uint64_t bytes = 0;
+    };
+
+    static uint64_t Key(GpuResourceKind kind, GLuint id) { return ((uint64_t)kind << 32) | id; }
+
+    std::unordered_map<uint64_t, Resource> mLive;
+    uint64_t mBytes[GPU_RESOURCE_KIND_COUNT] = {};
+    size_t mCounts[GPU_RESOURCE_KIND_COUNT] = {};
+    uint64_t mTotalBytes = 0, mPeakBytes = 0;
+    uint64_t mCreated = 0, mDestroyed = 0;
+};
+
+// The one manager. It is never destroyed, so handles in globals can still release into it during exit.
+inline GpuResourceManager& GpuResources()
+{
+    static GpuResourceManager* manager = new GpuResourceManager();
+    return *manager;
+}
+
+// Reference to a GL object of one kind. Copies share the object, and the last handle to go away deletes
+// it. Converts to the GL name, so a handle can be passed straight to the GL calls that use the object.
+template <GpuResourceKind Kind>
+class GpuHandle
+{
+public:
+    GpuHandle() = default;
+    ~GpuHandle() { Reset(); }
+
+    GpuHandle(const GpuHandle& other) : mId(other.mId)
+    {
+        if (mId)
+            GpuResources().Retain(Kind, mId);
+    }
+
+    GpuHandle(GpuHandle&& other) : mId(other.mId) { other.mId = 0; }
+
+    GpuHandle& operator=(GpuHandle other)
+    {
+        std::swap(mId, other.mId);
+        return *this;
+    }
+
+    static GpuHandle Create(const char* label)
+    {
+        GpuHandle handle;
+        handle.mId = GpuResources().Create(Kind, label);
+        return handle;
+    }
+
+    void Reset()
+    {
+        if (mId)
+            GpuResources().Release(Kind, mId);
+        mId = 0;
+    }
+
+    void SetBytes(uint64_t bytes) const { GpuResources().SetBytes(Kind, mId, bytes); }
+    uint64_t Bytes() const { return GpuResources().Bytes(Kind, mId); }
+
+    GLuint Id() const { return mId; }
+    operator GLuint() const { return mId; }
+
+private:
+    GLuint mId = 0;
+};
+
+typedef GpuHandle<GPU_BUFFER> GpuBuffer;
+typedef GpuHandle<GPU_TEXTURE> GpuTexture;
+typedef GpuHandle<GPU_VERTEX_ARRAY> GpuVertexArray;
+typedef GpuHandle<GPU_PROGRAM> GpuProgram;
+typedef GpuHandle<GPU_VERTEX_SHADER> GpuVertexShader;
+typedef GpuHandle<GPU_FRAGMENT_SHADER> GpuFragmentShader;
+typedef GpuHandle<GPU_QUERY> GpuQuery;
+typedef GpuHandle<GPU_FRAMEBUFFER> GpuFramebuffer;
+typedef GpuHandle<GPU_RENDERBUFFER> GpuRenderbuffer;
+
+#endif
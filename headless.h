@@ -0,0 +1,173 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Context backends for machines without a display server, compiled in when the project defines these and
+// links their libraries:
+//   HEADLESS_EGL     EGL 1.4 with EGL_KHR_create_context (libEGL). Mesa's surfaceless platform needs no
+//                    display or GPU at all and runs on llvmpipe; other drivers get a pbuffer instead.
+//   HEADLESS_OSMESA  Mesa's off-screen renderer (libOSMesa), for systems without EGL. GL calls then have
+//                    to resolve into libOSMesa, so GLEW is the one built with GLEW_OSMESA.
+#ifdef HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef HEADLESS_OSMESA
+#include <GL/osmesa.h>
+#endif
+
+// A GL 4.4 core context made current on the calling thread with nothing to present to, so frames are drawn
+// into framebuffer objects. Backends are tried in the order above.
+class HeadlessContext
+{
+public:
+    ~HeadlessContext() { Destroy(); }
+
+    bool Create(int width, int height)
+    {
+        (void)width;
+        (void)height;
+#ifdef HEADLESS_EGL
+        if (CreateEgl(width, height))
+            return true;
+        Destroy();
+#endif
+#ifdef HEADLESS_OSMESA
+        if (CreateOsMesa(width, height))
+            return true;
+        Destroy();
+#endif
+        return false;
+    }
+
+    void Destroy()
+    {
+#ifdef HEADLESS_EGL
+        if (mDisplay != EGL_NO_DISPLAY)
+        {
+            eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            if (mContext != EGL_NO_CONTEXT)
+                eglDestroyContext(mDisplay, mContext);
+            if (mSurface != EGL_NO_SURFACE)
+                eglDestroySurface(mDisplay, mSurface);
+            eglTerminate(mDisplay);
+        }
+        mDisplay = EGL_NO_DISPLAY;
+        mContext = EGL_NO_CONTEXT;
+        mSurface = EGL_NO_SURFACE;
+#endif
+#ifdef HEADLESS_OSMESA
+        if (mOsMesa)
+            OSMesaDestroyContext(mOsMesa);
+        mOsMesa = nullptr;
+        mOsMesaBuffer.clear();
+#endif
+        mApi = nullptr;
+    }
+
+    // How the context was made, or nullptr when there is none
+    const char* Api() const { return mApi; }
+
+    // Whether any backend was compiled in
+    static bool Available()
+    {
+#if defined(HEADLESS_EGL) || defined(HEADLESS_OSMESA)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+#ifdef HEADLESS_EGL
+    bool CreateEgl(int width, int height)
+    {
+        // The surfaceless platform is a client extension, asked of no display; without it the default
+        // display may still be a GPU driver reached through a render node
+        const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay)
+            mDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (mDisplay == EGL_NO_DISPLAY)
+            mDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+        EGLint major, minor;
+        if (mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+            return false;
+
+        const char* extensions = eglQueryString(mDisplay, EGL_EXTENSIONS);
+        const bool surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+        if (!extensions || !strstr(extensions, "EGL_KHR_create_context"))
+            return false;
+
+        // Every buffer the frames use is a framebuffer object, so the config only has to support desktop GL
+        const EGLint configAttributes[] = {
+            EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+            EGL_NONE };
+        EGLConfig config;
+        EGLint configCount = 0;
+        if (!eglChooseConfig(mDisplay, configAttributes, &config, 1, &configCount) || configCount == 0)
+            return false;
+
+        if (!surfaceless)
+        {
+            const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+            mSurface = eglCreatePbufferSurface(mDisplay, config, surfaceAttributes);
+            if (mSurface == EGL_NO_SURFACE)
+                return false;
+        }
+
+        const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION_KHR, 4,
+            EGL_CONTEXT_MINOR_VERSION_KHR, 4,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+            EGL_NONE };
+        mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+        if (mContext == EGL_NO_CONTEXT || !eglMakeCurrent(mDisplay, mSurface, mSurface, mContext))
+            return false;
+
+        mApi = surfaceless ? "EGL surfaceless" : "EGL pbuffer";
+        return true;
+    }
+
+    EGLDisplay mDisplay = EGL_NO_DISPLAY;
+    EGLContext mContext = EGL_NO_CONTEXT;
+    EGLSurface mSurface = EGL_NO_SURFACE;
+#endif
+
+#ifdef HEADLESS_OSMESA
+    // OSMesa always renders into client memory; it only backs the default framebuffer, which stays unused
+    bool CreateOsMesa(int width, int height)
+    {
+        const int attributes[] = {
+            OSMESA_FORMAT, OSMESA_RGBA,
+            OSMESA_DEPTH_BITS, 0,
+            OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+            OSMESA_CONTEXT_MAJOR_VERSION, 4,
+            OSMESA_CONTEXT_MINOR_VERSION, 4,
+            0 };
+        mOsMesa = OSMesaCreateContextAttribs(attributes, nullptr);
+        if (!mOsMesa)
+            return false;
+
+        mOsMesaBuffer.resize((size_t)width * height * 4);
+        if (!OSMesaMakeCurrent(mOsMesa, mOsMesaBuffer.data(), GL_UNSIGNED_BYTE, width, height))
+            return false;
+
+        mApi = "OSMesa";
+        return true;
+    }
+
+    OSMesaContext mOsMesa = nullptr;
+    std::vector<uint8_t> mOsMesaBuffer;
+#endif
+
+    const char* mApi = nullptr;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef IMAGEDECODER_H
+#define IMAGEDECODER_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "stb_image.h"
+
+// stb_image compiles its SSE2 JPEG paths for these targets unless STBI_NO_SIMD is defined
+#if !defined(STBI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define IMAGEDECODER_STB_SSE2 1
+#endif
+
+// Faster decoders are compiled in when the project defines these and links their libraries:
+//   IMAGEDECODER_TURBOJPEG  libjpeg-turbo's TurboJPEG API (turbojpeg.h, turbojpeg.lib)
+//   IMAGEDECODER_SPNG       libspng (spng.h, spng.lib)
+#ifdef IMAGEDECODER_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+#ifdef IMAGEDECODER_SPNG
+#include <spng.h>
+#endif
+
+// Size and channel count of an encoded image, known from its header alone
+struct ImageInfo
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+
+    size_t Bytes() const { return (size_t)width * height * channels; }
+};
+
+// Decodes one kind of encoded image into 8-bit texels, top row first. Probe reads only the header, so the
+// caller can allocate (or reuse) the destination before Decode fills it. Both may be called from several
+// threads at once.
+class ImageDecoder
+{
+public:
+    virtual ~ImageDecoder() = default;
+    virtual const char* Name() const = 0;
+
+    // False when the data is not an image this decoder handles, so the next decoder gets to try it
+    virtual bool Probe(const uint8_t* data, size_t size, ImageInfo& info) const = 0;
+
+    // pixels holds info.Bytes() bytes, with info as Probe filled it
+    virtual bool Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* pixels) const = 0;
+};
+
+// stb_image decodes every format the program ships. It allocates its own result, so Decode copies that
+// into the caller's buffer.
+class StbImageDecoder : public ImageDecoder
+{
+public:
+    const char* Name() const override
+    {
+#ifdef IMAGEDECODER_STB_SSE2
+        return "stb_image (SSE2)";
+#else
+        return "stb_image";
+#endif
+    }
+
+    bool Probe(const uint8_t* data, size_t size, ImageInfo& info) const override
+    {
+        return stbi_info_from_memory(data, (int)size, &info.width, &info.height, &info.channels) != 0;
+    }
+
+    bool Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* pixels) const override
+    {
+        int width, height, channels;
+        unsigned char* decoded = stbi_load_from_memory(data, (int)size, &width, &height, &channels, info.channels);
+        if (!decoded)
+            return false;
+
+        const bool matches = width == info.width && height == info.height;
+        if (matches)
+            memcpy(pixels, decoded, info.Bytes());
+        stbi_image_free(decoded);
+        return matches;
+    }
+};
+
+#ifdef IMAGEDECODER_TURBOJPEG
+// libjpeg-turbo decodes straight into the caller's buffer with its SIMD IDCT and color conversion. Grey
+// JPEGs stay one channel; CMYK ones are left to stb_image.
+class TurboJpegDecoder : public ImageDecoder
+{
+public:
+    const char* Name() const override { return "libjpeg-turbo"; }
+
+    bool Probe(const uint8_t* data, size_t size, ImageInfo& info) const override
+    {
+        int width, height, subsampling, colorspace;
+        if (size < 3 || data[0] != 0xff || data[1] != 0xd8 || data[2] != 0xff
+            || tjDecompressHeader3(Handle(), data, (unsigned long)size, &width, &height, &subsampling, &colorspace) != 0
+            || colorspace == TJCS_CMYK || colorspace == TJCS_YCCK)
+            return false;
+
+        info.width = width;
+        info.height = height;
+        info.channels = colorspace == TJCS_GRAY ? 1 : 3;
+        return true;
+    }
+
+    bool Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* pixels) const override
+    {
+        return tjDecompress2(Handle(), data, (unsigned long)size, pixels, info.width, 0, info.height,
+            info.channels == 1 ? TJPF_GRAY : TJPF_RGB, TJFLAG_ACCURATEDCT) == 0;
+    }
+
+private:
+    // A decompressor is not thread safe, so every thread keeps its own for as long as it lives
+    static tjhandle Handle()
+    {
+        struct Decompressor
+        {
+            tjhandle handle = tjInitDecompress();
+            ~Decompressor() { tjDestroy(handle); }
+        };
+        thread_local Decompressor decompressor;
+        return decompressor.handle;
+    }
+};
+#endif
+
+#ifdef IMAGEDECODER_SPNG
+// libspng decodes 8-bit PNGs straight into the caller's buffer with SIMD unfiltering. Palette images expand
+// to RGB or RGBA, depending on transparency. 16-bit images are left to stb_image.
+class SpngDecoder : public ImageDecoder
+{
+public:
+    const char* Name() const override { return "libspng"; }
+
+    bool Probe(const uint8_t* data, size_t size, ImageInfo& info) const override
+    {
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        if (size < sizeof(signature) || memcmp(data, signature, sizeof(signature)) != 0)
+            return false;
+
+        Context context(data, size);
+        spng_ihdr header;
+        int format;
+        if (!context.ctx || spng_get_ihdr(context.ctx, &header) != 0 || !Format(context.ctx, header, format))
+            return false;
+
+        info.width = (int)header.width;
+        info.height = (int)header.height;
+        info.channels = format == SPNG_FMT_G8 ? 1 : format == SPNG_FMT_GA8 ? 2 : format == SPNG_FMT_RGB8 ? 3 : 4;
+        return true;
+    }
+
+    bool Decode(const uint8_t* data, size_t size, const ImageInfo& info, uint8_t* pixels) const override
+    {
+        Context context(data, size);
+        spng_ihdr header;
+        int format;
+        return context.ctx && spng_get_ihdr(context.ctx, &header) == 0 && Format(context.ctx, header, format)
+            && spng_decode_image(context.ctx, pixels, info.Bytes(), format, SPNG_DECODE_TRNS) == 0;
+    }
+
+private:
+    struct Context
+    {
+        spng_ctx* ctx;
+        Context(const uint8_t* data, size_t size) : ctx(spng_ctx_new(0))
+        {
+            if (ctx && spng_set_png_buffer(ctx, data, size) != 0)
+            {
+                spng_ctx_free(ctx);
+                ctx = nullptr;
+            }
+        }
+        ~Context() { spng_ctx_free(ctx); }
+    };
+
+    // Output format keeping every channel of the image, or false for ones stb_image handles better
+    static bool Format(spng_ctx* ctx, const spng_ihdr& header, int& format)
+    {
+        if (header.bit_depth > 8)
+            return false;
+
+        spng_trns transparency;
+        switch (header.color_type)
+        {
+        case SPNG_COLOR_TYPE_GRAYSCALE: format = SPNG_FMT_G8; return true;
+        case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA: format = SPNG_FMT_GA8; return true;
+        case SPNG_COLOR_TYPE_TRUECOLOR: format = spng_get_trns(ctx, &transparency) == 0 ? SPNG_FMT_RGBA8 : SPNG_FMT_RGB8; return true;
+        case SPNG_COLOR_TYPE_INDEXED: format = spng_get_trns(ctx, &transparency) == 0 ? SPNG_FMT_RGBA8 : SPNG_FMT_RGB8; return true;
+        case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA: format = SPNG_FMT_RGBA8; return true;
+        default: return false;
+        }
+    }
+};
+#endif
+
+// The decoders compiled in, most specialized first, with stb_image last to take whatever the others refuse
+class ImageDecoders
+{
+public:
+    ImageDecoders()
+    {
+#ifdef IMAGEDECODER_TURBOJPEG
+        mDecoders.emplace_back(new TurboJpegDecoder());
+#endif
+#ifdef IMAGEDECODER_SPNG
+        mDecoders.emplace_back(new SpngDecoder());
+#endif
+        mDecoders.emplace_back(new StbImageDecoder());
+    }
+
+    size_t Count() const { return mDecoders.size(); }
+    const ImageDecoder& operator[](size_t index) const { return *mDecoders[index]; }
+    const ImageDecoder& Fallback() const { return *mDecoders.back(); }
+
+    // First decoder whose probe accepts the data, or nullptr when none does
+    const ImageDecoder* Probe(const uint8_t* data, size_t size, ImageInfo& info, bool fallbackOnly = false) const
+    {
+        for (size_t i = fallbackOnly ? mDecoders.size() - 1 : 0; i < mDecoders.size(); ++i)
+        {
+            if (mDecoders[i]->Probe(data, size, info))
+                return mDecoders[i].get();
+        }
+        return nullptr;
+    }
+
+    // Probes, sizes pixels from the header and decodes into it. pixels keeps its capacity, so a caller
+    // decoding many images into one vector allocates only for the largest.
+    bool Decode(const uint8_t* data, size_t size, ImageInfo& info, std::vector<uint8_t>& pixels, bool fallbackOnly = false) const
+    {
+        const ImageDecoder* decoder = Probe(data, size, info, fallbackOnly);
+        if (!decoder)
+            return false;
+        pixels.resize(info.Bytes());
+        return decoder->Decode(data, size, info, pixels.data());
+    }
+
+private:
+    std::vector<std::unique_ptr<ImageDecoder>> mDecoders;
+};
+
+// The one set of decoders, created on first use
+inline const ImageDecoders& Decoders()
+{
+    static const ImageDecoders decoders;
+    return decoders;
+}
+
+#endif
@@ -0,0 +1,595 @@
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMAGEKERNELS_SSE 1
+#endif
+
+#if defined(IMAGEKERNELS_SSE) && (defined(__SSSE3__) || defined(__AVX__))
+#include <tmmintrin.h>
+#define IMAGEKERNELS_SSSE3 1
+#endif
+
+// Kernels for the texture pipeline on tightly packed 8-bit images of 1 to 4 channels, where 2 and 4
+// channel images carry alpha last. Each kernel has a plain version named ...Scalar; the SIMD version
+// produces the same bytes, handles what does not fill a register with the scalar code, and is what the
+// rest of the program calls.
+
+inline void FlipRowsScalar(uint8_t* image, int width, int height, int channels)
+{
+    const size_t rowBytes = (size_t)width * channels;
+    for (int y = 0; y < height / 2; ++y)
+    {
+        uint8_t* top = image + (size_t)y * rowBytes;
+        uint8_t* bottom = image + (size_t)(height - 1 - y) * rowBytes;
+        for (size_t i = 0; i < rowBytes; ++i)
+            std::swap(top[i], bottom[i]);
+    }
+}
+
+// Turns an image upside down, swapping rows 16 bytes at a time
+inline void FlipRows(uint8_t* image, int width, int height, int channels)
+{
+    const size_t rowBytes = (size_t)width * channels;
+    for (int y = 0; y < height / 2; ++y)
+    {
+        uint8_t* top = image + (size_t)y * rowBytes;
+        uint8_t* bottom = image + (size_t)(height - 1 - y) * rowBytes;
+        size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+        for (; i + 16 <= rowBytes; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i*)(top + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(bottom + i));
+            _mm_storeu_si128((__m128i*)(top + i), b);
+            _mm_storeu_si128((__m128i*)(bottom + i), a);
+        }
+#endif
+        for (; i < rowBytes; ++i)
+            std::swap(top[i], bottom[i]);
+    }
+}
+
+inline void ExpandRgbToRgbaScalar(const uint8_t* rgb, size_t count, uint8_t* rgba)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        rgba[i * 4] = rgb[i * 3];
+        rgba[i * 4 + 1] = rgb[i * 3 + 1];
+        rgba[i * 4 + 2] = rgb[i * 3 + 2];
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+// Adds an opaque alpha channel. With SSSE3 four texels are spread out by one byte shuffle; SSE2 assembles
+// them from four unaligned 32-bit loads. Either way a load reads past the texels it uses, so the last
+// few texels go through the scalar loop.
+inline void ExpandRgbToRgba(const uint8_t* rgb, size_t count, uint8_t* rgba)
+{
+    size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+#ifdef IMAGEKERNELS_SSSE3
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    for (; i + 6 <= count; i += 4)
+    {
+        const __m128i texels = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(rgb + i * 3)), spread);
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), _mm_or_si128(texels, alpha));
+    }
+#else
+    for (; i + 5 <= count; i += 4)
+    {
+        int32_t texels[4];
+        for (int k = 0; k < 4; ++k)
+            memcpy(&texels[k], rgb + (i + k) * 3, 4);
+        const __m128i packed = _mm_setr_epi32(texels[0], texels[1], texels[2], texels[3]);
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), _mm_or_si128(packed, alpha));
+    }
+#endif
+#endif
+    ExpandRgbToRgbaScalar(rgb + i * 3, count - i, rgba + i * 4);
+}
+
+inline bool IsGrayscaleScalar(const uint8_t* image, size_t count, int channels)
+{
+    if (channels < 3)
+        return true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint8_t* texel = image + i * channels;
+        if (texel[0] != texel[1] || texel[0] != texel[2])
+            return false;
+    }
+    return true;
+}
+
+// True when every texel has red, green and blue equal. RGBA texels are compared as 32-bit lanes against
+// themselves shifted by one and two bytes. RGB texels straddle registers, so the same 15 bytes (five
+// texels) are loaded at offsets 0, 1 and 2 and the comparisons at every third byte are checked.
+inline bool IsGrayscale(const uint8_t* image, size_t count, int channels)
+{
+    if (channels < 3)
+        return true;
+
+    size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+    if (channels == 4)
+    {
+        const __m128i low = _mm_set1_epi32(0xff);
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(image + i * 4));
+            const __m128i diff = _mm_or_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), _mm_xor_si128(v, _mm_srli_epi32(v, 16)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(diff, low), _mm_setzero_si128())) != 0xffff)
+                return false;
+        }
+    }
+    else
+    {
+        for (; i + 6 <= count; i += 5)
+        {
+            const uint8_t* bytes = image + i * 3;
+            const __m128i r = _mm_loadu_si128((const __m128i*)bytes);
+            const __m128i g = _mm_loadu_si128((const __m128i*)(bytes + 1));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(bytes + 2));
+            const int equal = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(r, g), _mm_cmpeq_epi8(r, b)));
+            if ((equal & 0x1249) != 0x1249)
+                return false;
+        }
+    }
+#endif
+    return IsGrayscaleScalar(image + i * channels, count - i, channels);
+}
+
+inline bool IsOpaqueScalar(const uint8_t* image, size_t count, int channels)
+{
+    if (channels != 2 && channels != 4)
+        return true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (image[i * channels + channels - 1] != 255)
+            return false;
+    }
+    return true;
+}
+
+// True when every alpha is 255. Color bytes are forced to 255 with a mask, so a register is all ones
+// exactly when its alphas are.
+inline bool IsOpaque(const uint8_t* image, size_t count, int channels)
+{
+    if (channels != 2 && channels != 4)
+        return true;
+
+    size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+    const __m128i colors = channels == 4 ? _mm_set1_epi32(0x00ffffff) : _mm_set1_epi16(0x00ff);
+    const __m128i ones = _mm_set1_epi8(-1);
+    const size_t texelsPerRegister = 16 / channels;
+    for (; i + texelsPerRegister <= count; i += texelsPerRegister)
+    {
+        const __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i*)(image + i * channels)), colors);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+            return false;
+    }
+#endif
+    return IsOpaqueScalar(image + i * channels, count - i, channels);
+}
+
+// Fewest channels that hold an image without loss: color becomes grey when every texel is grey, and
+// alpha is dropped when every texel is opaque
+inline int MinimalChannels(const uint8_t* image, size_t count, int channels)
+{
+    const bool alpha = (channels == 2 || channels == 4) && !IsOpaque(image, count, channels);
+    return (IsGrayscale(image, count, channels) ? 1 : 3) + (alpha ? 1 : 0);
+}
+
+// round(c * a / 255) without a division, exact for every 8-bit c and a
+inline uint8_t MultiplyAlpha(unsigned c, unsigned a)
+{
+    const unsigned t = c * a + 128;
+    return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+inline void PremultiplyAlphaScalar(uint8_t* rgba, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t* texel = rgba + i * 4;
+        for (int c = 0; c < 3; ++c)
+            texel[c] = MultiplyAlpha(texel[c], texel[3]);
+    }
+}
+
+// Multiplies the color of RGBA texels by their alpha, two texels per 16-bit register half. Alpha is
+// multiplied by 255, which leaves it as it was.
+inline void PremultiplyAlpha(uint8_t* rgba, size_t count)
+{
+    size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colorLanes = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i alphaLanes = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+    const __m128i half = _mm_set1_epi16(128);
+    auto premultiply = [&](__m128i texels)
+    {
+        __m128i alpha = _mm_shufflelo_epi16(texels, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm_or_si128(_mm_and_si128(alpha, colorLanes), alphaLanes);
+        const __m128i t = _mm_add_epi16(_mm_mullo_epi16(texels, alpha), half);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(rgba + i * 4));
+        const __m128i low = premultiply(_mm_unpacklo_epi8(v, zero));
+        const __m128i high = premultiply(_mm_unpackhi_epi8(v, zero));
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), _mm_packus_epi16(low, high));
+    }
+#endif
+    PremultiplyAlphaScalar(rgba + i * 4, count - i);
+}
+
+// sRGB transfer function and its inverse, on values from 0 to 1
+inline float SrgbToLinear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float LinearToSrgb(float c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Linear value of every 8-bit sRGB value
+inline const float* SrgbDecodeTable()
+{
+    static const std::vector<float> table = []()
+    {
+        std::vector<float> values(256);
+        for (int i = 0; i < 256; ++i)
+            values[i] = SrgbToLinear(i / 255.0f);
+        return values;
+    }();
+    return table.data();
+}
+
+// 8-bit sRGB value of linear values quantized to 12 bits, which is within one step of the exact encoding
+const int SRGB_ENCODE_TABLE_SIZE = 4096;
+inline const uint8_t* SrgbEncodeTable()
+{
+    static const std::vector<uint8_t> table = []()
+    {
+        std::vector<uint8_t> values(SRGB_ENCODE_TABLE_SIZE);
+        for (int i = 0; i < SRGB_ENCODE_TABLE_SIZE; ++i)
+            values[i] = (uint8_t)(LinearToSrgb(i / (float)(SRGB_ENCODE_TABLE_SIZE - 1)) * 255.0f + 0.5f);
+        return values;
+    }();
+    return table.data();
+}
+
+// Converts an 8-bit image to floats from 0 to 1, decoding color from sRGB when srgb is set. Alpha is
+// always linear. A table lookup per byte is already as fast as it gets, so this has no SIMD version.
+inline void DecodeImage(const uint8_t* image, size_t count, int channels, bool srgb, float* out)
+{
+    const float* decode = SrgbDecodeTable();
+    const int colors = channels >= 3 ? 3 : 1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            const uint8_t value = image[i * channels + c];
+            out[i * channels + c] = srgb && c < colors ? decode[value] : value / 255.0f;
+        }
+    }
+}
+
+// Encodes the values first to end of an image, the index of a value giving its channel
+inline void EncodeValues(const float* image, size_t first, size_t end, int channels, bool srgb, uint8_t* out)
+{
+    const uint8_t* encode = SrgbEncodeTable();
+    const int colors = channels >= 3 ? 3 : 1;
+    for (size_t i = first; i < end; ++i)
+    {
+        const float value = std::min(std::max(image[i], 0.0f), 1.0f);
+        out[i] = srgb && (int)(i % channels) < colors ? encode[(int)(value * (SRGB_ENCODE_TABLE_SIZE - 1) + 0.5f)] : (uint8_t)(int)(value * 255.0f + 0.5f);
+    }
+}
+
+inline void EncodeImageScalar(const float* image, size_t count, int channels, bool srgb, uint8_t* out)
+{
+    EncodeValues(image, 0, count * channels, channels, srgb, out);
+}
+
+// Inverse of DecodeImage. Four values are clamped and scaled to table indices (or to bytes) per register;
+// the table lookups that follow are scalar.
+inline void EncodeImage(const float* image, size_t count, int channels, bool srgb, uint8_t* out)
+{
+    size_t i = 0;
+#ifdef IMAGEKERNELS_SSE
+    if (channels == 4 || !srgb)
+    {
+        const uint8_t* encode = SrgbEncodeTable();
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+        // Table scale for color lanes and 255 for the alpha lane of RGBA
+        const __m128 scale = srgb ? _mm_setr_ps(SRGB_ENCODE_TABLE_SIZE - 1.0f, SRGB_ENCODE_TABLE_SIZE - 1.0f, SRGB_ENCODE_TABLE_SIZE - 1.0f, 255.0f) : _mm_set1_ps(255.0f);
+        for (; i + 4 <= count * channels; i += 4)
+        {
+            const __m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(image + i), zero), one);
+            int32_t index[4];
+            _mm_storeu_si128((__m128i*)index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, scale), half)));
+            if (srgb)
+            {
+                out[i] = encode[index[0]];
+                out[i + 1] = encode[index[1]];
+                out[i + 2] = encode[index[2]];
+                out[i + 3] = (uint8_t)index[3];
+            }
+            else
+            {
+                for (int k = 0; k < 4; ++k)
+                    out[i + k] = (uint8_t)index[k];
+            }
+        }
+    }
+#endif
+    EncodeValues(image, i, count * channels, channels, srgb, out);
+}
+
+// Filters of the 2:1 downsample. Box averages the two source texels under each destination texel. Kaiser
+// is a windowed sinc over eight, which keeps more detail and aliases less; three lobe Lanczos over twelve is
+// sharper still, at the price of some ringing at hard edges.
+enum ImageFilter
+{
+    FILTER_BOX,
+    FILTER_KAISER,
+    FILTER_LANCZOS
+};
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window
+inline float BesselI0(float x)
+{
+    float sum = 1.0f, term = 1.0f;
+    for (int k = 1; k < 16; ++k)
+    {
+        term *= (x / (2.0f * k)) * (x / (2.0f * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Weights of the source texels 2x-5 to 2x+6 that make destination texel x, normalized to sum to one. Taps
+// a filter does not reach get a weight of zero and are skipped.
+const int DOWNSAMPLE_TAPS = 12;
+inline void DownsampleWeights(ImageFilter filter, float weights[DOWNSAMPLE_TAPS])
+{
+    const float pi = 3.14159265f, kaiserRadius = 4.0f, alpha = 4.0f, lobes = 3.0f;
+    float sum = 0.0f;
+    for (int tap = 0; tap < DOWNSAMPLE_TAPS; ++tap)
+    {
+        // Distance of the tap from the destination texel's center, in source texels
+        const float distance = tap - (DOWNSAMPLE_TAPS / 2.0f - 0.5f);
+        const float x = distance * 0.5f * pi;   // Cutoff at half the source frequency
+        const float sinc = std::sin(x) / x;
+        if (filter == FILTER_BOX)
+            weights[tap] = std::fabs(distance) < 1.0f ? 1.0f : 0.0f;
+        else if (filter == FILTER_KAISER)
+        {
+            const float ratio = distance / kaiserRadius;
+            weights[tap] = ratio * ratio < 1.0f ? sinc * BesselI0(alpha * std::sqrt(1.0f - ratio * ratio)) / BesselI0(alpha) : 0.0f;
+        }
+        else
+            weights[tap] = std::fabs(x) < lobes * pi ? sinc * std::sin(x / lobes) / (x / lobes) : 0.0f;
+        sum += weights[tap];
+    }
+    for (int tap = 0; tap < DOWNSAMPLE_TAPS; ++tap)
+        weights[tap] /= sum;
+}
+
+// Halves one axis of a float image, lineCount lines of length texels becoming lines of max(length / 2, 1),
+// of which the texels first to end are written. Texels and lines are addressed through strides, so the same
+// code filters rows and columns, and a tile of the destination is a range of lines and texels.
+inline void DownsampleAxisScalar(const float* src, int length, int lineCount, size_t texelStride, size_t lineStride, int channels,
+    const float weights[DOWNSAMPLE_TAPS], float* dst, size_t dstTexelStride, size_t dstLineStride, int first, int end)
+{
+    for (int line = 0; line < lineCount; ++line)
+    {
+        for (int x = first; x < end; ++x)
+        {
+            float* out = dst + line * dstLineStride + x * dstTexelStride;
+            for (int c = 0; c < channels; ++c)
+                out[c] = 0.0f;
+            for (int tap = 0; tap < DOWNSAMPLE_TAPS; ++tap)
+            {
+                if (weights[tap] == 0.0f)
+                    continue;
+                const int source = std::min(std::max(x * 2 - DOWNSAMPLE_TAPS / 2 + 1 + tap, 0), length - 1);
+                const float* texel = src + line * lineStride + source * texelStride;
+                for (int c = 0; c < channels; ++c)
+                    out[c] += texel[c] * weights[tap];
+            }
+        }
+    }
+}
+
+#ifdef IMAGEKERNELS_SSE
+// DownsampleAxis with a texel to a register. Three channel texels are moved as a pair and a single, which
+// keeps the fourth lane zero and touches nothing past the last texel.
+template <int Channels>
+inline void DownsampleAxisSse(const float* src, int length, int lineCount, size_t texelStride, size_t lineStride,
+    const float weights[DOWNSAMPLE_TAPS], float* dst, size_t dstTexelStride, size_t dstLineStride, int first, int end)
+{
+    for (int line = 0; line < lineCount; ++line)
+    {
+        for (int x = first; x < end; ++x)
+        {
+            __m128 sum = _mm_setzero_ps();
+            for (int tap = 0; tap < DOWNSAMPLE_TAPS; ++tap)
+            {
+                if (weights[tap] == 0.0f)
+                    continue;
+                const int source = std::min(std::max(x * 2 - DOWNSAMPLE_TAPS / 2 + 1 + tap, 0), length - 1);
+                const float* texel = src + line * lineStride + source * texelStride;
+                const __m128 value = Channels == 4 ? _mm_loadu_ps(texel)
+                    : _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)texel), _mm_load_ss(texel + 2));
+                sum = _mm_add_ps(sum, _mm_mul_ps(value, _mm_set1_ps(weights[tap])));
+            }
+
+            float* out = dst + line * dstLineStride + x * dstTexelStride;
+            if (Channels == 4)
+                _mm_storeu_ps(out, sum);
+            else
+            {
+                _mm_storel_pi((__m64*)out, sum);
+                _mm_store_ss(out + 2, _mm_movehl_ps(sum, sum));
+            }
+        }
+    }
+}
+#endif
+
+// Filters RGB and RGBA a texel per register, with each lane doing the same sums as the scalar code
+inline void DownsampleAxis(const float* src, int length, int lineCount, size_t texelStride, size_t lineStride, int channels,
+    const float weights[DOWNSAMPLE_TAPS], float* dst, size_t dstTexelStride, size_t dstLineStride, int first, int end)
+{
+#ifdef IMAGEKERNELS_SSE
+    if (channels == 4)
+        return DownsampleAxisSse<4>(src, length, lineCount, texelStride, lineStride, weights, dst, dstTexelStride, dstLineStride, first, end);
+    if (channels == 3)
+        return DownsampleAxisSse<3>(src, length, lineCount, texelStride, lineStride, weights, dst, dstTexelStride, dstLineStride, first, end);
+#endif
+    DownsampleAxisScalar(src, length, lineCount, texelStride, lineStride, channels, weights, dst, dstTexelStride, dstLineStride, first, end);
+}
+
+// Halves a float image in both directions, max(width / 2, 1) by max(height / 2, 1), filtering rows and
+// then columns. Texels past the edges repeat the edge.
+template <bool Simd = true>
+inline void DownsampleImage(const float* src, int width, int height, int channels, ImageFilter filter, float* dst)
+{
+    float weights[DOWNSAMPLE_TAPS];
+    DownsampleWeights(filter, weights);
+    const int newWidth = std::max(width / 2, 1), newHeight = std::max(height / 2, 1);
+    auto axis = Simd ? DownsampleAxis : DownsampleAxisScalar;
+
+    std::vector<float> rows((size_t)newWidth * height * channels);
+    if (width > 1)
+        axis(src, width, height, channels, (size_t)width * channels, channels, weights, rows.data(), channels, (size_t)newWidth * channels, 0, newWidth);
+    else
+        rows.assign(src, src + (size_t)height * channels);
+
+    if (height > 1)
+        axis(rows.data(), height, newWidth, (size_t)newWidth * channels, channels, channels, weights, dst, (size_t)newWidth * channels, channels, 0, newHeight);
+    else
+        std::copy(rows.begin(), rows.end(), dst);
+}
+
+inline void DownsampleBoxScalar(const uint8_t* src, int width, int height, int channels, uint8_t* dst)
+{
+    const int newWidth = std::max(width / 2, 1), newHeight = std::max(height / 2, 1);
+    for (int y = 0; y < newHeight; ++y)
+    {
+        const int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+        for (int x = 0; x < newWidth; ++x)
+        {
+            const int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+            for (int c = 0; c < channels; ++c)
+            {
+                const unsigned sum = src[((size_t)y0 * width + x0) * channels + c] + src[((size_t)y0 * width + x1) * channels + c]
+                    + src[((size_t)y1 * width + x0) * channels + c] + src[((size_t)y1 * width + x1) * channels + c];
+                dst[((size_t)y * newWidth + x) * channels + c] = (uint8_t)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// 2x2 box downsample of an 8-bit image with the average rounded to nearest; the last row or column of an
+// odd sized image is reused for its missing neighbor. Grey and RGBA rows are summed in 16-bit lanes, four
+// RGBA or sixteen grey destination texels per register; other channel counts stay scalar.
+inline void DownsampleBox(const uint8_t* src, int width, int height, int channels, uint8_t* dst)
+{
+#ifdef IMAGEKERNELS_SSE
+    if ((channels == 1 || channels == 4) && width >= 2)
+    {
+        const int newWidth = width / 2, newHeight = std::max(height / 2, 1);
+        const int texelsPerStep = channels == 4 ? 4 : 16;
+        const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2), lowBytes = _mm_set1_epi16(0xff);
+        for (int y = 0; y < newHeight; ++y)
+        {
+            const uint8_t* row0 = src + (size_t)std::min(y * 2, height - 1) * width * channels;
+            const uint8_t* row1 = src + (size_t)std::min(y * 2 + 1, height - 1) * width * channels;
+            uint8_t* out = dst + (size_t)y * newWidth * channels;
+            int x = 0;
+            for (; x + texelsPerStep <= newWidth; x += texelsPerStep)
+            {
+                const size_t offset = (size_t)x * 2 * channels;
+                const __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + offset)), b0 = _mm_loadu_si128((const __m128i*)(row0 + offset + 16));
+                const __m128i a1 = _mm_loadu_si128((const __m128i*)(row1 + offset)), b1 = _mm_loadu_si128((const __m128i*)(row1 + offset + 16));
+                __m128i low, high;
+                if (channels == 4)
+                {
+                    // Vertical sums of two texels per register, then each texel plus its right neighbor
+                    auto pairs = [&](__m128i top, __m128i bottom)
+                    {
+                        const __m128i first = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+                        const __m128i second = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+                        return _mm_unpacklo_epi64(_mm_add_epi16(first, _mm_srli_si128(first, 8)), _mm_add_epi16(second, _mm_srli_si128(second, 8)));
+                    };
+                    low = pairs(a0, a1);
+                    high = pairs(b0, b1);
+                }
+                else
+                {
+                    // Even plus odd bytes of both rows
+                    auto pairs = [&](__m128i top, __m128i bottom)
+                    {
+                        return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(top, lowBytes), _mm_srli_epi16(top, 8)),
+                            _mm_add_epi16(_mm_and_si128(bottom, lowBytes), _mm_srli_epi16(bottom, 8)));
+                    };
+                    low = pairs(a0, a1);
+                    high = pairs(b0, b1);
+                }
+                low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+                high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+                _mm_storeu_si128((__m128i*)(out + (size_t)x * channels), _mm_packus_epi16(low, high));
+            }
+
+            // The rest of the row
+            for (; x < newWidth; ++x)
+            {
+                for (int c = 0; c < channels; ++c)
+                {
+                    const unsigned sum = row0[(x * 2) * channels + c] + row0[(x * 2 + 1) * channels + c]
+                        + row1[(x * 2) * channels + c] + row1[(x * 2 + 1) * channels + c];
+                    out[x * channels + c] = (uint8_t)((sum + 2) / 4);
+                }
+            }
+        }
+        return;
+    }
+#endif
+    DownsampleBoxScalar(src, width, height, channels, dst);
+}
+
+// Kaiser filtered 2:1 downsample of an 8-bit image, through floats. Color is filtered in linear space when
+// srgb is set, so the average of dark and bright texels is not darkened.
+template <bool Simd = true>
+inline void DownsampleKaiser(const uint8_t* src, int width, int height, int channels, bool srgb, uint8_t* dst)
+{
+    const int newWidth = std::max(width / 2, 1), newHeight = std::max(height / 2, 1);
+    std::vector<float> decoded((size_t)width * height * channels), filtered((size_t)newWidth * newHeight * channels);
+    DecodeImage(src, (size_t)width * height, channels, srgb, decoded.data());
+    DownsampleImage<Simd>(decoded.data(), width, height, channels, FILTER_KAISER, filtered.data());
+    if (Simd)
+        EncodeImage(filtered.data(), (size_t)newWidth * newHeight, channels, srgb, dst);
+    else
+        EncodeImageScalar(filtered.data(), (size_t)newWidth * newHeight, channels, srgb, dst);
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef INPUTRECORDING_H
+#define INPUTRECORDING_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "openfile.h"
+
+// Kinds of record in an input log
+enum InputRecordType : uint8_t
+{
+    INPUT_FRAME,    // Start of a frame, with the step the camera moved by
+    INPUT_KEY,
+    INPUT_CURSOR,
+    INPUT_SCROLL,
+};
+
+// One record of an input log. Events hold what the window system reported, and are logged in the frame
+// that polled them, so a replay hands them out at the same point of the same frame.
+struct InputRecord
+{
+    InputRecordType type = INPUT_FRAME;
+    double time = 0.0;          // Seconds since the program started
+    float deltaTime = 0.0f;     // INPUT_FRAME
+    int32_t key = 0;            // INPUT_KEY, a GLFW key code
+    int32_t action = 0;         // INPUT_KEY, GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+    double x = 0.0, y = 0.0;    // INPUT_CURSOR position, INPUT_SCROLL offsets
+
+    static InputRecord Frame(double time, float deltaTime)
+    {
+        InputRecord record;
+        record.time = time;
+        record.deltaTime = deltaTime;
+        return record;
+    }
+
+    static InputRecord Key(double time, int key, int action)
+    {
+        InputRecord record;
+        record.type = INPUT_KEY;
+        record.time = time;
+        record.key = key;
+        record.action = action;
+        return record;
+    }
+
+    static InputRecord Position(InputRecordType type, double time, double x, double y)
+    {
+        InputRecord record;
+        record.type = type;
+        record.time = time;
+        record.x = x;
+        record.y = y;
+        return record;
+    }
+};
+
+// Input logs start with this and a version, followed by records: the type byte, the time, then the
+// fields of that type. Values are stored in the byte order of the machine that recorded them.
+const char INPUT_LOG_MAGIC[4] = { 'G', 'V', 'I', 'N' };
+const uint32_t INPUT_LOG_VERSION = 1;
+
+// Appends records to an input log as they happen
+class InputRecorder
+{
+public:
+    ~InputRecorder() { Close(); }
+
+    bool Open(const char* path)
+    {
+        Close();
+        mFile = OpenFile(path, "wb");
+        if (!mFile)
+            return false;
+        fwrite(INPUT_LOG_MAGIC, 1, sizeof(INPUT_LOG_MAGIC), mFile);
+        Put(INPUT_LOG_VERSION);
+        return true;
+    }
+
+    // False when a write failed
+    bool Close()
+    {
+        if (!mFile)
+            return true;
+        const bool written = !ferror(mFile);
+        fclose(mFile);
+        mFile = nullptr;
+        return written;
+    }
+
+    bool IsOpen() const { return mFile != nullptr; }
+    size_t FrameCount() const { return mFrames; }
+    size_t EventCount() const { return mEvents; }
+
+    void Write(const InputRecord& record)
+    {
+        if (!mFile)
+            return;
+
+        Put((uint8_t)record.type);
+        Put(record.time);
+        switch (record.type)
+        {
+        case INPUT_FRAME: Put(record.deltaTime); break;
+        case INPUT_KEY: Put(record.key); Put(record.action); break;
+        case INPUT_CURSOR:
+        case INPUT_SCROLL: Put(record.x); Put(record.y); break;
+        }
+        ++(record.type == INPUT_FRAME ? mFrames : mEvents);
+    }
+
+private:
+    template <typename T>
+    void Put(const T& value) { fwrite(&value, sizeof(T), 1, mFile); }
+
+    FILE* mFile = nullptr;
+    size_t mFrames = 0, mEvents = 0;
+};
+
+// Plays an input log back a frame at a time: BeginFrame consumes the frame's record, and DispatchEvents
+// then hands out the events recorded during that frame
+class InputReplay
+{
+public:
+    bool Load(const char* path)
+    {
+        mRecords.clear();
+        mNext = 0;
+        mFrames = 0;
+
+        FILE* file = OpenFile(path, "rb");
+        if (!file)
+            return false;
+        std::vector<uint8_t> data;
+        uint8_t chunk[65536];
+        for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+            data.insert(data.end(), chunk, chunk + read);
+        fclose(file);
+
+        size_t offset = 0;
+        auto get = [&](void* value, size_t size)
+        {
+            if (offset + size > data.size())
+                return false;
+            memcpy(value, data.data() + offset, size);
+            offset += size;
+            return true;
+        };
+
+        char magic[sizeof(INPUT_LOG_MAGIC)];
+        uint32_t version;
+        if (!get(magic, sizeof(magic)) || memcmp(magic, INPUT_LOG_MAGIC, sizeof(magic)) != 0 || !get(&version, sizeof(version)) || version != INPUT_LOG_VERSION)
+            return false;
+
+        while (offset < data.size())
+        {
+            InputRecord record;
+            uint8_t type;
+            bool complete = get(&type, sizeof(type)) && get(&record.time, sizeof(record.time));
+            record.type = (InputRecordType)type;
+            switch (type)
+            {
+            case INPUT_FRAME: complete = complete && get(&record.deltaTime, sizeof(record.deltaTime)); break;
+            case INPUT_KEY: complete = complete && get(&record.key, sizeof(record.key)) && get(&record.action, sizeof(record.action)); break;
+            case INPUT_CURSOR:
+            case INPUT_SCROLL: complete = complete && get(&record.x, sizeof(record.x)) && get(&record.y, sizeof(record.y)); break;
+            default: complete = false; break;
+            }
+            if (!complete)
+                return false;
+
+            mFrames += record.type == INPUT_FRAME ? 1 : 0;
+            mRecords.push_back(record);
+        }
+        return true;
+    }
+
+    bool IsLoaded() const { return !mRecords.empty(); }
+    size_t FrameCount() const { return mFrames; }
+    size_t EventCount() const { return mRecords.size() - mFrames; }
+
+    // True once every recorded frame was played
+    bool Finished() const
+    {
+        for (size_t i = mNext; i < mRecords.size(); ++i)
+        {
+            if (mRecords[i].type == INPUT_FRAME)
+                return false;
+        }
+        return true;
+    }
+
+    // Moves to the next frame, giving the step it was recorded with. Events left over from the previous
+    // frame are skipped.
+    bool BeginFrame(float& recordedDeltaTime)
+    {
+        while (mNext < mRecords.size() && mRecords[mNext].type != INPUT_FRAME)
+            ++mNext;
+        if (mNext == mRecords.size())
+            return false;
+        recordedDeltaTime = mRecords[mNext++].deltaTime;
+        return true;
+    }
+
+    // Calls handle(record) for every event of the current frame, in the order they were recorded
+    template <typename Handler>
+    void DispatchEvents(const Handler& handle)
+    {
+        for (; mNext < mRecords.size() && mRecords[mNext].type != INPUT_FRAME; ++mNext)
+            handle(mRecords[mNext]);
+    }
+
+private:
+    std::vector<InputRecord> mRecords;
+    size_t mNext = 0;
+    size_t mFrames = 0;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file through the operating system's page cache. Nothing is read until the
+// pages are touched, and the view stays valid until the object is destroyed.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const char* path)
+    {
+        Close();
+#ifdef _WIN32
+        mFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (mFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+
+        mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mMapping)
+            mData = (const unsigned char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+        mSize = (size_t)size.QuadPart;
+#else
+        mFile = open(path, O_RDONLY);
+        if (mFile < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(mFile, &info) != 0 || info.st_size == 0)
+        {
+            Close();
+            return false;
+        }
+
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, mFile, 0);
+        mData = data != MAP_FAILED ? (const unsigned char*)data : nullptr;
+        mSize = (size_t)info.st_size;
+#endif
+        if (!mData)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (mData)
+            UnmapViewOfFile(mData);
+        if (mMapping)
+            CloseHandle(mMapping);
+        if (mFile != INVALID_HANDLE_VALUE)
+            CloseHandle(mFile);
+        mMapping = nullptr;
+        mFile = INVALID_HANDLE_VALUE;
+#else
+        if (mData)
+            munmap((void*)mData, mSize);
+        if (mFile >= 0)
+            close(mFile);
+        mFile = -1;
+#endif
+        mData = nullptr;
+        mSize = 0;
+    }
+
+    const unsigned char* Data() const { return mData; }
+    size_t Size() const { return mSize; }
+
+private:
+#ifdef _WIN32
+    HANDLE mFile = INVALID_HANDLE_VALUE;
+    HANDLE mMapping = nullptr;
+#else
+    int mFile = -1;
+#endif
+    const unsigned char* mData = nullptr;
+    size_t mSize = 0;
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef MESHPROCESSING_H
+#define MESHPROCESSING_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// An indexed triangle list with interleaved vertices of floatsPerVertex floats each
+struct IndexedMesh
+{
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    unsigned floatsPerVertex = 0;
+
+    size_t VertexCount() const { return floatsPerVertex ? vertices.size() / floatsPerVertex : 0; }
+};
+
+// Turns a triangle soup into an indexed mesh, merging vertices whose attributes are bit-for-bit identical
+inline IndexedMesh WeldVertices(const float* soup, size_t vertexCount, unsigned floatsPerVertex)
+{
+    IndexedMesh mesh;
+    mesh.floatsPerVertex = floatsPerVertex;
+    mesh.indices.reserve(vertexCount);
+
+    // Hash the raw bytes of each vertex (FNV-1a) and resolve collisions by comparing them
+    std::unordered_multimap<uint64_t, uint32_t> lookup;
+    lookup.reserve(vertexCount);
+    const size_t vertexBytes = floatsPerVertex * sizeof(float);
+
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        const float* vertex = soup + v * floatsPerVertex;
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(vertex);
+
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t b = 0; b < vertexBytes; ++b)
+            hash = (hash ^ bytes[b]) * 1099511628211ull;
+
+        uint32_t index = UINT32_MAX;
+        auto range = lookup.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (std::memcmp(&mesh.vertices[it->second * floatsPerVertex], vertex, vertexBytes) == 0)
+            {
+                index = it->second;
+                break;
+            }
+        }
+
+        if (index == UINT32_MAX)
+        {
+            index = (uint32_t)mesh.VertexCount();
+            mesh.vertices.insert(mesh.vertices.end(), vertex, vertex + floatsPerVertex);
+            lookup.emplace(hash, index);
+        }
+        mesh.indices.push_back(index);
+    }
+
+    return mesh;
+}
+
+// Average cache miss ratio: vertex shader invocations per triangle for a FIFO post-transform cache.
+// 3.0 is an unindexed soup, 0.5 is the ideal for large regular meshes.
+inline float ComputeACMR(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize = 16)
+{
+    if (indices.size() < 3)
+        return 0.0f;
+
+    // A vertex is still cached if fewer than cacheSize misses happened since it was last loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    size_t misses = 0;
+    for (uint32_t index : indices)
+    {
+        if (loadedAt[index] == 0 || misses - loadedAt[index] >= cacheSize)
+        {
+            ++misses;
+            loadedAt[index] = misses;
+        }
+    }
+
+    return (float)misses / (float)(indices.size() / 3);
+}
+
+// Reorders triangles for the post-transform vertex cache with Tipsify (Sander, Nehab and Barczak 2007).
+// Triangles are emitted as fans around a vertex, and the next fanning vertex is the one still in the
+// cache with the most remaining work. cacheSize should match the hardware cache being targeted.
+inline void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize = 16)
+{
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    // Vertex -> triangle adjacency in compressed form
+    std::vector<uint32_t> liveTriangles(vertexCount, 0);
+    for (uint32_t index : indices)
+        ++liveTriangles[index];
+
+    std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v)
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + liveTriangles[v];
+
+    std::vector<uint32_t> adjacency(indices.size());
+    std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (size_t t = 0; t < triangleCount; ++t)
+        for (int corner = 0; corner < 3; ++corner)
+            adjacency[fill[indices[t * 3 + corner]]++] = (uint32_t)t;
+
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnds;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> output;
+    output.reserve(indices.size());
+
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0;
+    int64_t fanVertex = 0;
+
+    while (fanVertex >= 0)
+    {
+        candidates.clear();
+
+        // Emit every remaining triangle around the fanning vertex
+        for (uint32_t a = adjacencyOffset[fanVertex]; a < adjacencyOffset[fanVertex + 1]; ++a)
+        {
+            const uint32_t t = adjacency[a];
+            if (emitted[t])
+                continue;
+
+            for (int corner = 0; corner < 3; ++corner)
+            {
+                const uint32_t v = indices[t * 3 + corner];
+                output.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                --liveTriangles[v];
+
+                if (time - cacheTime[v] > cacheSize)
+                {
+                    cacheTime[v] = time;
+                    ++time;
+                }
+            }
+            emitted[t] = true;
+        }
+
+        // Prefer a candidate that will still be in the cache once its remaining triangles are emitted,
+        // and among those the one that entered the cache first
+        fanVertex = -1;
+        int64_t bestPriority = -1;
+        for (uint32_t v : candidates)
+        {
+            if (liveTriangles[v] == 0)
+                continue;
+
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * liveTriangles[v] <= cacheSize)
+                priority = time - cacheTime[v];
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                fanVertex = v;
+            }
+        }
+
+        // Dead end: back up to a recently used vertex with triangles left, or scan forward for any
+        if (fanVertex < 0)
+        {
+            while (!deadEnds.empty())
+            {
+                const uint32_t v = deadEnds.back();
+                deadEnds.pop_back();
+                if (liveTriangles[v] > 0)
+                {
+                    fanVertex = v;
+                    break;
+                }
+            }
+        }
+        while (fanVertex < 0 && cursor < vertexCount)
+        {
+            if (liveTriangles[cursor] > 0)
+                fanVertex = (int64_t)cursor;
+            ++cursor;
+        }
+    }
+
+    indices.swap(output);
+}
+
+// Renumbers vertices in the order the index buffer first references them, so vertex fetches walk the
+// buffer mostly forward. Unreferenced vertices are dropped.
+inline void OptimizeVertexFetch(IndexedMesh& mesh)
+{
+    const size_t vertexCount = mesh.VertexCount();
+    std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+    std::vector<float> vertices;
+    vertices.reserve(mesh.vertices.size());
+
+    uint32_t next = 0;
+    for (uint32_t& index : mesh.indices)
+    {
+        if (remap[index] == UINT32_MAX)
+        {
+            remap[index] = next++;
+            const float* vertex = &mesh.vertices[index * mesh.floatsPerVertex];
+            vertices.insert(vertices.end(), vertex, vertex + mesh.floatsPerVertex);
+        }
+        index = remap[index];
+    }
+
+    mesh.vertices.swap(vertices);
+}
+
+// Quantized vertex, 16 bytes instead of 32: position as UNORM16 relative to the mesh bounds, normal as
+// signed normalized GL_INT_2_10_10_10_REV and texture coordinate as UNORM16 relative to the mesh's UV range
+struct CompactVertex
+{
+    uint16_t position[4];   // xyz, w unused (keeps the normal 4-byte aligned)
+    uint32_t normal;
+    uint16_t uv[2];
+};
+
+// How to turn normalized compact attributes back into mesh space: value = offset + normalized * scale
+struct QuantizationInfo
+{
+    float positionOffset[3];
+    float positionScale[3];
+    float uvOffset[2];
+    float uvScale[2];
+};
+
+// Largest difference between the source vertices and their decoded compact versions
+struct QuantizationError
+{
+    float position;         // Mesh space units
+    float normalDegrees;    // Angle between source and decoded normal directions
+    float uv;               // Texture coordinate units
+};
+
+// Vertices are expected as 3 position, 3 normal and 2 texture coordinate floats
+inline void QuantizeVertices(const IndexedMesh& mesh, std::vector<CompactVertex>& compact, QuantizationInfo& info)
+{
+    const size_t vertexCount = mesh.VertexCount();
+    const unsigned stride = mesh.floatsPerVertex;
+    compact.resize(vertexCount);
+
+    // Bounds of the positions and texture coordinates
+    float lower[5], upper[5];
+    const unsigned channels[5] = { 0, 1, 2, 6, 7 };
+    for (int c = 0; c < 5; ++c)
+    {
+        lower[c] = upper[c] = vertexCount ? mesh.vertices[channels[c]] : 0.0f;
+        for (size_t v = 1; v < vertexCount; ++v)
+        {
+            const float value = mesh.vertices[v * stride + channels[c]];
+            lower[c] = value < lower[c] ? value : lower[c];
+            upper[c] = value > upper[c] ? value : upper[c];
+        }
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        info.positionOffset[c] = lower[c];
+        info.positionScale[c] = upper[c] - lower[c];
+    }
+    for (int c = 0; c < 2; ++c)
+    {
+        info.uvOffset[c] = lower[3 + c];
+        info.uvScale[c] = upper[3 + c] - lower[3 + c];
+    }
+
+    // A flat axis has a scale of zero and decodes to its offset whatever is stored
+    auto unorm16 = [](float value, float offset, float scale) -> uint16_t
+    {
+        if (scale <= 0.0f)
+            return 0;
+        float normalized = (value - offset) / scale;
+        normalized = normalized < 0.0f ? 0.0f : (normalized > 1.0f ? 1.0f : normalized);
+        return (uint16_t)std::lround(normalized * 65535.0f);
+    };
+    auto snorm10 = [](float value) -> uint32_t
+    {
+        value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+        return (uint32_t)((int32_t)std::lround(value * 511.0f)) & 0x3ffu;
+    };
+
+    for (size_t v = 0; v < vertexCount; ++v)
+    {
+        const float* source = &mesh.vertices[v * stride];
+        CompactVertex& out = compact[v];
+
+        for (int c = 0; c < 3; ++c)
+            out.position[c] = unorm16(source[c], info.positionOffset[c], info.positionScale[c]);
+        out.position[3] = 0;
+
+        // Only the direction of a normal matters to the shader, so pack it normalized
+        float length = std::sqrt(source[3] * source[3] + source[4] * source[4] + source[5] * source[5]);
+        float inverse = length > 0.0f ? 1.0f / length : 0.0f;
+        out.normal = snorm10(source[3] * inverse) | (snorm10(source[4] * inverse) << 10) | (snorm10(source[5] * inverse) << 20);
+
+        for (int c = 0; c < 2; ++c)
+            out.uv[c] = unorm16(source[6 + c], info.uvOffset[c], info.uvScale[c]);
+    }
+}
+
+// Decodes every compact vertex the way the GL would and compares it with the float source
+inline QuantizationError MeasureQuantizationError(const IndexedMesh& mesh, const std::vector<CompactVertex>& compact, const QuantizationInfo& info)
+{
+    QuantizationError error = { 0.0f, 0.0f, 0.0f };
+    const unsigned stride = mesh.floatsPerVertex;
+    const float radiansToDegrees = 57.2957795f;
+
+    auto decodeSnorm10 = [](uint32_t bits) -> float
+    {
+        int32_t value = (int32_t)(bits << 22) >> 22; // Sign extend the 10-bit field
+        float normalized = value / 511.0f;
+        return normalized < -1.0f ? -1.0f : normalized;
+    };
+
+    for (size_t v = 0; v < compact.size(); ++v)
+    {
+        const float* source = &mesh.vertices[v * stride];
+        const CompactVertex& packed = compact[v];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float decoded = info.positionOffset[c] + packed.position[c] / 65535.0f * info.positionScale[c];
+            error.position = std::fmax(error.position, std::fabs(decoded - source[c]));
+        }
+
+        float n[3] = { decodeSnorm10(packed.normal), decodeSnorm10(packed.normal >> 10), decodeSnorm10(packed.normal >> 20) };
+        float sourceLength = std::sqrt(source[3] * source[3] + source[4] * source[4] + source[5] * source[5]);
+        float decodedLength = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (sourceLength > 0.0f && decodedLength > 0.0f)
+        {
+            float cosine = (n[0] * source[3] + n[1] * source[4] + n[2] * source[5]) / (sourceLength * decodedLength);
+            cosine = cosine > 1.0f ? 1.0f : (cosine < -1.0f ? -1.0f : cosine);
+            error.normalDegrees = std::fmax(error.normalDegrees, std::acos(cosine) * radiansToDegrees);
+        }
+
+        for (int c = 0; c < 2; ++c)
+        {
+            float decoded = info.uvOffset[c] + packed.uv[c] / 65535.0f * info.uvScale[c];
+            error.uv = std::fmax(error.uv, std::fabs(decoded - source[6 + c]));
+        }
+    }
+
+    return error;
+}
+
+#endif
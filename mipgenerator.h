@@ -0,0 +1,232 @@
+#ifndef MIPGENERATOR_H
+#define MIPGENERATOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "imagekernels.h"
+#include "texturecache.h"
+#include "threadpool.h"
+
+// How GenerateMipChain filters
+struct MipSettings
+{
+    ImageFilter filter = FILTER_KAISER;
+    bool srgb = false;          // Color is sRGB encoded and filtered in linear space, so averages do not darken
+    float alphaCutoff = 0.0f;   // When non zero, alpha of each level is scaled so as many texels reach this as in level 0
+    unsigned threadCount = 1;
+    ThreadPool* pool = nullptr; // Where threads beyond the calling one come from; without it only the caller works
+};
+
+// Edge of the square tiles a level is split into between threads
+const int MIP_TILE_SIZE = 64;
+
+// State ForEachTile shares with its helper jobs, which may outlive the call when the pool is busy
+struct TileWork
+{
+    std::atomic<int> next{ 0 };
+    std::mutex mutex;
+    std::condition_variable idle;
+    int running = 0;        // Helpers taking tiles, guarded by mutex
+    bool closed = false;    // Set once the caller ran out of tiles, guarded by mutex
+};
+
+// Calls tile(index) for every index below count, on up to threadCount threads: the calling one and helper
+// jobs on pool. Tiles are handed out one at a time, so threads that get cheap tiles take more of them. A
+// helper that only starts once the caller ran out of tiles returns without taking any, so the caller never
+// waits for jobs queued behind other work, and a single tile runs on the calling thread alone.
+template <typename Function>
+inline void ForEachTile(int count, unsigned threadCount, ThreadPool* pool, const Function& tile)
+{
+    std::shared_ptr<TileWork> shared = std::make_shared<TileWork>();
+    auto work = [shared, count, &tile]()
+    {
+        for (int index = shared->next++; index < count; index = shared->next++)
+            tile(index);
+    };
+
+    threadCount = std::max(1u, std::min(threadCount, (unsigned)std::max(count, 1)));
+    const unsigned helpers = pool ? std::min(threadCount - 1, pool->Size()) : 0;
+    for (unsigned helper = 0; helper < helpers; ++helper)
+    {
+        pool->Submit([shared, work]()
+        {
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (shared->closed)
+                    return;
+                ++shared->running;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            if (--shared->running == 0)
+                shared->idle.notify_all();
+        });
+    }
+
+    work();
+    if (helpers == 0)
+        return;
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->closed = true;
+    shared->idle.wait(lock, [&]() { return shared->running == 0; });
+}
+
+// Share of texels of a float image whose alpha reaches cutoff
+inline float AlphaCoverage(const float* image, size_t count, int channels, float cutoff)
+{
+    size_t covered = 0;
+    for (size_t i = 0; i < count; ++i)
+        covered += image[i * channels + channels - 1] >= cutoff ? 1 : 0;
+    return count > 0 ? (float)covered / count : 0.0f;
+}
+
+// Factor for the alpha of a level that gives it the coverage target at cutoff. The covered texels are the
+// ones with the largest alpha, so the alpha they start at is a quantile, found by partial sorting.
+inline float CoverageScale(const float* image, size_t count, int channels, float cutoff, float target)
+{
+    const size_t covered = (size_t)(target * count + 0.5f);
+    if (covered == 0 || count == 0)
+        return 1.0f;
+
+    std::vector<float> alphas(count);
+    for (size_t i = 0; i < count; ++i)
+        alphas[i] = image[i * channels + channels - 1];
+    std::nth_element(alphas.begin(), alphas.begin() + (covered - 1), alphas.end(), [](float a, float b) { return a > b; });
+    const float threshold = alphas[covered - 1];
+    return threshold > 0.0f ? cutoff / threshold : 1.0f;
+}
+
+// Appends the full mip chain of an 8-bit image to payload, level 0 first, like BuildMipChain but with the
+// filter, color space and alpha coverage of settings. Each level is filtered from the one above in float,
+// so rounding does not add up down the chain, and only the copy appended to payload is 8-bit. Levels
+// follow one another, but each is cut into tiles that the threads share: a pass of rows, a pass of columns
+// and the conversion back to bytes. When levelMs is given, it receives the milliseconds each level took.
+inline void GenerateMipChain(const uint8_t* image, int width, int height, int channels, const MipSettings& settings,
+    std::vector<uint8_t>& payload, std::vector<TextureLevel>& levels, std::vector<double>* levelMs = nullptr)
+{
+    typedef std::chrono::steady_clock Clock;
+    auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    auto tileCount = [](int length) { return (length + MIP_TILE_SIZE - 1) / MIP_TILE_SIZE; };
+
+    Clock::time_point start = Clock::now();
+    TextureLevel level = { payload.size(), (uint64_t)width * height * channels, (uint32_t)width, (uint32_t)height };
+    payload.insert(payload.end(), image, image + level.size);
+    levels.push_back(level);
+
+    // A box filter on 8-bit values needs no floats, and rounds exactly like BuildMipChain
+    const bool hasAlpha = channels == 2 || channels == 4;
+    const bool coverage = settings.alphaCutoff > 0.0f && hasAlpha;
+    if (settings.filter == FILTER_BOX && !settings.srgb && !coverage)
+    {
+        if (levelMs)
+            levelMs->push_back(milliseconds(start));
+        while (level.width > 1 || level.height > 1)
+        {
+            start = Clock::now();
+            const TextureLevel source = level;
+            level.width = std::max(source.width / 2, 1u);
+            level.height = std::max(source.height / 2, 1u);
+            level.offset = payload.size();
+            level.size = (uint64_t)level.width * level.height * channels;
+            payload.resize(payload.size() + level.size);
+
+            // Bands of destination rows, each from its own pair of source rows
+            const uint8_t* src = payload.data() + source.offset;
+            uint8_t* dst = payload.data() + level.offset;
+            ForEachTile(tileCount(level.height), settings.threadCount, settings.pool, [&](int band)
+            {
+                const uint32_t firstRow = band * MIP_TILE_SIZE, endRow = std::min(firstRow + MIP_TILE_SIZE, level.height);
+                const uint32_t sourceRows = std::min((endRow - firstRow) * 2, source.height - firstRow * 2);
+                DownsampleBox(src + (size_t)firstRow * 2 * source.width * channels, source.width, sourceRows, channels,
+                    dst + (size_t)firstRow * level.width * channels);
+            });
+            levels.push_back(level);
+            if (levelMs)
+                levelMs->push_back(milliseconds(start));
+        }
+        return;
+    }
+
+    std::vector<float> current((size_t)width * height * channels);
+    ForEachTile(tileCount(height), settings.threadCount, settings.pool, [&](int band)
+    {
+        const size_t first = (size_t)band * MIP_TILE_SIZE * width, end = std::min((size_t)(band + 1) * MIP_TILE_SIZE, (size_t)height) * width;
+        DecodeImage(image + first * channels, end - first, channels, settings.srgb, current.data() + first * channels);
+    });
+    const float targetCoverage = coverage ? AlphaCoverage(current.data(), (size_t)width * height, channels, settings.alphaCutoff) : 0.0f;
+    if (levelMs)
+        levelMs->push_back(milliseconds(start));
+
+    float weights[DOWNSAMPLE_TAPS];
+    DownsampleWeights(settings.filter, weights);
+    std::vector<float> rows, next;
+    while (level.width > 1 || level.height > 1)
+    {
+        start = Clock::now();
+        const int sourceWidth = (int)level.width, sourceHeight = (int)level.height;
+        const int newWidth = std::max(sourceWidth / 2, 1), newHeight = std::max(sourceHeight / 2, 1);
+        rows.resize((size_t)newWidth * sourceHeight * channels);
+        next.resize((size_t)newWidth * newHeight * channels);
+
+        // Rows first: each tile is a block of source rows and destination columns
+        const int rowTilesX = tileCount(newWidth);
+        ForEachTile(rowTilesX * tileCount(sourceHeight), settings.threadCount, settings.pool, [&](int tile)
+        {
+            const int firstX = tile % rowTilesX * MIP_TILE_SIZE, firstY = tile / rowTilesX * MIP_TILE_SIZE;
+            const int lineCount = std::min(MIP_TILE_SIZE, sourceHeight - firstY);
+            DownsampleAxis(current.data() + (size_t)firstY * sourceWidth * channels, sourceWidth, lineCount, channels, (size_t)sourceWidth * channels,
+                channels, weights, rows.data() + (size_t)firstY * newWidth * channels, channels, (size_t)newWidth * channels,
+                firstX, std::min(firstX + MIP_TILE_SIZE, newWidth));
+        });
+
+        // Then columns: each tile is a block of columns and destination rows
+        const int columnTilesX = tileCount(newWidth);
+        ForEachTile(columnTilesX * tileCount(newHeight), settings.threadCount, settings.pool, [&](int tile)
+        {
+            const int firstX = tile % columnTilesX * MIP_TILE_SIZE, firstY = tile / columnTilesX * MIP_TILE_SIZE;
+            const int lineCount = std::min(MIP_TILE_SIZE, newWidth - firstX);
+            DownsampleAxis(rows.data() + (size_t)firstX * channels, sourceHeight, lineCount, (size_t)newWidth * channels, channels,
+                channels, weights, next.data() + (size_t)firstX * channels, (size_t)newWidth * channels, channels,
+                firstY, std::min(firstY + MIP_TILE_SIZE, newHeight));
+        });
+
+        const float alphaScale = coverage ? CoverageScale(next.data(), (size_t)newWidth * newHeight, channels, settings.alphaCutoff, targetCoverage) : 1.0f;
+
+        level.width = newWidth;
+        level.height = newHeight;
+        level.offset = payload.size();
+        level.size = (uint64_t)level.width * level.height * channels;
+        payload.resize(payload.size() + level.size);
+
+        // Back to bytes in bands of rows, scaling alpha on a copy so the next level filters the real one
+        uint8_t* dst = payload.data() + level.offset;
+        ForEachTile(tileCount(newHeight), settings.threadCount, settings.pool, [&](int band)
+        {
+            const size_t first = (size_t)band * MIP_TILE_SIZE * newWidth, end = std::min((size_t)(band + 1) * MIP_TILE_SIZE, (size_t)newHeight) * newWidth;
+            const float* texels = next.data() + first * channels;
+            std::vector<float> scaled;
+            if (alphaScale != 1.0f)
+            {
+                scaled.assign(texels, texels + (end - first) * channels);
+                for (size_t i = channels - 1; i < scaled.size(); i += channels)
+                    scaled[i] *= alphaScale;
+                texels = scaled.data();
+            }
+            EncodeImage(texels, end - first, channels, settings.srgb, dst + first * channels);
+        });
+
+        levels.push_back(level);
+        current.swap(next);
+        if (levelMs)
+            levelMs->push_back(milliseconds(start));
+    }
+}
+
+#endif
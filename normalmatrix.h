@@ -0,0 +1,157 @@
+#ifndef NORMALMATRIX_H
+#define NORMALMATRIX_H
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NORMALMATRIX_SSE 1
+#endif
+
+// Relative tolerance for treating a matrix as a rotation times one scale factor
+const float NORMAL_MATRIX_UNIFORM_TOLERANCE = 1e-4f;
+
+// Normal matrix (inverse transpose of the upper 3x3) of one column major 4x4 matrix, written as three
+// columns padded to four floats, the std430 layout of a mat3. When the columns are orthogonal and of equal
+// length the matrix is a rotation scaled by s, whose inverse transpose is the matrix itself over s^2, so
+// no inverse is needed. Otherwise the columns of the inverse transpose are the cross products of the
+// other two columns over the determinant. Returns true when the fast path was taken.
+inline bool ComputeNormalMatrix(const float* model, float* normalMatrix)
+{
+    const float* c0 = model;
+    const float* c1 = model + 4;
+    const float* c2 = model + 8;
+
+    const float length0 = c0[0] * c0[0] + c0[1] * c0[1] + c0[2] * c0[2];
+    const float length1 = c1[0] * c1[0] + c1[1] * c1[1] + c1[2] * c1[2];
+    const float length2 = c2[0] * c2[0] + c2[1] * c2[1] + c2[2] * c2[2];
+    const float dot01 = c0[0] * c1[0] + c0[1] * c1[1] + c0[2] * c1[2];
+    const float dot12 = c1[0] * c2[0] + c1[1] * c2[1] + c1[2] * c2[2];
+    const float dot20 = c2[0] * c0[0] + c2[1] * c0[1] + c2[2] * c0[2];
+    const float tolerance = NORMAL_MATRIX_UNIFORM_TOLERANCE * length0;
+
+    if (std::fabs(length1 - length0) <= tolerance && std::fabs(length2 - length0) <= tolerance
+        && std::fabs(dot01) <= tolerance && std::fabs(dot12) <= tolerance && std::fabs(dot20) <= tolerance && length0 > 0.0f)
+    {
+        const float invScale2 = 1.0f / length0;
+        for (int column = 0; column < 3; ++column)
+        {
+            for (int row = 0; row < 3; ++row)
+                normalMatrix[column * 4 + row] = model[column * 4 + row] * invScale2;
+            normalMatrix[column * 4 + 3] = 0.0f;
+        }
+        return true;
+    }
+
+    const float* columns[3] = { c0, c1, c2 };
+    const float determinant = c0[0] * (c1[1] * c2[2] - c1[2] * c2[1]) + c0[1] * (c1[2] * c2[0] - c1[0] * c2[2]) + c0[2] * (c1[0] * c2[1] - c1[1] * c2[0]);
+    const float invDeterminant = determinant != 0.0f ? 1.0f / determinant : 0.0f;
+    for (int column = 0; column < 3; ++column)
+    {
+        const float* a = columns[(column + 1) % 3];
+        const float* b = columns[(column + 2) % 3];
+        normalMatrix[column * 4 + 0] = (a[1] * b[2] - a[2] * b[1]) * invDeterminant;
+        normalMatrix[column * 4 + 1] = (a[2] * b[0] - a[0] * b[2]) * invDeterminant;
+        normalMatrix[column * 4 + 2] = (a[0] * b[1] - a[1] * b[0]) * invDeterminant;
+        normalMatrix[column * 4 + 3] = 0.0f;
+    }
+    return false;
+}
+
+// Normal matrices of count column major 4x4 matrices, as ComputeNormalMatrix would write them. With SSE
+// four matrices are transposed into one register per element and go through the same math side by side;
+// a group whose four matrices are all uniformly scaled skips the cofactors. Returns how many matrices took
+// the uniform scale path.
+inline size_t ComputeNormalMatrices(const float* models, float* normalMatrices, size_t count)
+{
+    size_t uniformCount = 0;
+    size_t i = 0;
+
+#ifdef NORMALMATRIX_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 relativeTolerance = _mm_set1_ps(NORMAL_MATRIX_UNIFORM_TOLERANCE);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        // m[column][row] holds that element of all four matrices
+        __m128 m[3][4];
+        for (int column = 0; column < 3; ++column)
+        {
+            m[column][0] = _mm_loadu_ps(models + (i + 0) * 16 + column * 4);
+            m[column][1] = _mm_loadu_ps(models + (i + 1) * 16 + column * 4);
+            m[column][2] = _mm_loadu_ps(models + (i + 2) * 16 + column * 4);
+            m[column][3] = _mm_loadu_ps(models + (i + 3) * 16 + column * 4);
+            _MM_TRANSPOSE4_PS(m[column][0], m[column][1], m[column][2], m[column][3]);
+        }
+
+        auto dot = [&](int a, int b)
+        {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[a][0], m[b][0]), _mm_mul_ps(m[a][1], m[b][1])), _mm_mul_ps(m[a][2], m[b][2]));
+        };
+        auto within = [&](__m128 value, __m128 tolerance) { return _mm_cmple_ps(_mm_and_ps(value, absMask), tolerance); };
+
+        const __m128 length0 = dot(0, 0);
+        const __m128 tolerance = _mm_mul_ps(relativeTolerance, length0);
+        __m128 uniform = _mm_and_ps(within(_mm_sub_ps(dot(1, 1), length0), tolerance), within(_mm_sub_ps(dot(2, 2), length0), tolerance));
+        uniform = _mm_and_ps(uniform, _mm_and_ps(within(dot(0, 1), tolerance), _mm_and_ps(within(dot(1, 2), tolerance), within(dot(2, 0), tolerance))));
+        uniform = _mm_and_ps(uniform, _mm_cmpgt_ps(length0, zero));
+        const int uniformMask = _mm_movemask_ps(uniform);
+
+        __m128 n[3][4];
+        const __m128 invScale2 = _mm_div_ps(one, _mm_max_ps(length0, _mm_set1_ps(1e-30f)));
+        for (int column = 0; column < 3; ++column)
+        {
+            for (int row = 0; row < 3; ++row)
+                n[column][row] = _mm_mul_ps(m[column][row], invScale2);
+            n[column][3] = zero;
+        }
+
+        if (uniformMask != 0xf)
+        {
+            __m128 cofactor[3][3];
+            for (int column = 0; column < 3; ++column)
+            {
+                const __m128* a = m[(column + 1) % 3];
+                const __m128* b = m[(column + 2) % 3];
+                cofactor[column][0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+                cofactor[column][1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+                cofactor[column][2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+            }
+
+            // det = c0 . (c1 x c2), which is column 0 of the cofactors
+            const __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0][0], cofactor[0][0]), _mm_mul_ps(m[0][1], cofactor[0][1])), _mm_mul_ps(m[0][2], cofactor[0][2]));
+            const __m128 singular = _mm_cmpeq_ps(determinant, zero);
+            const __m128 invDeterminant = _mm_andnot_ps(singular, _mm_div_ps(one, _mm_or_ps(determinant, _mm_and_ps(singular, one))));
+
+            for (int column = 0; column < 3; ++column)
+            {
+                for (int row = 0; row < 3; ++row)
+                {
+                    const __m128 general = _mm_mul_ps(cofactor[column][row], invDeterminant);
+                    n[column][row] = _mm_or_ps(_mm_and_ps(uniform, n[column][row]), _mm_andnot_ps(uniform, general));
+                }
+            }
+        }
+
+        for (int column = 0; column < 3; ++column)
+        {
+            _MM_TRANSPOSE4_PS(n[column][0], n[column][1], n[column][2], n[column][3]);
+            for (int lane = 0; lane < 4; ++lane)
+                _mm_storeu_ps(normalMatrices + (i + lane) * 12 + column * 4, n[column][lane]);
+        }
+
+        for (int lane = 0; lane < 4; ++lane)
+            uniformCount += (uniformMask >> lane) & 1;
+    }
+#endif
+
+    for (; i < count; ++i)
+        uniformCount += ComputeNormalMatrix(models + i * 16, normalMatrices + i * 12);
+
+    return uniformCount;
+}
+
+#endif
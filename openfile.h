@@ -0,0 +1,20 @@
+#ifndef OPENFILE_H
+#define OPENFILE_H
+
+#include <cstdio>
+
+// fopen, through fopen_s on MSVC, where the project's SDL checks make plain fopen an error. Returns nullptr
+// when the file cannot be opened.
+inline FILE* OpenFile(const char* path, const char* mode)
+{
+#ifdef _MSC_VER
+    FILE* file = nullptr;
+    if (fopen_s(&file, path, mode) != 0)
+        file = nullptr;
+    return file;
+#else
+    return fopen(path, mode);
+#endif
+}
+
+#endif
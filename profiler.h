@@ -0,0 +1,378 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Frame profiler: nestable CPU scopes on any thread and GPU scopes on the context thread, recorded into one
+// lock-free ring and exported as Chrome trace JSON (chrome://tracing or ui.perfetto.dev). Everything is
+// used through the PROFILE_ macros at the bottom, which expand to nothing when PROFILER_ENABLED is 0, so a
+// build without the profiler carries no trace of it.
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+#if PROFILER_ENABLED
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gpuresources.h"
+#include "openfile.h"
+
+// One finished scope. Names are not copied, so they must live as long as the program, like literals do.
+struct ProfileEvent
+{
+    const char* name;
+    uint64_t startNs;       // On the steady clock, GPU scopes included
+    uint64_t durationNs;
+    uint32_t thread;
+    uint32_t depth;         // Enclosing scopes open on the same thread
+};
+
+// Ring of the most recent events that any number of threads append to without a lock. Writers claim a slot
+// with one atomic increment. Each slot is a seqlock: its sequence is odd while a writer fills it and ends
+// at twice the event's index plus two, so a reader keeps only slots that held the same finished event
+// before and after it copied them. Old events are overwritten; the newest RING_SIZE are kept.
+class ProfileRing
+{
+public:
+    static const uint32_t RING_SIZE = 1 << 16;
+
+    void Push(const ProfileEvent& event)
+    {
+        const uint64_t index = mHead.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = mSlots[index & (RING_SIZE - 1)];
+        slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store((uintptr_t)event.name, std::memory_order_relaxed);
+        slot.startNs.store(event.startNs, std::memory_order_relaxed);
+        slot.durationNs.store(event.durationNs, std::memory_order_relaxed);
+        slot.threadAndDepth.store((uint64_t)event.thread << 32 | event.depth, std::memory_order_relaxed);
+        slot.sequence.store(index * 2 + 2, std::memory_order_release);
+    }
+
+    // Copies the events still in the ring, oldest first
+    void Snapshot(std::vector<ProfileEvent>& events) const
+    {
+        const uint64_t head = mHead.load(std::memory_order_acquire);
+        const uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+        events.clear();
+        events.reserve((size_t)(head - first));
+        for (uint64_t index = first; index < head; ++index)
+        {
+            const Slot& slot = mSlots[index & (RING_SIZE - 1)];
+            const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != index * 2 + 2)
+                continue;
+
+            ProfileEvent event;
+            event.name = (const char*)slot.name.load(std::memory_order_relaxed);
+            event.startNs = slot.startNs.load(std::memory_order_relaxed);
+            event.durationNs = slot.durationNs.load(std::memory_order_relaxed);
+            const uint64_t threadAndDepth = slot.threadAndDepth.load(std::memory_order_relaxed);
+            event.thread = (uint32_t)(threadAndDepth >> 32);
+            event.depth = (uint32_t)threadAndDepth;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+                events.push_back(event);
+        }
+    }
+
+    uint64_t Pushed() const { return mHead.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence{ 0 };
+        std::atomic<uintptr_t> name{ 0 };
+        std::atomic<uint64_t> startNs{ 0 }, durationNs{ 0 }, threadAndDepth{ 0 };
+    };
+
+    std::atomic<uint64_t> mHead{ 0 };
+    Slot mSlots[RING_SIZE];
+};
+
+// GPU scopes are pairs of GL_TIMESTAMP queries, which unlike GL_TIME_ELAPSED can nest. Each frame has its
+// own pool, and a pool is read back when its frame comes around again, so the GPU has had
+// PROFILER_GPU_FRAMES - 1 frames to finish and reading never stalls. Results that are still not there
+// are dropped rather than waited for.
+const int PROFILER_GPU_FRAMES = 4;
+const int PROFILER_GPU_SCOPES_PER_FRAME = 128;
+
+class Profiler
+{
+public:
+    // Thread id shown for GPU scopes in the trace
+    static const uint32_t GPU_THREAD = 0xffff;
+
+    static Profiler& Instance()
+    {
+        static Profiler* profiler = new Profiler();   // Never destroyed, so scopes on exiting threads still work
+        return *profiler;
+    }
+
+    static uint64_t Now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Small id of the calling thread, in the order threads first recorded something
+    uint32_t ThreadId()
+    {
+        thread_local uint32_t id = mNextThread.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+
+    // Open scopes of the calling thread
+    static uint32_t& Depth()
+    {
+        thread_local uint32_t depth = 0;
+        return depth;
+    }
+
+    void Record(const char* name, uint64_t startNs, uint64_t endNs, uint32_t thread, uint32_t depth)
+    {
+        mRing.Push({ name, startNs, endNs - startNs, thread, depth });
+    }
+
+    // Names the calling thread in the trace; the name must outlive the program like scope names
+    void NameThread(const char* name)
+    {
+        const uint32_t id = ThreadId();
+        if (id < MAX_NAMED_THREADS)
+            mThreadNames[id].store((uintptr_t)name, std::memory_order_relaxed);
+    }
+
+    // GPU side, context thread only. The pools are created once the context exists and destroyed before it is.
+    void CreateGpuQueries()
+    {
+        for (GpuFrame& frame : mGpuFrames)
+        {
+            frame.queries.clear();
+            for (int i = 0; i < PROFILER_GPU_SCOPES_PER_FRAME * 2; ++i)
+                frame.queries.push_back(GpuQuery::Create("profiler timestamp"));
+            frame.scopes.clear();
+            frame.lastQuery = -1;
+        }
+        mGpuEnabled = true;
+    }
+
+    void DestroyGpuQueries()
+    {
+        for (GpuFrame& frame : mGpuFrames)
+        {
+            frame.queries.clear();
+            frame.scopes.clear();
+            frame.lastQuery = -1;
+        }
+        mGpuEnabled = false;
+    }
+
+    // Starts a frame: reads back the pool this frame reuses, then ties the GPU clock to the CPU one for
+    // the scopes about to be recorded
+    void BeginFrame()
+    {
+        if (!mGpuEnabled)
+            return;
+
+        mGpuFrameIndex = (mGpuFrameIndex + 1) % PROFILER_GPU_FRAMES;
+        GpuFrame& frame = mGpuFrames[mGpuFrameIndex];
+        ReadGpuFrame(frame);
+
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        frame.clockOffsetNs = (int64_t)Now() - gpuNow;
+        frame.scopes.clear();
+        frame.lastQuery = -1;
+        mGpuDepth = 0;
+    }
+
+    // Index of the scope to pass to EndGpuScope, or -1 when the pool of this frame is full
+    int BeginGpuScope(const char* name)
+    {
+        GpuFrame& frame = mGpuFrames[mGpuFrameIndex];
+        if (!mGpuEnabled || (int)frame.scopes.size() >= PROFILER_GPU_SCOPES_PER_FRAME)
+            return -1;
+
+        const int scope = (int)frame.scopes.size();
+        frame.scopes.push_back({ name, mGpuDepth++ });
+        frame.lastQuery = scope * 2;
+        glQueryCounter(frame.queries[frame.lastQuery], GL_TIMESTAMP);
+        return scope;
+    }
+
+    void EndGpuScope(int scope)
+    {
+        if (scope < 0)
+            return;
+        GpuFrame& frame = mGpuFrames[mGpuFrameIndex];
+        frame.lastQuery = scope * 2 + 1;
+        glQueryCounter(frame.queries[frame.lastQuery], GL_TIMESTAMP);
+        --mGpuDepth;
+    }
+
+    uint64_t DroppedGpuScopes() const { return mDroppedGpuScopes; }
+
+    // Writes every event in the ring as Chrome trace JSON: complete ("X") events in microseconds, one
+    // trace thread per recording thread plus one for the GPU
+    bool ExportChromeTrace(const char* path) const
+    {
+        std::vector<ProfileEvent> events;
+        mRing.Snapshot(events);
+        FILE* file = OpenFile(path, "w");
+        if (!file)
+            return false;
+
+        const uint64_t originNs = events.empty() ? 0 : events.front().startNs;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", GPU_THREAD);
+        for (uint32_t thread = 0; thread < MAX_NAMED_THREADS; ++thread)
+        {
+            const char* name = (const char*)mThreadNames[thread].load(std::memory_order_relaxed);
+            if (name)
+                fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", thread, Escape(name).c_str());
+        }
+        for (const ProfileEvent& event : events)
+        {
+            // GPU clock calibration can put a scope slightly before the first CPU event
+            const double start = ((int64_t)event.startNs - (int64_t)originNs) / 1000.0;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%u}}",
+                Escape(event.name).c_str(), event.thread == GPU_THREAD ? "gpu" : "cpu", event.thread, start, event.durationNs / 1000.0, event.depth);
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+    size_t EventCount() const
+    {
+        const uint64_t pushed = mRing.Pushed();
+        return (size_t)std::min<uint64_t>(pushed, ProfileRing::RING_SIZE);
+    }
+
+private:
+    static const uint32_t MAX_NAMED_THREADS = 64;
+
+    struct GpuScope
+    {
+        const char* name;
+        uint32_t depth;
+    };
+
+    struct GpuFrame
+    {
+        std::vector<GpuQuery> queries;      // Start and end timestamp of each scope
+        std::vector<GpuScope> scopes;
+        int lastQuery = -1;                 // Timestamp issued last, the end of the outermost scope when nested
+        int64_t clockOffsetNs = 0;          // Steady clock minus GPU clock when the frame began
+    };
+
+    void ReadGpuFrame(const GpuFrame& frame)
+    {
+        if (frame.scopes.empty() || frame.lastQuery < 0)
+            return;
+
+        // Timestamps finish in the order they were issued, so the last one issued being there means they
+        // all are
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            mDroppedGpuScopes += frame.scopes.size();
+            return;
+        }
+
+        for (size_t scope = 0; scope < frame.scopes.size(); ++scope)
+        {
+            GLuint64 start = 0, end = 0;
+            glGetQueryObjectui64v(frame.queries[scope * 2], GL_QUERY_RESULT, &start);
+            glGetQueryObjectui64v(frame.queries[scope * 2 + 1], GL_QUERY_RESULT, &end);
+            Record(frame.scopes[scope].name, start + frame.clockOffsetNs, end + frame.clockOffsetNs, GPU_THREAD, frame.scopes[scope].depth);
+        }
+    }
+
+    static std::string Escape(const char* text)
+    {
+        std::string escaped;
+        for (; *text; ++text)
+        {
+            if (*text == '"' || *text == '\\')
+                escaped += '\\';
+            escaped += *text;
+        }
+        return escaped;
+    }
+
+    ProfileRing mRing;
+    std::atomic<uint32_t> mNextThread{ 0 };
+    std::atomic<uintptr_t> mThreadNames[MAX_NAMED_THREADS] = {};
+
+    // Context thread only
+    GpuFrame mGpuFrames[PROFILER_GPU_FRAMES];
+    int mGpuFrameIndex = 0;
+    uint32_t mGpuDepth = 0;
+    bool mGpuEnabled = false;
+    uint64_t mDroppedGpuScopes = 0;
+};
+
+// Times the enclosing block on the calling thread
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* name) : mName(name), mDepth(Profiler::Depth()++), mStartNs(Profiler::Now()) {}
+    ~ProfileScope()
+    {
+        const uint64_t endNs = Profiler::Now();
+        --Profiler::Depth();
+        Profiler& profiler = Profiler::Instance();
+        profiler.Record(mName, mStartNs, endNs, profiler.ThreadId(), mDepth);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    const char* mName;
+    uint32_t mDepth;
+    uint64_t mStartNs;
+};
+
+// Times the GL commands issued in the enclosing block, on the context thread
+class GpuProfileScope
+{
+public:
+    explicit GpuProfileScope(const char* name) : mScope(Profiler::Instance().BeginGpuScope(name)) {}
+    ~GpuProfileScope() { Profiler::Instance().EndGpuScope(mScope); }
+
+    GpuProfileScope(const GpuProfileScope&) = delete;
+    GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+
+private:
+    int mScope;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+#define PROFILE_THREAD(name) Profiler::Instance().NameThread(name)
+#define PROFILE_FRAME() Profiler::Instance().BeginFrame()
+#define PROFILE_CREATE_GPU() Profiler::Instance().CreateGpuQueries()
+#define PROFILE_DESTROY_GPU() Profiler::Instance().DestroyGpuQueries()
+#define PROFILE_EXPORT(path) Profiler::Instance().ExportChromeTrace(path)
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#define PROFILE_THREAD(name)
+#define PROFILE_FRAME()
+#define PROFILE_CREATE_GPU()
+#define PROFILE_DESTROY_GPU()
+#define PROFILE_EXPORT(path) false
+
+#endif
+
+#endif
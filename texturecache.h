@@ -0,0 +1,212 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "imagekernels.h"
+#include "openfile.h"
+
+// Cooked texture container: a header, a table of mip levels and the payload holding every level in the
+// final GL format, ready to upload without decoding. The header keeps a hash of the source file's bytes,
+// so an entry whose source changed is detected and cooked again.
+const char COOKED_TEXTURE_MAGIC[4] = { 'G', 'V', 'T', 'X' };
+const uint32_t COOKED_TEXTURE_VERSION = 2;
+
+// One level of a mip chain inside a contiguous payload
+struct TextureLevel
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct CookedTextureHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t internalFormat;    // GL enums, stored as numbers so this file does not need the GL headers
+    uint32_t format;
+    uint32_t channels;
+    uint32_t blockBytes;        // Bytes per 4x4 block of a compressed format, 0 for uncompressed levels
+    uint32_t levelCount;
+    uint32_t reserved;
+    uint64_t payloadSize;
+};
+
+// 64-bit FNV-1a over a whole buffer. Passing the hash of one buffer as the seed continues it over the next.
+inline uint64_t HashBytes(const unsigned char* bytes, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+inline bool ReadWholeFile(const char* path, std::vector<unsigned char>& bytes)
+{
+    FILE* file = OpenFile(path, "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    bytes.resize(size > 0 ? (size_t)size : 0);
+    const bool read = size > 0 && fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+    return read;
+}
+
+// Creates a directory, succeeding when it already exists
+inline bool MakeDirectory(const char* path)
+{
+#ifdef _WIN32
+    return _mkdir(path) == 0 || errno == EEXIST;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Copies an 8-bit image into another channel count. Grey expands to RGB, RGB drops to grey by its first
+// channel, and alpha is kept when both sides have it and opaque otherwise.
+inline void ConvertChannels(const unsigned char* image, size_t texelCount, int channels, unsigned char* converted, int newChannels)
+{
+    if (channels == 3 && newChannels == 4)
+    {
+        ExpandRgbToRgba(image, texelCount, converted);
+        return;
+    }
+
+    const int colors = channels >= 3 ? 3 : 1, newColors = newChannels >= 3 ? 3 : 1;
+    const bool alpha = channels == 2 || channels == 4, newAlpha = newChannels == 2 || newChannels == 4;
+    for (size_t i = 0; i < texelCount; ++i)
+    {
+        const unsigned char* texel = image + i * channels;
+        unsigned char* out = converted + i * newChannels;
+        for (int c = 0; c < newColors; ++c)
+            out[c] = texel[std::min(c, colors - 1)];
+        if (newAlpha)
+            out[newColors] = alpha ? texel[colors] : 255;
+    }
+}
+
+// Bilinear resample of an 8-bit image to another size, with texel centers mapped onto texel centers. Good
+// for the modest ratios between source images and texture array layers; large reductions would alias.
+inline void ResizeImage(const unsigned char* image, int width, int height, int channels, unsigned char* resized, int newWidth, int newHeight)
+{
+    const float scaleX = (float)width / newWidth, scaleY = (float)height / newHeight;
+    for (int y = 0; y < newHeight; ++y)
+    {
+        const float sourceY = std::min(std::max((y + 0.5f) * scaleY - 0.5f, 0.0f), (float)(height - 1));
+        const int y0 = (int)sourceY, y1 = std::min(y0 + 1, height - 1);
+        const float fy = sourceY - y0;
+        for (int x = 0; x < newWidth; ++x)
+        {
+            const float sourceX = std::min(std::max((x + 0.5f) * scaleX - 0.5f, 0.0f), (float)(width - 1));
+            const int x0 = (int)sourceX, x1 = std::min(x0 + 1, width - 1);
+            const float fx = sourceX - x0;
+            for (int c = 0; c < channels; ++c)
+            {
+                const float top = image[((size_t)y0 * width + x0) * channels + c] * (1.0f - fx) + image[((size_t)y0 * width + x1) * channels + c] * fx;
+                const float bottom = image[((size_t)y1 * width + x0) * channels + c] * (1.0f - fx) + image[((size_t)y1 * width + x1) * channels + c] * fx;
+                resized[((size_t)y * newWidth + x) * channels + c] = (unsigned char)(top + (bottom - top) * fy + 0.5f);
+            }
+        }
+    }
+}
+
+// Appends the full mip chain of an 8-bit image to payload, level 0 first. Each level is a DownsampleBox of
+// the one above.
+inline void BuildMipChain(const unsigned char* image, int width, int height, int channels, std::vector<unsigned char>& payload, std::vector<TextureLevel>& levels)
+{
+    TextureLevel level = { payload.size(), (uint64_t)width * height * channels, (uint32_t)width, (uint32_t)height };
+    payload.insert(payload.end(), image, image + level.size);
+    levels.push_back(level);
+
+    while (level.width > 1 || level.height > 1)
+    {
+        const TextureLevel source = level;
+        level.width = source.width > 1 ? source.width / 2 : 1;
+        level.height = source.height > 1 ? source.height / 2 : 1;
+        level.offset = payload.size();
+        level.size = (uint64_t)level.width * level.height * channels;
+        payload.resize(payload.size() + level.size);
+
+        DownsampleBox(payload.data() + source.offset, source.width, source.height, channels, payload.data() + level.offset);
+        levels.push_back(level);
+    }
+}
+
+// Writes header, level table and payload. The file is written under a name unique to the calling thread
+// and renamed, so a reader never sees a half written entry and two threads cooking the same source do not
+// write into one file.
+inline bool WriteCookedTexture(const std::string& path, CookedTextureHeader header, const std::vector<TextureLevel>& levels, const unsigned char* payload)
+{
+    memcpy(header.magic, COOKED_TEXTURE_MAGIC, sizeof(header.magic));
+    header.version = COOKED_TEXTURE_VERSION;
+    header.levelCount = (uint32_t)levels.size();
+    header.payloadSize = levels.empty() ? 0 : levels.back().offset + levels.back().size;
+
+    std::ostringstream temporaryPath;
+    temporaryPath << path << '.' << std::this_thread::get_id() << ".tmp";
+    const std::string temporary = temporaryPath.str();
+    FILE* file = OpenFile(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(levels.data(), sizeof(TextureLevel), levels.size(), file) == levels.size()
+        && fwrite(payload, 1, (size_t)header.payloadSize, file) == header.payloadSize;
+    written = fclose(file) == 0 && written;
+
+    std::remove(path.c_str());
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Checks a cooked file in memory against the hash of its source and points into its level table and payload
+inline bool ParseCookedTexture(const unsigned char* data, size_t size, uint64_t sourceHash, CookedTextureHeader& header,
+    const TextureLevel*& levels, const unsigned char*& payload)
+{
+    if (!data || size < sizeof(CookedTextureHeader))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, COOKED_TEXTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != COOKED_TEXTURE_VERSION
+        || header.sourceHash != sourceHash || header.levelCount == 0)
+        return false;
+
+    const size_t tableEnd = sizeof(CookedTextureHeader) + header.levelCount * sizeof(TextureLevel);
+    if (tableEnd > size || size - tableEnd != header.payloadSize)
+        return false;
+
+    levels = (const TextureLevel*)(data + sizeof(CookedTextureHeader));
+    payload = data + tableEnd;
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        if (levels[i].offset + levels[i].size > header.payloadSize)
+            return false;
+    }
+    return true;
+}
+
+#endif
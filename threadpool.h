@@ -0,0 +1,93 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running jobs in submission order. Jobs must not touch OpenGL; anything
+// that needs the context is handed back to the thread that owns it.
+class ThreadPool
+{
+public:
+    // Defaults to one thread per core, minus the one running the render loop. hardware_concurrency is 0
+    // when the core count is unknown, which counts as two cores here.
+    explicit ThreadPool(unsigned threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+        for (unsigned i = 0; i < threadCount; ++i)
+            mThreads.emplace_back([this]() { WorkerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mJobAvailable.notify_all();
+        for (std::thread& thread : mThreads)
+            thread.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+            ++mUnfinished;
+        }
+        mJobAvailable.notify_one();
+    }
+
+    // Blocks until every submitted job has finished
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mAllDone.wait(lock, [this]() { return mUnfinished == 0; });
+    }
+
+    unsigned Size() const { return (unsigned)mThreads.size(); }
+
+private:
+    void WorkerLoop()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mJobAvailable.wait(lock, [this]() { return mStopping || !mJobs.empty(); });
+                if (mJobs.empty())
+                    return;
+                job = std::move(mJobs.front());
+                mJobs.pop_front();
+            }
+
+            job();
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mUnfinished == 0)
+                mAllDone.notify_all();
+        }
+    }
+
+    std::vector<std::thread> mThreads;
+    std::deque<std::function<void()>> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mJobAvailable;
+    std::condition_variable mAllDone;
+    size_t mUnfinished = 0;
+    bool mStopping = false;
+};
+
+#endif